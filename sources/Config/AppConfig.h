@@ -73,7 +73,18 @@ ogram, e.g. puTTY, minicom, picocom or screen).                 \
 
   #define FIRMWARE_VERSION          PSTR(" * enstix v"VERSION" (compiled "FORMATTED_DATE")\r\n   (c) 2015 flabbergast")
 
+  /** Expose the encrypted disk as a second LUN (LUN 1), next to the VirtualFAT volume (LUN 0)?
+   *  LUN 1 has no medium until the disk is unlocked, so unlocking is just a media change.
+   *  Comment out to have a single LUN, which switches over from the VirtualFAT volume to the
+   *  encrypted disk when unlocking (and back when locking); that's a media change too, the host
+   *  is told with a UNIT ATTENTION. */
+  #define DUAL_LUN
+
+  #if defined(DUAL_LUN)
+  #define TOTAL_LUNS                2
+  #else
   #define TOTAL_LUNS                1
+  #endif
 
   /** Total number of bytes of the storage medium. */
   /** Only matters if using chip's flash for storage */
@@ -85,11 +96,90 @@ ogram, e.g. puTTY, minicom, picocom or screen).                 \
    */
   #define DISK_BLOCK_SIZE                   512
 
+  /** Logical block size of the encrypted disk, as reported to the host: DISK_BLOCK_SIZE, or a multiple of it
+   *  (4096, which is what modern filesystems use anyway). A logical block is encrypted as a whole: one ESSIV IV
+   *  and one CBC chain running through all of its sectors, so the IV is only computed once per logical block.
+   *  The disk image has to be encrypted the same way (scripts/encrypt-image.py --block-size).
+   *  The media, the sector buffers and the VirtualFAT volume stay at DISK_BLOCK_SIZE. */
+  #define ENCRYPTED_BLOCK_SIZE              DISK_BLOCK_SIZE
+  //#define ENCRYPTED_BLOCK_SIZE              4096
+
+  #define ENCRYPTED_BLOCK_SECTORS           (ENCRYPTED_BLOCK_SIZE / DISK_BLOCK_SIZE)
+
   /** Where does the disk image in flash begin?
    * WARNING!!! No checking is done! It needs to be further than the firmware code ends!
    * WARNING!!! BEGIN+SIZE needs to fit into the available flash (i.e. end below bootloader code)! */
   #define DISK_AREA_BEGIN_BYTE              0x6000
 
+  /** Number of sector buffers used by the READ(10)/WRITE(10) pipelines: while one sector is
+   *  being sent to (received from) the host, the others are read and decrypted (encrypted
+   *  and written). 1 means no overlap. They also hold the sectors read ahead (READ_AHEAD_SECTORS), so
+   *  the xmega has more of them (and a smaller read cache, for the same RAM). */
+  #if defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__)
+  #define DISK_SECTOR_BUFFERS               4
+  #else
+  #define DISK_SECTOR_BUFFERS               2
+  #endif
+
+  /** Sectors are read/decrypted (encrypted/written) in pieces of this many bytes, in between
+   *  servicing the USB endpoint. Needs to be a multiple of 16 (AES block) and divide DISK_BLOCK_SIZE. */
+  #define DISK_PIPELINE_CHUNK_BYTES         64
+
+  /** Long READ(10)/WRITE(10) transfers stop for the other USB interfaces (serial console, keyboard) after every
+   *  USB_SERVICE_SECTORS sectors, or after USB_SERVICE_INTERVAL (in 10ms units), whichever comes first; otherwise
+   *  they'd wait until the whole transfer is done. Smaller values mean less latency for them under disk load, at
+   *  some throughput cost (the time spent is reported with the performance counters, see LOG SENSE in SCSI.c). */
+  #define USB_SERVICE_SECTORS               32
+  #define USB_SERVICE_INTERVAL              2
+
+  /** How many sectors to read (and decrypt) ahead of a sequential stream of READ(10) commands, in
+   *  between the commands, at most. The actual depth follows how many of the sectors fetched ahead
+   *  the host wanted. The sectors are kept in the sector buffers, so this can be at most
+   *  DISK_SECTOR_BUFFERS; 0 disables read-ahead. */
+  #define READ_AHEAD_SECTORS                DISK_SECTOR_BUFFERS
+
+  /** Number of sectors kept by the write-back cache of the encrypted disk (at most 8; 0 disables
+   *  the cache). Each one costs DISK_BLOCK_SIZE bytes of RAM. Only WRITE(10) commands of at most
+   *  this many sectors go through the cache, bigger ones are written through. The cache works with
+   *  single sectors, so it's not used with bigger ENCRYPTED_BLOCK_SIZE (writing out a single sector
+   *  of a logical block would break the CBC chain of the rest of the block). The host build turns the
+   *  caches (and THIN_PROVISIONING) on with HOST_CACHES, to check them (see host/makefile). */
+  #if (defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__) || defined(HOST_CACHES)) && (ENCRYPTED_BLOCK_SECTORS == 1)
+  #define WRITE_CACHE_SECTORS               4
+  #else
+  #define WRITE_CACHE_SECTORS               0
+  #endif
+
+  /** The write-back cache is flushed after the disk was idle for this long (in 10ms units). */
+  #define WRITE_CACHE_FLUSH_DELAY           100
+
+  /** Number of decrypted sectors kept by the read cache of the encrypted disk (at most 8; 0 disables
+   *  the cache). Each one costs DISK_BLOCK_SIZE bytes of RAM. Only the sectors fetched by READ(10)
+   *  commands of at most this many sectors are kept, so that big reads don't push out the FAT and
+   *  directory sectors. Not used with bigger ENCRYPTED_BLOCK_SIZE, as no read is that small then.
+   *  Not on atmega32u4: its 2.5kB of RAM are taken by the two DISK_SECTOR_BUFFERS, the AES and hashing
+   *  contexts and LUFA, with hardly any left for the stack; not even one more sector fits. */
+  #if (defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__) || defined(HOST_CACHES)) && (ENCRYPTED_BLOCK_SECTORS == 1)
+  #define READ_CACHE_SECTORS                2
+  #else
+  #define READ_CACHE_SECTORS                0
+  #endif
+
+  /** Keep an allocation map of the encrypted disk at the end of the SD card (thin provisioning)? Sectors that were
+   *  never written (or were discarded, or written with zeros) read back as zeros without any SD card or AES work,
+   *  so a new card doesn't need to be provisioned with a whole encrypted image: creating the map (the 't' command)
+   *  is enough. The map takes 1 bit per sector plus one sector on the card, and DISK_BLOCK_SIZE bytes of RAM. A card
+   *  without a map works as before. Works with single sectors, so not with bigger ENCRYPTED_BLOCK_SIZE. */
+  #if defined(USE_SDCARD) && (defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__) || defined(HOST_CACHES)) && \
+      (ENCRYPTED_BLOCK_SECTORS == 1)
+  #define THIN_PROVISIONING
+  #endif
+
+  /** How long (in ms) hashing the passphrase should take: changing the passphrase (the 'c' command) times
+   *  PBKDF2 on the chip and sets its iteration count for this. Longer makes guessing the passphrase from
+   *  the EEPROM contents slower, and unlocking too. */
+  #define KDF_TARGET_MILLIS                 2000
+
   /** Compute some extra numbers from Config/AppConfig ones. */
   /** Total number of blocks of the virtual memory for reporting to the host as the device's total capacity. */
   #define VIRTUAL_DISK_BLOCKS              (VIRTUAL_DISK_BYTES / DISK_BLOCK_SIZE)
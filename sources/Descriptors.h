@@ -112,6 +112,19 @@
 			USB_Descriptor_Endpoint_t             MS_DataOutEndpoint;
 		} USB_Descriptor_Configuration_t;
 
+		/** Type define for the configuration descriptor of the "storage only" mode (see \ref usb_set_storage_only()),
+		 *  which only has the Mass Storage interface.
+		 */
+		typedef struct
+		{
+			USB_Descriptor_Configuration_Header_t Config;
+
+			// Mass Storage Interface
+			USB_Descriptor_Interface_t            MS_Interface;
+			USB_Descriptor_Endpoint_t             MS_DataInEndpoint;
+			USB_Descriptor_Endpoint_t             MS_DataOutEndpoint;
+		} USB_Descriptor_StorageConfiguration_t;
+
 		/** Enum for the device interface descriptor IDs within the device. Each interface descriptor
 		 *  should have a unique ID index associated with it, which can be used to refer to the
 		 *  interface from other descriptors.
@@ -124,6 +137,9 @@
 			INTERFACE_ID_MassStorage = 3, /**< Mass storage interface descriptor ID */
 		};
 
+		/** Mass storage interface descriptor ID in the "storage only" mode. */
+		#define INTERFACE_ID_StorageOnly_MassStorage  0
+
 		/** Enum for the device string descriptor IDs within the device. Each string descriptor should
 		 *  have a unique ID index associated with it, which can be used to refer to the string from
 		 *  other descriptors.
@@ -0,0 +1,331 @@
+/*
+ * DiskCache.c
+ * (c) 2015 flabbergast
+ *  Caches of (plaintext) sectors of the encrypted disk.
+ *
+ *  Write-back cache: small writes (FAT, directories) are kept in RAM and
+ *  only encrypted and written to the media when the cache fills up, on the
+ *  host's request (SYNCHRONIZE CACHE, FUA, eject), before disk state changes,
+ *  or after the disk was idle for a while. Repeated writes to the same sector
+ *  only cost a memcpy this way.
+ *
+ *  Read cache: the sectors fetched by small reads (boot sector, FAT,
+ *  directories, which hosts keep re-reading) are kept decrypted, least
+ *  recently used ones are dropped first. A hit saves reading the sector
+ *  from the media and decrypting it.
+ */
+
+#include "DiskCache.h"
+
+#include <string.h>
+
+#include "../Timer.h"
+#include "../enstix.h"
+
+#if (WRITE_CACHE_SECTORS > 8) || (READ_CACHE_SECTORS > 8)
+  #error "WRITE_CACHE_SECTORS and READ_CACHE_SECTORS can be at most 8."
+#endif
+
+/* Statistics */
+uint32_t DiskCache_Hits;
+uint32_t DiskCache_Misses;
+
+#if (WRITE_CACHE_SECTORS > 0) || (READ_CACHE_SECTORS > 0)
+/* Mark "Slot" as the most recently used one (age 0) among "Slots" slots */
+static void DiskCache_Touch(uint8_t* const Age, const uint8_t Slots, const uint8_t Slot)
+{
+  for (uint8_t i = 0; i < Slots; i++)
+  {
+    if ((i != Slot) && (Age[i] < Slots - 1))
+      Age[i]++;
+  }
+  Age[Slot] = 0;
+}
+#endif
+
+#if (WRITE_CACHE_SECTORS > 0)
+
+/* Write cache slots: a slot is in use if its bit in CacheUsed is set */
+static uint8_t  CacheData[WRITE_CACHE_SECTORS][DISK_BLOCK_SIZE];
+static uint32_t CacheSector[WRITE_CACHE_SECTORS];
+static uint8_t  CacheAge[WRITE_CACHE_SECTORS]; // 0 = most recently written
+static uint8_t  CacheUsed;
+
+/* When was the cache last written to (in millis10() units) */
+static uint32_t LastWriteTime;
+
+/* Writing out the cache failed while nobody was waiting for it (see DiskCache_Task) */
+static bool     DeferredError;
+
+/* Find the slot holding "Sector"; returns WRITE_CACHE_SECTORS if not cached */
+static uint8_t DiskCache_Find(const uint32_t Sector)
+{
+  for (uint8_t i = 0; i < WRITE_CACHE_SECTORS; i++)
+  {
+    if ((CacheUsed & (1 << i)) && (CacheSector[i] == Sector))
+      return i;
+  }
+
+  return WRITE_CACHE_SECTORS;
+}
+
+#endif
+
+#if (READ_CACHE_SECTORS > 0)
+
+/* Read cache slots: a slot is in use if its bit in ReadCacheUsed is set */
+static uint8_t  ReadCacheData[READ_CACHE_SECTORS][DISK_BLOCK_SIZE];
+static uint32_t ReadCacheSector[READ_CACHE_SECTORS];
+static uint8_t  ReadCacheAge[READ_CACHE_SECTORS]; // 0 = most recently used
+static uint8_t  ReadCacheUsed;
+
+/* Find the read cache slot holding "Sector"; returns READ_CACHE_SECTORS if not cached */
+static uint8_t DiskCache_ReadFind(const uint32_t Sector)
+{
+  for (uint8_t i = 0; i < READ_CACHE_SECTORS; i++)
+  {
+    if ((ReadCacheUsed & (1 << i)) && (ReadCacheSector[i] == Sector))
+      return i;
+  }
+
+  return READ_CACHE_SECTORS;
+}
+
+/* Put a copy of "Buffer", the contents of "Sector", into the read cache (dropping the least recently used sector if
+ * it's full); returns the slot */
+static uint8_t DiskCache_ReadKeep(const uint8_t* Buffer, const uint32_t Sector)
+{
+  uint8_t Slot = DiskCache_ReadFind(Sector);
+
+  if (Slot == READ_CACHE_SECTORS)
+  {
+    uint8_t Oldest = 0;
+
+    /* Take a free slot, or drop the least recently used one */
+    for (Slot = 0; Slot < READ_CACHE_SECTORS; Slot++)
+    {
+      if (!(ReadCacheUsed & (1 << Slot)))
+        break;
+      if (ReadCacheAge[Slot] > ReadCacheAge[Oldest])
+        Oldest = Slot;
+    }
+
+    if (Slot == READ_CACHE_SECTORS)
+      Slot = Oldest;
+
+    ReadCacheSector[Slot] = Sector;
+    ReadCacheUsed |= (1 << Slot);
+  }
+
+  memcpy(ReadCacheData[Slot], Buffer, DISK_BLOCK_SIZE);
+  DiskCache_Touch(ReadCacheAge, READ_CACHE_SECTORS, Slot);
+
+  return Slot;
+}
+
+#endif
+
+#if (WRITE_CACHE_SECTORS > 0)
+/* Encrypt and write out the sector in "Slot"; the slot is free afterwards, unless that failed. The sector gets
+ * encrypted in place, so its plaintext is copied aside first: into the read cache, where it's the latest contents
+ * of the sector, and from where it's restored if the write fails */
+static bool DiskCache_WriteOut(const uint8_t Slot)
+{
+  #if (READ_CACHE_SECTORS > 0)
+  uint8_t* Copy = ReadCacheData[DiskCache_ReadKeep(CacheData[Slot], CacheSector[Slot])];
+  #else
+  uint8_t  Copy[DISK_BLOCK_SIZE];
+
+  memcpy(Copy, CacheData[Slot], DISK_BLOCK_SIZE);
+  #endif
+
+  if (CALLBACK_disk_writeSector(CacheData[Slot], CacheSector[Slot]) != DISK_BLOCK_SIZE)
+  {
+    memcpy(CacheData[Slot], Copy, DISK_BLOCK_SIZE);
+    return false;
+  }
+
+  CacheUsed &= ~(1 << Slot);
+  return true;
+}
+#endif
+
+uint8_t* DiskCache_WriteBuffer(const uint32_t Sector)
+{
+#if (WRITE_CACHE_SECTORS > 0)
+  uint8_t Slot = DiskCache_Find(Sector);
+
+  if (Slot == WRITE_CACHE_SECTORS)
+  {
+    uint8_t Oldest = 0;
+
+    /* Take a free slot, or make room by writing out the oldest one */
+    for (Slot = 0; Slot < WRITE_CACHE_SECTORS; Slot++)
+    {
+      if (!(CacheUsed & (1 << Slot)))
+        break;
+      if (CacheAge[Slot] > CacheAge[Oldest])
+        Oldest = Slot;
+    }
+
+    if (Slot == WRITE_CACHE_SECTORS)
+    {
+      Slot = Oldest;
+      if (!DiskCache_WriteOut(Slot))
+        return NULL;
+    }
+
+    CacheSector[Slot] = Sector;
+    CacheUsed |= (1 << Slot);
+  }
+
+  /* The decrypted copy (if any) is outdated now */
+  #if (READ_CACHE_SECTORS > 0)
+  uint8_t ReadSlot = DiskCache_ReadFind(Sector);
+  if (ReadSlot != READ_CACHE_SECTORS)
+    ReadCacheUsed &= ~(1 << ReadSlot);
+  #endif
+
+  DiskCache_Touch(CacheAge, WRITE_CACHE_SECTORS, Slot);
+
+  LastWriteTime = millis10();
+
+  return CacheData[Slot];
+#else
+  return NULL;
+#endif
+}
+
+bool DiskCache_Read(uint8_t* Buffer, const uint32_t Sector)
+{
+#if (WRITE_CACHE_SECTORS > 0)
+  uint8_t Slot = DiskCache_Find(Sector);
+
+  if (Slot != WRITE_CACHE_SECTORS)
+  {
+    memcpy(Buffer, CacheData[Slot], DISK_BLOCK_SIZE);
+    DiskCache_Hits++;
+    return true;
+  }
+#endif
+
+#if (READ_CACHE_SECTORS > 0)
+  uint8_t ReadSlot = DiskCache_ReadFind(Sector);
+
+  if (ReadSlot != READ_CACHE_SECTORS)
+  {
+    memcpy(Buffer, ReadCacheData[ReadSlot], DISK_BLOCK_SIZE);
+    DiskCache_Touch(ReadCacheAge, READ_CACHE_SECTORS, ReadSlot);
+    DiskCache_Hits++;
+    return true;
+  }
+#endif
+
+  DiskCache_Misses++;
+  return false;
+}
+
+void DiskCache_Keep(const uint8_t* Buffer, const uint32_t Sector)
+{
+#if (READ_CACHE_SECTORS > 0)
+  DiskCache_ReadKeep(Buffer, Sector);
+#endif
+}
+
+void DiskCache_Discard(const uint32_t Sector, const uint16_t Count)
+{
+#if (WRITE_CACHE_SECTORS > 0)
+  for (uint8_t i = 0; i < WRITE_CACHE_SECTORS; i++)
+  {
+    if ((CacheSector[i] >= Sector) && (CacheSector[i] - Sector < Count))
+      CacheUsed &= ~(1 << i);
+  }
+#endif
+
+#if (READ_CACHE_SECTORS > 0)
+  for (uint8_t i = 0; i < READ_CACHE_SECTORS; i++)
+  {
+    if ((ReadCacheSector[i] >= Sector) && (ReadCacheSector[i] - Sector < Count))
+      ReadCacheUsed &= ~(1 << i);
+  }
+#endif
+}
+
+#if (WRITE_CACHE_SECTORS > 0)
+/* Write out all the cached sectors, in ascending order (that's the easiest for the card); the ones that fail stay */
+static bool DiskCache_WriteAll(void)
+{
+  uint8_t Left = CacheUsed;
+
+  while (Left)
+  {
+    uint8_t Lowest = WRITE_CACHE_SECTORS;
+
+    for (uint8_t i = 0; i < WRITE_CACHE_SECTORS; i++)
+    {
+      if ((Left & (1 << i)) && ((Lowest == WRITE_CACHE_SECTORS) || (CacheSector[i] < CacheSector[Lowest])))
+        Lowest = i;
+    }
+
+    Left &= ~(1 << Lowest);
+    DiskCache_WriteOut(Lowest);
+  }
+
+  return !CacheUsed;
+}
+#endif
+
+bool DiskCache_Flush(void)
+{
+#if (WRITE_CACHE_SECTORS > 0)
+  bool Success = DiskCache_WriteAll() && !DeferredError;
+
+  DeferredError = false;
+  return Success;
+#else
+  return true;
+#endif
+}
+
+bool DiskCache_Failed(void)
+{
+#if (WRITE_CACHE_SECTORS > 0)
+  bool Failed = DeferredError;
+
+  DeferredError = false;
+  return Failed;
+#else
+  return false;
+#endif
+}
+
+void DiskCache_Wipe(void)
+{
+#if (WRITE_CACHE_SECTORS > 0)
+  memset(CacheData, 0, sizeof(CacheData));
+  CacheUsed = 0;
+  DeferredError = false;
+#endif
+
+#if (READ_CACHE_SECTORS > 0)
+  memset(ReadCacheData, 0, sizeof(ReadCacheData));
+  ReadCacheUsed = 0;
+#endif
+}
+
+void DiskCache_Task(void (*Writing)(void))
+{
+#if (WRITE_CACHE_SECTORS > 0)
+  if (!CacheUsed || ((millis10() - LastWriteTime) < WRITE_CACHE_FLUSH_DELAY))
+    return;
+
+  /* If that fails, the sectors stay and it's tried again after another WRITE_CACHE_FLUSH_DELAY; the host hears about
+   * it from the next SYNCHRONIZE CACHE or FUA write (see DiskCache_Failed) */
+  Writing();
+  if (!DiskCache_WriteAll())
+  {
+    DeferredError = true;
+    LastWriteTime = millis10();
+  }
+#endif
+}
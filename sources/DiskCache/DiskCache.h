@@ -0,0 +1,60 @@
+/*
+ * DiskCache.h
+ * (c) 2015 flabbergast
+ *  Write-back and read caches of (plaintext) sectors of the encrypted disk:
+ *  header file.
+ */
+
+#ifndef _DISKCACHE_H_
+#define _DISKCACHE_H_
+
+  /* Includes: */
+    #include <stdint.h>
+    #include <stdbool.h>
+
+    #include "../Config/AppConfig.h"
+
+  /* Global Variables: */
+    // Number of sectors served by DiskCache_Read from the caches, and of those
+    //   that had to be fetched from the media.
+    extern uint32_t DiskCache_Hits;
+    extern uint32_t DiskCache_Misses;
+
+  /* Function Prototypes: */
+    // Get a buffer to receive the new contents of "Sector" into. Returns the
+    //   cached copy of the sector if there is one (so that repeated writes
+    //   merge), otherwise a free slot; the oldest slot is written out if needed.
+    //   Returns NULL if that fails. The slot holds the sector from now on, so
+    //   it should be filled completely (or DiskCache_Discard-ed).
+    uint8_t* DiskCache_WriteBuffer(const uint32_t Sector);
+
+    // Copy the cached contents of "Sector" into "Buffer"; false if not cached.
+    bool DiskCache_Read(uint8_t* Buffer, const uint32_t Sector);
+
+    // Keep a copy of the just read and decrypted "Sector" in the read cache
+    //   (dropping the least recently used one if it's full).
+    void DiskCache_Keep(const uint8_t* Buffer, const uint32_t Sector);
+
+    // Forget (without writing out) the cached copies of "Count" sectors
+    //   starting at "Sector"; e.g. because they're about to be overwritten.
+    void DiskCache_Discard(const uint32_t Sector, const uint16_t Count);
+
+    // Write out all the cached sectors. Returns false if any write failed
+    //   (those sectors stay cached, to be written out later), or if one
+    //   failed in the background since the last flush (see DiskCache_Failed).
+    bool DiskCache_Flush(void);
+
+    // Did writing out the cache in the background (DiskCache_Task) fail since
+    //   the last DiskCache_Flush or DiskCache_Failed? Clears that.
+    bool DiskCache_Failed(void);
+
+    // Erase all the cached plaintext from RAM. Anything not flushed is lost.
+    void DiskCache_Wipe(void);
+
+    // Should be called periodically: flushes the cache when the disk has
+    //   been idle for WRITE_CACHE_FLUSH_DELAY. A failure is remembered for
+    //   the next DiskCache_Flush or DiskCache_Failed. "Writing" is called
+    //   before that (the medium can't be in the middle of anything else).
+    void DiskCache_Task(void (*Writing)(void));
+
+#endif
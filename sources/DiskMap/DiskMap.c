@@ -0,0 +1,311 @@
+/*
+ * DiskMap.c
+ * (c) 2015 flabbergast
+ *  Allocation map of the encrypted disk (thin provisioning).
+ *
+ *  A sector of the SD card that was never written holds garbage (or
+ *  whatever was on the card), which decrypts to more garbage; that's why a
+ *  new card used to be provisioned by encrypting a whole (zeroed) image
+ *  onto it. With the map, one bit per sector tells whether the sector was
+ *  written: unmapped sectors read as zeros without touching the card or
+ *  AES, and writing zeros (or discarding) just clears the bit again.
+ *
+ *  Layout at the end of the card, encrypted like any other sector:
+ *    [ disk sectors | map sectors (DISK_BLOCK_SIZE * 8 bits each) | header ]
+ *  The header (the very last sector) holds MapMagic and the number of disk
+ *  sectors; if it doesn't decrypt to that, there's no map and the disk is
+ *  the whole card, like before.
+ *
+ *  One sector of the map is kept in RAM. Mapping a sector is written to
+ *  the card before the data is, so that data is never lost behind a clear
+ *  bit; clearing bits is written out lazily (on flush, or when another
+ *  sector of the map is needed).
+ */
+
+#include "DiskMap.h"
+
+#include <string.h>
+
+#include "../Timer.h"
+#include "../enstix.h"
+
+#if defined(THIN_PROVISIONING) && (ENCRYPTED_BLOCK_SECTORS != 1)
+  #error "THIN_PROVISIONING only works with ENCRYPTED_BLOCK_SIZE equal to DISK_BLOCK_SIZE."
+#endif
+
+#if defined(THIN_PROVISIONING)
+
+#define MAP_BITS_PER_SECTOR     ((uint32_t)DISK_BLOCK_SIZE * 8)
+#define MAP_NONE                0xFFFFFFFF
+
+static const uint8_t MapMagic[16] = "enstix map v1";
+
+static uint32_t DataSectors;   // sectors covered by the map (the disk); 0 if there's no map
+static uint8_t  MapData[DISK_BLOCK_SIZE];
+static uint32_t MapLoaded = MAP_NONE; // which sector of the map is in MapData
+static bool     MapDirty;
+
+/* When was the map last changed (in millis10() units) */
+static uint32_t LastChangeTime;
+
+/* Number of disk sectors if the media has "MediaSectors" in total */
+static uint32_t DiskMap_DataSectors(const uint32_t MediaSectors)
+{
+  uint32_t MapSectors = (MediaSectors + MAP_BITS_PER_SECTOR - 1) / MAP_BITS_PER_SECTOR;
+
+  return MediaSectors - MapSectors - 1;
+}
+
+/* Get sector "Index" of the map into MapData (writing out the current one if needed) */
+static bool DiskMap_Load(const uint32_t Index)
+{
+  if (MapLoaded == Index)
+    return true;
+
+  if (!DiskMap_Flush())
+    return false;
+
+  MapLoaded = MAP_NONE;
+  if (CALLBACK_disk_readSector(MapData, DataSectors + Index) != DISK_BLOCK_SIZE)
+    return false;
+
+  MapLoaded = Index;
+  return true;
+}
+
+/* Set the bits of "Count" sectors starting at "Sector" (all covered by the map) to "Mapped"; "Changed" tells whether
+ * any of them wasn't already */
+static bool DiskMap_Set(uint32_t Sector, uint32_t Count, const bool Mapped, bool* const Changed)
+{
+  *Changed = false;
+
+  while (Count)
+  {
+    uint16_t Bit = (Sector % MAP_BITS_PER_SECTOR);
+    uint8_t  Mask = (1 << (Bit % 8));
+
+    if (!DiskMap_Load(Sector / MAP_BITS_PER_SECTOR))
+      return false;
+
+    if (!(MapData[Bit / 8] & Mask) == Mapped)
+    {
+      MapData[Bit / 8] ^= Mask;
+      MapDirty = true;
+      *Changed = true;
+      LastChangeTime = millis10();
+    }
+
+    Sector++;
+    Count--;
+  }
+
+  return true;
+}
+
+#endif
+
+uint32_t DiskMap_Open(const uint32_t MediaSectors)
+{
+#if defined(THIN_PROVISIONING)
+  uint32_t Sectors = DiskMap_DataSectors(MediaSectors);
+
+  DiskMap_Close();
+
+  if ((MediaSectors <= MAP_BITS_PER_SECTOR) ||
+      (CALLBACK_disk_readSector(MapData, MediaSectors - 1) != DISK_BLOCK_SIZE) ||
+      memcmp(MapData, MapMagic, sizeof(MapMagic)) ||
+      (*(uint32_t*)&MapData[sizeof(MapMagic)] != Sectors))
+  {
+    memset(MapData, 0, sizeof(MapData));
+    return MediaSectors;
+  }
+
+  DataSectors = Sectors;
+  return DataSectors;
+#else
+  return MediaSectors;
+#endif
+}
+
+uint32_t DiskMap_Format(const uint32_t MediaSectors, void (*Idle)(void))
+{
+#if defined(THIN_PROVISIONING)
+  uint32_t Sectors = DiskMap_DataSectors(MediaSectors);
+
+  DiskMap_Close();
+
+  if (MediaSectors <= MAP_BITS_PER_SECTOR)
+    return 0;
+
+  /* The map first, the header last: if this gets interrupted, there's just no map */
+  for (uint32_t Sector = Sectors; Sector < MediaSectors - 1; Sector++)
+  {
+    memset(MapData, 0, sizeof(MapData)); // the previous one was encrypted in place
+    if (CALLBACK_disk_writeSector(MapData, Sector) != DISK_BLOCK_SIZE)
+      return 0;
+    Idle();
+  }
+
+  memset(MapData, 0, sizeof(MapData));
+  memcpy(MapData, MapMagic, sizeof(MapMagic));
+  *(uint32_t*)&MapData[sizeof(MapMagic)] = Sectors;
+  if (CALLBACK_disk_writeSector(MapData, MediaSectors - 1) != DISK_BLOCK_SIZE)
+    return 0;
+
+  DataSectors = Sectors;
+  return DataSectors;
+#else
+  return 0;
+#endif
+}
+
+bool DiskMap_Active(void)
+{
+#if defined(THIN_PROVISIONING)
+  return (DataSectors != 0);
+#else
+  return false;
+#endif
+}
+
+bool DiskMap_IsMapped(const uint32_t Sector)
+{
+#if defined(THIN_PROVISIONING)
+  uint16_t Bit = (Sector % MAP_BITS_PER_SECTOR);
+
+  /* Also the sectors of the map itself, which are read through the same callbacks */
+  if (Sector >= DataSectors)
+    return true;
+
+  if (!DiskMap_Load(Sector / MAP_BITS_PER_SECTOR))
+    return true;
+
+  return (MapData[Bit / 8] & (1 << (Bit % 8)));
+#else
+  return true;
+#endif
+}
+
+bool DiskMap_Map(const uint32_t Sector, const uint32_t Count)
+{
+#if defined(THIN_PROVISIONING)
+  bool Changed;
+
+  if (Sector >= DataSectors)
+    return true;
+
+  if (!DiskMap_Set(Sector, (Count < DataSectors - Sector) ? Count : (DataSectors - Sector), true, &Changed))
+    return false;
+
+  /* Only newly mapped sectors have to be on the medium first; cleared bits can wait */
+  return (!Changed || DiskMap_Flush());
+#else
+  return true;
+#endif
+}
+
+bool DiskMap_Unmap(const uint32_t Sector, const uint32_t Count)
+{
+#if defined(THIN_PROVISIONING)
+  bool Changed;
+
+  if ((Sector >= DataSectors) || (Count > DataSectors - Sector))
+    return false;
+
+  return DiskMap_Set(Sector, Count, false, &Changed);
+#else
+  return false;
+#endif
+}
+
+uint32_t DiskMap_Extent(const uint32_t Sector, const uint32_t Count, bool* const Mapped)
+{
+#if defined(THIN_PROVISIONING)
+  uint16_t Bit = (Sector % MAP_BITS_PER_SECTOR);
+  uint32_t Length = MAP_BITS_PER_SECTOR - Bit; // only as far as the end of this sector of the map
+  uint16_t End;
+
+  *Mapped = true;
+
+  if (Sector >= DataSectors)
+    return Count;
+
+  if (Length > Count)
+    Length = Count;
+  if (Length > DataSectors - Sector)
+    Length = DataSectors - Sector;
+  End = Bit + Length;
+
+  if (!DiskMap_Load(Sector / MAP_BITS_PER_SECTOR))
+    return (End - Bit);
+
+  *Mapped = (MapData[Bit / 8] & (1 << (Bit % 8)));
+
+  for (uint16_t i = Bit + 1; i < End; i++)
+  {
+    /* Skip whole bytes that match */
+    if (!(i % 8) && (End - i >= 8) && (MapData[i / 8] == (*Mapped ? 0xFF : 0x00)))
+    {
+      i += 7;
+      continue;
+    }
+
+    if (!(MapData[i / 8] & (1 << (i % 8))) == *Mapped)
+      return (i - Bit);
+  }
+
+  return (End - Bit);
+#else
+  *Mapped = true;
+  return Count;
+#endif
+}
+
+bool DiskMap_Flush(void)
+{
+#if defined(THIN_PROVISIONING)
+  bool Written;
+
+  if (!MapDirty)
+    return true;
+
+  /* The sector gets encrypted in place on the way to the medium (no room for a copy on the stack, this runs nested in
+   * the write pipeline): decrypt it back afterwards, it stays dirty if the write failed. If it can't be decrypted, the
+   * changes are lost unless they were written; the sector is read again when needed */
+  Written = (CALLBACK_disk_writeSector(MapData, DataSectors + MapLoaded) == DISK_BLOCK_SIZE);
+  if (!CALLBACK_disk_writeSector_restore())
+  {
+    MapLoaded = MAP_NONE;
+    MapDirty  = false;
+    return Written;
+  }
+
+  MapDirty = !Written;
+  return Written;
+#else
+  return true;
+#endif
+}
+
+void DiskMap_Close(void)
+{
+#if defined(THIN_PROVISIONING)
+  DataSectors = 0;
+  MapLoaded   = MAP_NONE;
+  MapDirty    = false;
+  memset(MapData, 0, sizeof(MapData));
+#endif
+}
+
+void DiskMap_Task(void (*Writing)(void))
+{
+#if defined(THIN_PROVISIONING)
+  if (!MapDirty || ((millis10() - LastChangeTime) < WRITE_CACHE_FLUSH_DELAY))
+    return;
+
+  /* If that fails, it's tried again after another WRITE_CACHE_FLUSH_DELAY (or on the next flush) */
+  Writing();
+  if (!DiskMap_Flush())
+    LastChangeTime = millis10();
+#endif
+}
@@ -0,0 +1,61 @@
+/*
+ * DiskMap.h
+ * (c) 2015 flabbergast
+ *  Allocation map of the encrypted disk (thin provisioning): header file.
+ */
+
+#ifndef _DISKMAP_H_
+#define _DISKMAP_H_
+
+  /* Includes: */
+    #include <stdint.h>
+    #include <stdbool.h>
+
+    #include "../Config/AppConfig.h"
+
+  /* Function Prototypes: */
+    // Look for the map at the end of the media ("MediaSectors" sectors; the
+    //   key has to be set up already). Returns the number of sectors left for
+    //   the disk: all of them if there's no map.
+    uint32_t DiskMap_Open(const uint32_t MediaSectors);
+
+    // Create a new map at the end of the media, with all the sectors
+    //   unmapped (so the whole disk reads as zeros). That's one write per
+    //   DISK_BLOCK_SIZE * 8 sectors; "Idle" is called in between. Returns the
+    //   number of sectors left for the disk, 0 if that failed.
+    uint32_t DiskMap_Format(const uint32_t MediaSectors, void (*Idle)(void));
+
+    // Is there a map (i.e. do unmapped sectors read back as zeros)?
+    bool DiskMap_Active(void);
+
+    // Was "Sector" written since it was last unmapped? true if there's no
+    //   map, or if the map can't be read.
+    bool DiskMap_IsMapped(const uint32_t Sector);
+
+    // Mark "Count" sectors starting at "Sector" as written; this goes to the
+    //   media right away if any of them wasn't mapped. Returns false if that
+    //   failed.
+    bool DiskMap_Map(const uint32_t Sector, const uint32_t Count);
+
+    // Mark "Count" sectors starting at "Sector" as unmapped (reading back as
+    //   zeros). Returns false if there's no map, the sectors aren't covered
+    //   by it, or the map can't be read.
+    bool DiskMap_Unmap(const uint32_t Sector, const uint32_t Count);
+
+    // Number of sectors (at least 1, at most "Count") starting at "Sector"
+    //   that are all mapped or all unmapped; which one goes into "Mapped".
+    uint32_t DiskMap_Extent(const uint32_t Sector, const uint32_t Count, bool* const Mapped);
+
+    // Write out the changes to the map. Returns false if that failed (the
+    //   changes are kept, to be written out later).
+    bool DiskMap_Flush(void);
+
+    // Forget the map (without writing anything out).
+    void DiskMap_Close(void);
+
+    // Should be called periodically: flushes the map when it hasn't changed
+    //   for WRITE_CACHE_FLUSH_DELAY. "Writing" is called before that (the
+    //   medium can't be in the middle of anything else).
+    void DiskMap_Task(void (*Writing)(void));
+
+#endif
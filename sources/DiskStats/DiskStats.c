@@ -0,0 +1,68 @@
+/*
+ * DiskStats.c
+ * (c) 2015 flabbergast
+ *  Performance counters of the encrypted disk: what was transferred, how
+ *  long it took, and where the time went (waiting for the card, AES).
+ *  They're cumulative since power up, and read by the host with LOG SENSE
+ *  (e.g. sg_logs), so that sticks can be monitored without the console.
+ */
+
+#include "DiskStats.h"
+
+#include "../Timer.h"
+
+DiskStats_t DiskStats;
+
+/* Account a command of "Count" sectors that took "Micros" */
+static void DiskStats_Latency(DiskStats_Latency_t* const Latency, const uint16_t Count, const uint32_t Micros)
+{
+  uint32_t PerSector = Micros / Count;
+
+  if (!Latency->MinMicros || (PerSector < Latency->MinMicros))
+    Latency->MinMicros = PerSector;
+  if (PerSector > Latency->MaxMicros)
+    Latency->MaxMicros = PerSector;
+
+  Latency->TotalMicros += Micros;
+}
+
+void DiskStats_Transfer(const bool IsRead, const uint16_t Count, const uint32_t StartTicks)
+{
+  uint32_t Micros = (timer_ticks() - StartTicks) * TIMER_TICK_MICROS;
+
+  if (!Count)
+    return;
+
+  if (IsRead)
+  {
+    DiskStats.SectorsRead += Count;
+    DiskStats_Latency(&DiskStats.ReadLatency, Count, Micros);
+  }
+  else
+  {
+    DiskStats.SectorsWritten += Count;
+    DiskStats_Latency(&DiskStats.WriteLatency, Count, Micros);
+  }
+}
+
+void DiskStats_AddTime(uint64_t* const Micros, const uint32_t StartTicks)
+{
+  *Micros += (timer_ticks() - StartTicks) * TIMER_TICK_MICROS;
+}
+
+uint32_t DiskStats_AverageMicros(const DiskStats_Latency_t* const Latency, uint32_t Sectors)
+{
+  uint64_t Total = Latency->TotalMicros;
+
+  if (!Sectors)
+    return 0;
+
+  /* Scale both down until a 32-bit division does (no need for the big 64-bit one) */
+  while (Total >> 32)
+  {
+    Total   >>= 1;
+    Sectors >>= 1;
+  }
+
+  return (Sectors ? (uint32_t)Total / Sectors : UINT32_MAX);
+}
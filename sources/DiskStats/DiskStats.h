@@ -0,0 +1,61 @@
+/*
+ * DiskStats.h
+ * (c) 2015 flabbergast
+ *  Performance counters of the encrypted disk (reported to the host
+ *  by the LOG SENSE command): header file.
+ */
+
+#ifndef _DISKSTATS_H_
+#define _DISKSTATS_H_
+
+  /* Includes: */
+    #include <stdint.h>
+    #include <stdbool.h>
+
+    #include "../Config/AppConfig.h"
+
+  /* Macros: */
+    // Number of SCSI commands counted separately (see SCSI_CountedCommands in SCSI.c).
+    #define DISK_STATS_COMMANDS 16
+
+  /* Type Defines: */
+    // Min/avg/max per-sector latency of READ (10) or WRITE (10) commands; the
+    //   latency of a command is its duration divided by its number of sectors.
+    typedef struct
+    {
+      uint32_t MinMicros;   // 0 until the first command
+      uint32_t MaxMicros;
+      uint64_t TotalMicros; // duration of all the commands
+    } DiskStats_Latency_t;
+
+    typedef struct
+    {
+      uint32_t SectorsRead;
+      uint32_t SectorsWritten;
+      uint64_t SpiBytesRead;     // ciphertext moved over SPI
+      uint64_t SpiBytesWritten;
+      uint64_t SdBusyMicros;     // spent in sd_raw waiting for the card
+      uint64_t AesMicros;        // spent encrypting/decrypting sectors (on the xmega: starting the
+                                 //   AES module and waiting for it, not its background work)
+      uint64_t YieldMicros;      // spent on the other USB interfaces during transfers
+      uint32_t Yields;
+      DiskStats_Latency_t ReadLatency;
+      DiskStats_Latency_t WriteLatency;
+      uint32_t Commands[DISK_STATS_COMMANDS + 1]; // to the encrypted disk; the last one counts all the other commands
+    } DiskStats_t;
+
+  /* Global Variables: */
+    extern DiskStats_t DiskStats;
+
+  /* Function Prototypes: */
+    // Count "Count" sectors transferred by a READ (10) or WRITE (10) command
+    //   that started at timer_ticks() "StartTicks".
+    void DiskStats_Transfer(const bool IsRead, const uint16_t Count, const uint32_t StartTicks);
+
+    // Add the time since timer_ticks() "StartTicks" to "Micros".
+    void DiskStats_AddTime(uint64_t* const Micros, const uint32_t StartTicks);
+
+    // Average of the per-sector latencies in "Latency" of "Sectors" sectors.
+    uint32_t DiskStats_AverageMicros(const DiskStats_Latency_t* const Latency, uint32_t Sectors);
+
+#endif
@@ -57,6 +57,8 @@
 #include <LUFA/Platform/Platform.h>
 
 #include "SCSI/SCSI.h"
+#include "DiskCache/DiskCache.h"
+#include "DiskMap/DiskMap.h"
 
 
 /** LUFA CDC Class driver interface configuration and state information. This structure is
@@ -186,6 +188,7 @@ void init(void)
   memset(usb_keyboard_current_keys_GLOBAL, 0, 6);
   usb_keyboard_current_modifier_GLOBAL = 0;
   usb_keyboard_sending_string_GLOBAL = false;
+  usb_storage_only_GLOBAL = false;
   disk_read_only_GLOBAL = true;
   disk_state_GLOBAL = DISK_STATE_INITIAL;
 
@@ -198,14 +201,67 @@ void init(void)
 void usb_tasks(void)
 {
   MS_Device_USBTask(&Disk_MS_Interface);
+  usb_tasks_others();
+  USB_USBTask();
+
+  static uint8_t prev_disk_state = DISK_STATE_INITIAL;
+  if(disk_state_GLOBAL == DISK_STATE_ENCRYPTING) {
+    // a sector being read ahead would be finished by their writes, its result lost
+    DiskCache_Task(SCSI_ReadAhead_Borrow);
+    DiskMap_Task(SCSI_ReadAhead_Borrow);
+    SCSI_ReadAhead_Task();
+  } else if(prev_disk_state == DISK_STATE_ENCRYPTING) {
+    DiskCache_Wipe(); // don't leave any decrypted data lying around
+    DiskMap_Close();
+  }
+  prev_disk_state = disk_state_GLOBAL;
+}
+
+void usb_tasks_others(void)
+{
+  if(usb_storage_only_GLOBAL)
+    return;
+
   CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
   HID_Device_USBTask(&Keyboard_HID_Interface);
-  USB_USBTask();
 
   if(usb_keyboard_sending_string_GLOBAL)
     usb_keyboard_service_write();
 }
 
+/*
+ * ** storage only mode **
+ */
+
+/* The serial and keyboard endpoints aren't configured in the storage only mode,
+ * so their endpoint memory is free: the disk endpoints get two banks each, the
+ * host can then send (receive) the next packet while the current one is being
+ * processed. The host only ever picks the first configuration, so the device
+ * re-enumerates with a different one (see Descriptors.c). The waits (for the
+ * host to notice the disconnect, and to enumerate the device again) go through
+ * usb_wait(), so that the enumeration is serviced as it happens. */
+void usb_set_storage_only(const bool storage_only)
+{
+  uint8_t banks = (storage_only ? 2 : 1);
+
+  DiskCache_Flush();
+  DiskMap_Flush();
+
+  USB_Disable();
+  usb_storage_only_GLOBAL = storage_only;
+  Disk_MS_Interface.Config.InterfaceNumber = (storage_only ? INTERFACE_ID_StorageOnly_MassStorage : INTERFACE_ID_MassStorage);
+  Disk_MS_Interface.Config.DataINEndpoint.Banks = banks;
+  Disk_MS_Interface.Config.DataOUTEndpoint.Banks = banks;
+  // forget the serial line settings (no DTR, nothing gets sent) and any keyboard output
+  memset(&VirtualSerial_CDC_Interface.State, 0, sizeof(VirtualSerial_CDC_Interface.State));
+  memset(&Disk_MS_Interface.State, 0, sizeof(Disk_MS_Interface.State));
+  usb_keyboard_send_current_data_GLOBAL = false;
+  usb_keyboard_sending_string_GLOBAL = false;
+  usb_wait(98); // 1s
+  USB_Init();
+  usb_wait(20); // 200ms
+}
+
 /*
  * ** usb_serial **
  */
@@ -220,12 +276,22 @@ int16_t usb_serial_getchar(void)
   return CDC_Device_ReceiveByte(&VirtualSerial_CDC_Interface);
 }
 
-void usb_serial_wait_for_key(void)
+/* Instead of a delay: the disk keeps working meanwhile (a SCSI command is only
+ * processed when usb_tasks() runs, so any delay would hold up the host) */
+void usb_wait(const uint8_t ticks)
 {
-  while(usb_serial_available() == 0) {
+  uint32_t start = millis10();
+
+  do {
     usb_tasks();
     service_button();
-    _delay_ms(10);
+  } while((millis10() - start) < ticks);
+}
+
+void usb_serial_wait_for_key(void)
+{
+  while(usb_serial_available() == 0) {
+    usb_wait(1);
   }
 }
 
@@ -318,9 +384,7 @@ uint16_t usb_serial_readline(char *buffer, const uint16_t buffer_size, const boo
           break;
       }
     }
-    usb_tasks();
-    service_button();
-    _delay_ms(10);
+    usb_wait(1);
   }
   return 0; // never reached
 }
@@ -411,11 +475,15 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 {
   bool ConfigSuccess = true;
 
-  ConfigSuccess &= HID_Device_ConfigureEndpoints(&Keyboard_HID_Interface);
-  ConfigSuccess &= CDC_Device_ConfigureEndpoints(&VirtualSerial_CDC_Interface);
+  if (!usb_storage_only_GLOBAL)
+  {
+    ConfigSuccess &= HID_Device_ConfigureEndpoints(&Keyboard_HID_Interface);
+    ConfigSuccess &= CDC_Device_ConfigureEndpoints(&VirtualSerial_CDC_Interface);
+  }
   ConfigSuccess &= MS_Device_ConfigureEndpoints(&Disk_MS_Interface);
 
-  USB_Device_EnableSOFEvents();
+  if (!usb_storage_only_GLOBAL)
+    USB_Device_EnableSOFEvents();
 
   LEDs_SetAllLEDs(ConfigSuccess ? LEDMASK_USB_READY : LEDMASK_USB_ERROR);
 }
@@ -423,8 +491,11 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 /** Event handler for the library USB Control Request reception event. */
 void EVENT_USB_Device_ControlRequest(void)
 {
-  CDC_Device_ProcessControlRequest(&VirtualSerial_CDC_Interface);
-  HID_Device_ProcessControlRequest(&Keyboard_HID_Interface);
+  if (!usb_storage_only_GLOBAL)
+  {
+    CDC_Device_ProcessControlRequest(&VirtualSerial_CDC_Interface);
+    HID_Device_ProcessControlRequest(&Keyboard_HID_Interface);
+  }
   MS_Device_ProcessControlRequest(&Disk_MS_Interface);
 }
 
@@ -446,7 +517,8 @@ bool CALLBACK_MS_Device_SCSICommandReceived(USB_ClassInfo_MS_Device_t* const MSI
 /** Event handler for the USB device Start Of Frame event. */
 void EVENT_USB_Device_StartOfFrame(void)
 {
-  HID_Device_MillisecondElapsed(&Keyboard_HID_Interface);
+  if (!usb_storage_only_GLOBAL)
+    HID_Device_MillisecondElapsed(&Keyboard_HID_Interface);
 }
 
 /* by flabbergast:
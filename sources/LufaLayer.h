@@ -54,6 +54,8 @@
     // --- basic functions ---
     void init(void);
     void usb_tasks(void);
+    void usb_tasks_others(void); // all but the Mass Storage one (which calls this during long transfers)
+    void usb_wait(const uint8_t ticks); // BLOCKING for "ticks" * 10/1024 sec (takes care of _tasks)
     // --- usb_serial ---
     uint16_t usb_serial_available(void); // number of getchars guaranteed to succeed immediately
     int16_t usb_serial_getchar(void); // negative values mean error in receiving (not connected or no input)
@@ -87,6 +89,13 @@
     // for sending longer text
     GLOBALS_EXTERN_LUFALAYER bool usb_keyboard_sending_string_GLOBAL;
 
+    // --- storage only mode ---
+    // re-enumerate as a Mass Storage device only (no serial, no keyboard), with the
+    //   endpoint memory of the other interfaces used to double bank the disk endpoints;
+    //   or back to the full composite device
+    void usb_set_storage_only(const bool storage_only);
+    GLOBALS_EXTERN_LUFALAYER bool usb_storage_only_GLOBAL;
+
     // --- buttons, LEDs and such ---
     uint32_t button_pressed_for(void); // for how long was the button pressed? (in 10/1024 sec; 0 if not pressed)
     void service_button(void); // should be called periodically to update the button state
@@ -48,13 +48,22 @@
 
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include <string.h>
 
 #include "../LufaLayer.h"
 #include "../Descriptors.h"
 #include "../VirtualFAT/VirtualFAT.h"
+#include "../DiskCache/DiskCache.h"
+#include "../DiskMap/DiskMap.h"
+#include "../DiskStats/DiskStats.h"
+#include "../Timer.h"
 #include "../Config/AppConfig.h"
 #include "../enstix.h"
 
+#if (READ_AHEAD_SECTORS > DISK_SECTOR_BUFFERS)
+  #error "READ_AHEAD_SECTORS can be at most DISK_SECTOR_BUFFERS."
+#endif
+
 /** Structure to hold the SCSI response data to a SCSI INQUIRY command. This gives information about the device's
  *  features and capabilities.
  */
@@ -96,6 +105,56 @@ static SCSI_Request_Sense_Response_t SenseData =
     .AdditionalLength    = 0x0A,
   };
 
+/** Sector buffers for transfers to/from the encrypted disk. */
+static uint8_t SectorBuffers[DISK_SECTOR_BUFFERS][DISK_BLOCK_SIZE];
+
+/** Read-ahead state: between commands, the sectors following a sequential stream of READ (10) commands are
+ *  fetched into \ref SectorBuffers, just as \ref SCSI_ReadSectors() would do it if the next command continues
+ *  the stream.
+ */
+static uint32_t ReadAheadAddress;  /**< Where the last READ (10) ended, i.e. where a sequential one starts */
+static uint16_t ReadAheadBlocks;   /**< Number of sectors to fetch ahead (0 if not reading ahead) */
+static uint16_t ReadAheadFetched;  /**< Number of sectors fetched ahead so far */
+static bool     ReadAheadActive;   /**< Fetch of the next sector in progress */
+static bool     ReadAheadFailed;   /**< Fetching ahead failed (it's retried by the READ (10) command) */
+static uint8_t  ReadAheadDepth;    /**< How far to read ahead; follows how many of the sectors fetched ahead were wanted */
+
+/** Sectors transferred, and the time (in millis10() units), since the other USB interfaces were last serviced by
+ *  \ref SCSI_Yield(). */
+static uint16_t YieldSectors;
+static uint32_t YieldTime;
+
+/** Number of bytes of the sector being fetched (by \ref SCSI_ReadSectors_Step()) that are decrypted already; they can
+ *  be sent to the host before the rest of the sector is done. */
+static uint16_t FetchedBytes;
+
+/** Pending UNIT ATTENTION conditions of each LUN (additional sense code and qualifier; 0 if none), see
+ *  \ref SCSI_Disk_Changed().
+ */
+static uint8_t UnitAttentionCode[TOTAL_LUNS];
+static uint8_t UnitAttentionQualifier[TOTAL_LUNS];
+
+/** The commands counted separately in the performance counters (the order of \c DiskStats.Commands). */
+static const uint8_t SCSI_CountedCommands[DISK_STATS_COMMANDS] =
+{
+  SCSI_CMD_TEST_UNIT_READY,
+  SCSI_CMD_REQUEST_SENSE,
+  SCSI_CMD_INQUIRY,
+  SCSI_CMD_MODE_SENSE_6,
+  SCSI_CMD_START_STOP_UNIT,
+  SCSI_CMD_SEND_DIAGNOSTIC,
+  SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL,
+  SCSI_CMD_READ_CAPACITY_10,
+  SCSI_CMD_READ_10,
+  SCSI_CMD_WRITE_10,
+  SCSI_CMD_VERIFY_10,
+  SCSI_CMD_SYNCHRONIZE_CACHE_10,
+  SCSI_CMD_WRITE_SAME_10,
+  SCSI_CMD_UNMAP,
+  SCSI_CMD_LOG_SENSE,
+  SCSI_CMD_SERVICE_ACTION_IN_16,
+};
+
 
 /** Main routine to process the SCSI command located in the Command Block Wrapper read from the host. This dispatches
  *  to the appropriate SCSI command handling routine if the issued command is supported by the device, else it returns
@@ -107,7 +166,40 @@ static SCSI_Request_Sense_Response_t SenseData =
  */
 bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 {
-  bool CommandSuccess = false;
+  bool    CommandSuccess = false;
+  uint8_t LUN            = MSInterfaceInfo->State.CommandBlock.LUN;
+
+  /* The performance counters are the encrypted disk's (not the VirtualFAT volume's, nor an empty LUN's) */
+  if (SCSI_LUN_Medium(MSInterfaceInfo) == LUN_MEDIUM_ENCRYPTED)
+    DiskStats.Commands[SCSI_CommandIndex(MSInterfaceInfo->State.CommandBlock.SCSICommandData[0])]++;
+
+  /* The other USB interfaces were just serviced by usb_tasks() */
+  YieldSectors = 0;
+  YieldTime    = millis10();
+
+  /* A pending UNIT ATTENTION fails any command but INQUIRY; REQUEST SENSE gets it as the sense data */
+  if (UnitAttentionCode[LUN] &&
+      (MSInterfaceInfo->State.CommandBlock.SCSICommandData[0] != SCSI_CMD_INQUIRY))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_UNIT_ATTENTION,
+                   UnitAttentionCode[LUN],
+                   UnitAttentionQualifier[LUN]);
+    UnitAttentionCode[LUN] = 0;
+
+    if (MSInterfaceInfo->State.CommandBlock.SCSICommandData[0] != SCSI_CMD_REQUEST_SENSE)
+      return false;
+  }
+
+  /* The encrypted disk's LUN has no medium until the disk is unlocked */
+  if ((SCSI_LUN_Medium(MSInterfaceInfo) == LUN_MEDIUM_NONE) &&
+      SCSI_NeedsMedium(MSInterfaceInfo->State.CommandBlock.SCSICommandData[0]))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_NOT_READY,
+                   SCSI_ASENSE_MEDIUM_NOT_PRESENT,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
 
   /* Run the appropriate SCSI command hander function based on the passed command */
   switch (MSInterfaceInfo->State.CommandBlock.SCSICommandData[0])
@@ -130,11 +222,29 @@ bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
     case SCSI_CMD_MODE_SENSE_6:
       CommandSuccess = SCSI_Command_ModeSense_6(MSInterfaceInfo);
       break;
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+      CommandSuccess = SCSI_Command_Synchronize_Cache_10(MSInterfaceInfo);
+      break;
+    case SCSI_CMD_SERVICE_ACTION_IN_16:
+      CommandSuccess = SCSI_Command_Service_Action_In_16(MSInterfaceInfo);
+      break;
+    case SCSI_CMD_UNMAP:
+      CommandSuccess = SCSI_Command_Unmap(MSInterfaceInfo);
+      break;
+    case SCSI_CMD_WRITE_SAME_10:
+      CommandSuccess = SCSI_Command_Write_Same_10(MSInterfaceInfo);
+      break;
+    case SCSI_CMD_LOG_SENSE:
+      CommandSuccess = SCSI_Command_Log_Sense(MSInterfaceInfo);
+      break;
     case SCSI_CMD_START_STOP_UNIT:
 #if !defined(NO_APP_START_ON_EJECT)
       /* If the user ejected the volume, signal bootloader exit at next opportunity. */
       //RunBootloader = ((MSInterfaceInfo->State.CommandBlock.SCSICommandData[4] & 0x03) != 0x02);
 #endif
+      /* Write out the cached data before the medium is stopped/ejected */
+      CommandSuccess = SCSI_Command_Synchronize_Cache_10(MSInterfaceInfo);
+      break;
     case SCSI_CMD_SEND_DIAGNOSTIC:
     case SCSI_CMD_TEST_UNIT_READY:
     case SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL:
@@ -164,6 +274,109 @@ bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
   return false;
 }
 
+/** Tells the host that the encrypted disk has changed: it was unlocked or locked (appeared in or disappeared from
+ *  its LUN, or replaced the VirtualFAT volume and the other way round), or its write protection has changed.
+ *  The next command to the LUN (but INQUIRY) fails with UNIT ATTENTION and the given additional sense code and
+ *  qualifier, so that the host re-reads the capacity and mode pages; this way no USB re-enumeration is needed.
+ *
+ *  Also forgets the sectors fetched ahead, and wipes the sector buffers.
+ *
+ *  \param[in] Acode  Additional sense code of the UNIT ATTENTION, e.g. \c SCSI_ASENSE_NOT_READY_TO_READY_CHANGE
+ *  \param[in] Aqual  Additional sense code qualifier of the UNIT ATTENTION
+ */
+void SCSI_Disk_Changed(const uint8_t Acode, const uint8_t Aqual)
+{
+  SCSI_ReadAhead_Cancel();
+  memset(SectorBuffers, 0, sizeof(SectorBuffers));
+
+  UnitAttentionCode[ENCRYPTED_DISK_LUN]      = Acode;
+  UnitAttentionQualifier[ENCRYPTED_DISK_LUN] = Aqual;
+}
+
+/** Determines what the LUN addressed by the current command presents to the host. With \c DUAL_LUN, LUN 0 is always the
+ *  VirtualFAT volume and LUN 1 the encrypted disk (once unlocked); otherwise the only LUN switches from the former to the
+ *  latter when unlocking.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return One of the \c LUN_MEDIUM_* values.
+ */
+static uint8_t SCSI_LUN_Medium(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+#if defined(DUAL_LUN)
+  if (MSInterfaceInfo->State.CommandBlock.LUN == 0)
+    return LUN_MEDIUM_VIRTUALFAT;
+
+  return (disk_state_GLOBAL == DISK_STATE_ENCRYPTING) ? LUN_MEDIUM_ENCRYPTED : LUN_MEDIUM_NONE;
+#else
+  return (disk_state_GLOBAL == DISK_STATE_ENCRYPTING) ? LUN_MEDIUM_ENCRYPTED : LUN_MEDIUM_VIRTUALFAT;
+#endif
+}
+
+/** Gives the number of (logical) blocks of a LUN's medium.
+ *
+ *  \param[in] Medium  What the LUN presents, see \ref SCSI_LUN_Medium()
+ *
+ *  \return Size of the medium, in blocks of \ref SCSI_LUN_BlockSize() bytes.
+ */
+static uint32_t SCSI_LUN_Blocks(const uint8_t Medium)
+{
+  if (Medium == LUN_MEDIUM_ENCRYPTED)
+    return disk_size_GLOBAL / ENCRYPTED_BLOCK_SECTORS;
+  else if (Medium == LUN_MEDIUM_VIRTUALFAT)
+    return VIRTUALFAT_LUN_MEDIA_BLOCKS;
+
+  return 0;
+}
+
+/** Gives the logical block size of a LUN's medium, as reported to the host: the encrypted disk's can be bigger
+ *  than a sector (\c ENCRYPTED_BLOCK_SIZE), the VirtualFAT volume's is always a sector.
+ *
+ *  \param[in] Medium  What the LUN presents, see \ref SCSI_LUN_Medium()
+ *
+ *  \return Logical block size in bytes.
+ */
+static uint16_t SCSI_LUN_BlockSize(const uint8_t Medium)
+{
+  return (Medium == LUN_MEDIUM_ENCRYPTED) ? ENCRYPTED_BLOCK_SIZE : VIRTUALFAT_SECTOR_SIZE_BYTES;
+}
+
+/** Determines if a LUN's medium is write protected: the VirtualFAT volume always is, the encrypted disk
+ *  depends on \ref disk_read_only_GLOBAL.
+ *
+ *  \param[in] Medium  What the LUN presents, see \ref SCSI_LUN_Medium()
+ *
+ *  \return Boolean \c true if the medium can't be written to, \c false otherwise.
+ */
+static bool SCSI_LUN_ReadOnly(const uint8_t Medium)
+{
+  return (Medium != LUN_MEDIUM_ENCRYPTED) || disk_read_only_GLOBAL;
+}
+
+/** Determines if a SCSI command accesses the medium, i.e. has to fail on a LUN with no medium.
+ *
+ *  \param[in] Command  SCSI command opcode
+ *
+ *  \return Boolean \c true if the command needs the medium, \c false otherwise.
+ */
+static bool SCSI_NeedsMedium(const uint8_t Command)
+{
+  switch (Command)
+  {
+    case SCSI_CMD_TEST_UNIT_READY:
+    case SCSI_CMD_READ_CAPACITY_10:
+    case SCSI_CMD_SERVICE_ACTION_IN_16:
+    case SCSI_CMD_READ_10:
+    case SCSI_CMD_WRITE_10:
+    case SCSI_CMD_VERIFY_10:
+    case SCSI_CMD_WRITE_SAME_10:
+    case SCSI_CMD_UNMAP:
+      return true;
+    default:
+      return false;
+  }
+}
+
 /** Command processing for an issued SCSI INQUIRY command. This command returns information about the device's features
  *  and capabilities to the host.
  *
@@ -176,6 +389,10 @@ static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInf
   uint16_t AllocationLength  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[3]);
   uint16_t BytesTransferred  = MIN(AllocationLength, sizeof(InquiryData));
 
+  /* Vital Product Data pages are dealt with separately */
+  if (MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] == SCSI_EVPD_BIT)
+    return SCSI_Command_Inquiry_VPD(MSInterfaceInfo);
+
   /* Only the standard INQUIRY data is supported, check if any optional INQUIRY bits set */
   if ((MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & ((1 << 0) | (1 << 1))) ||
        MSInterfaceInfo->State.CommandBlock.SCSICommandData[2])
@@ -202,6 +419,86 @@ static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInf
   return true;
 }
 
+/** Command processing for an issued SCSI INQUIRY command with the EVPD bit set. This command returns one of the
+ *  Vital Product Data pages: the list of supported pages, the Block Limits page (transfer sizes, limits of UNMAP
+ *  and WRITE SAME), the Block Device Characteristics page (non-rotating medium) or the Logical Block Provisioning
+ *  page (which says that sectors can be discarded).
+ *
+ *  The optimal transfer length and unmap granularity are the card's allocation unit, so that the host aligns
+ *  (partitions, filesystem structures) and sizes its transfers to it. If the medium can't discard sectors (an MMC
+ *  card), there are no UNMAP limits and no provisioning bits.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Inquiry_VPD(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+  uint16_t AllocationLength  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[3]);
+  uint8_t  PageCode          = MSInterfaceInfo->State.CommandBlock.SCSICommandData[2];
+  uint8_t  PageData[64];
+  uint16_t BytesTransferred;
+  uint32_t EraseBlocks       = disk_erase_size_GLOBAL / ENCRYPTED_BLOCK_SECTORS; // in logical blocks
+  bool     CanDiscard        = CALLBACK_disk_canDiscard();
+
+  memset(PageData, 0, sizeof(PageData));
+  PageData[0] = DEVICE_TYPE_BLOCK;
+  PageData[1] = PageCode;
+
+  switch (PageCode)
+  {
+    case SCSI_VPD_SUPPORTED_PAGES:
+      PageData[3] = 4;
+      PageData[4] = SCSI_VPD_SUPPORTED_PAGES;
+      PageData[5] = SCSI_VPD_BLOCK_LIMITS;
+      PageData[6] = SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS;
+      PageData[7] = SCSI_VPD_LOGICAL_BLOCK_PROVISIONING;
+      break;
+    case SCSI_VPD_BLOCK_LIMITS:
+      PageData[3] = 0x3C;
+      PageData[4] = 0x01; // WSNZ: WRITE SAME of zero sectors (= up to the end of the disk) is not supported
+      *(uint32_t*)&PageData[8]  = SwapEndian_32(SCSI_MAX_TRANSFER_BLOCKS);   // maximum transfer length
+      *(uint32_t*)&PageData[12] = SwapEndian_32(MIN(EraseBlocks, SCSI_MAX_TRANSFER_BLOCKS)); // optimal transfer length
+      if (CanDiscard)
+      {
+        *(uint32_t*)&PageData[20] = SwapEndian_32(SCSI_UNMAP_MAX_BLOCKS);      // maximum unmap LBA count
+        *(uint32_t*)&PageData[24] = SwapEndian_32(SCSI_UNMAP_MAX_DESCRIPTORS); // maximum unmap block descriptor count
+        *(uint32_t*)&PageData[28] = SwapEndian_32(EraseBlocks);                // optimal unmap granularity
+        PageData[32] = (EraseBlocks ? 0x80 : 0x00);                            // UGAVALID: granularity aligned to block 0
+      }
+      *(uint32_t*)&PageData[40] = SwapEndian_32(SCSI_UNMAP_MAX_BLOCKS);      // maximum WRITE SAME length (low half)
+      break;
+    case SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS:
+      PageData[3] = 0x3C;
+      PageData[5] = 0x01; // medium rotation rate: non-rotating medium
+      break;
+    case SCSI_VPD_LOGICAL_BLOCK_PROVISIONING:
+      PageData[3] = 4;
+      if (CanDiscard)
+        PageData[5] = (1 << 7) | (1 << 5); // LBPU, LBPWS10: UNMAP and WRITE SAME (10) with the UNMAP bit
+      if (CanDiscard && DiskMap_Active())
+        PageData[5] |= (1 << 2);           // LBPRZ: unmapped sectors read as zeros
+      break;
+    default:
+      /* Unsupported page - update the SENSE key and fail the request */
+      SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                     SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+                     SCSI_ASENSEQ_NO_QUALIFIER);
+
+      return false;
+  }
+
+  BytesTransferred = MIN(AllocationLength, 4 + PageData[3]);
+
+  Endpoint_Write_Stream_LE(PageData, BytesTransferred, NULL);
+  Endpoint_ClearIN();
+
+  /* Succeed the command and update the bytes transferred counter */
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+
+  return true;
+}
+
 /** Command processing for an issued SCSI REQUEST SENSE command. This command returns information about the last issued command,
  *  including the error code and additional error information so that the host can determine why a command failed to complete.
  *
@@ -233,13 +530,10 @@ static bool SCSI_Command_Request_Sense(USB_ClassInfo_MS_Device_t* const MSInterf
  */
 static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
 {
-  if (disk_state_GLOBAL == DISK_STATE_ENCRYPTING) {
-    Endpoint_Write_32_BE((disk_size_GLOBAL/TOTAL_LUNS) - 1);
-    Endpoint_Write_32_BE(DISK_BLOCK_SIZE);
-  } else {
-    Endpoint_Write_32_BE(VIRTUALFAT_LUN_MEDIA_BLOCKS - 1);
-    Endpoint_Write_32_BE(VIRTUALFAT_SECTOR_SIZE_BYTES);
-  }
+  uint8_t Medium = SCSI_LUN_Medium(MSInterfaceInfo);
+
+  Endpoint_Write_32_BE(SCSI_LUN_Blocks(Medium) - 1);
+  Endpoint_Write_32_BE(SCSI_LUN_BlockSize(Medium));
   Endpoint_ClearIN();
 
   /* Succeed the command and update the bytes transferred counter */
@@ -260,11 +554,12 @@ static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInt
 static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
                                       const bool IsDataRead)
 {
+  uint8_t  Medium = SCSI_LUN_Medium(MSInterfaceInfo);
   uint32_t BlockAddress;
   uint16_t TotalBlocks;
 
   /* Check if the disk is write protected or not */
-  if ((IsDataRead == DATA_WRITE) && disk_read_only_GLOBAL)
+  if ((IsDataRead == DATA_WRITE) && SCSI_LUN_ReadOnly(Medium))
   {
     /* Block address is invalid, update SENSE key and return command fail */
     SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
@@ -280,9 +575,9 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
   /* Load in the 16-bit total blocks (SCSI uses big-endian, so have to reverse the byte order) */
   TotalBlocks  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
 
-  /* Check if the block address is outside the maximum allowable value for the LUN */
-  if ( (disk_state_GLOBAL == DISK_STATE_ENCRYPTING && BlockAddress >= (disk_size_GLOBAL / TOTAL_LUNS)) ||
-       (disk_state_GLOBAL == DISK_STATE_INITIAL && BlockAddress >= VIRTUALFAT_LUN_MEDIA_BLOCKS) )
+  /* Check if the block address (or the end of the transfer) is outside the maximum allowable value for the LUN;
+   * the disk map and the header live right after the encrypted disk's blocks */
+  if ((BlockAddress >= SCSI_LUN_Blocks(Medium)) || (TotalBlocks > SCSI_LUN_Blocks(Medium) - BlockAddress))
   {
     /* Block address is invalid, update SENSE key and return command fail */
     SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
@@ -292,35 +587,88 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
     return false;
   }
 
+  /* Reads from and writes to the encrypted disk go through the pipelines */
+  if (Medium == LUN_MEDIUM_ENCRYPTED)
+  {
+    uint32_t StartTicks = timer_ticks();
+    bool     Success;
+
+    if (TotalBlocks > SCSI_MAX_TRANSFER_BLOCKS)
+    {
+      SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                     SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+                     SCSI_ASENSEQ_NO_QUALIFIER);
+
+      return false;
+    }
+
+    /* From here on, everything works with sectors (a logical block is ENCRYPTED_BLOCK_SECTORS of them) */
+    BlockAddress *= ENCRYPTED_BLOCK_SECTORS;
+    TotalBlocks  *= ENCRYPTED_BLOCK_SECTORS;
+
+    /* Anything but the next read in the stream invalidates the sectors fetched ahead. The depth follows how many of
+     * them were wanted: one more when the host took all of them (there was time to fetch more, or there was no
+     * read-ahead yet), less by the ones it didn't want (a random workload ends up with none) */
+    if ((IsDataRead == DATA_READ) && (BlockAddress == ReadAheadAddress))
+    {
+      if ((ReadAheadFetched == ReadAheadBlocks) && (ReadAheadDepth < READ_AHEAD_SECTORS))
+        ReadAheadDepth++;
+    }
+    else
+    {
+      uint8_t Wasted = ReadAheadFetched + (ReadAheadActive ? 1 : 0);
+
+      SCSI_ReadAhead_Cancel();
+      ReadAheadDepth = (ReadAheadDepth > Wasted) ? (ReadAheadDepth - Wasted) : 0;
+    }
+
+    if (IsDataRead == DATA_READ)
+    {
+      Success = SCSI_ReadSectors(MSInterfaceInfo, BlockAddress, TotalBlocks);
+    }
+    else if (!SCSI_MapSectors(BlockAddress, TotalBlocks))
+    {
+      Success = false;
+    }
+    else if ((TotalBlocks <= WRITE_CACHE_SECTORS) &&
+             !(MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & SCSI_FUA_BIT))
+    {
+      /* Small writes go to the write-back cache, unless the host wants them on the medium (FUA) */
+      Success = SCSI_WriteSectors_Cached(MSInterfaceInfo, BlockAddress, TotalBlocks);
+    }
+    else
+    {
+      /* Writing through: the cached copies of these sectors are outdated now */
+      DiskCache_Discard(BlockAddress, TotalBlocks);
+      Success = SCSI_WriteSectors(MSInterfaceInfo, BlockAddress, TotalBlocks);
+
+      /* Sectors of zeros were only unmapped in the allocation map, which has to be on the medium as well; a FUA
+       * write also reports the write-back cache failing in the background (the sectors are still cached then) */
+      if (Success &&
+          (!DiskMap_Flush() ||
+           ((MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & SCSI_FUA_BIT) && DiskCache_Failed())))
+      {
+        SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+                       SCSI_ASENSE_WRITE_ERROR,
+                       SCSI_ASENSEQ_NO_QUALIFIER);
+
+        Success = false;
+      }
+    }
+
+    if (Success)
+      DiskStats_Transfer(IsDataRead, TotalBlocks, StartTicks);
+
+    return Success;
+  }
+
   /* Determine if the packet is a READ (10) or WRITE (10) command, call appropriate function */
   for (uint16_t i = 0; i < TotalBlocks; i++)
   {
     if (IsDataRead == DATA_READ) {
-      if (disk_state_GLOBAL == DISK_STATE_INITIAL) {
-        VirtualFAT_ReadBlock(BlockAddress + i);
-      } else if (disk_state_GLOBAL == DISK_STATE_ENCRYPTING) {
-        uint8_t BlockBuffer[DISK_BLOCK_SIZE];
-        // get the data
-        //if(DISK_BLOCK_SIZE != CALLBACK_disk_readSector(BlockBuffer,BlockAddress+i))
-        //  return false;
-        CALLBACK_disk_readSector(BlockBuffer,BlockAddress+i);
-        /* Write the entire read block Buffer to the host */
-        Endpoint_Write_Stream_LE(BlockBuffer, sizeof(BlockBuffer), NULL);
-        Endpoint_ClearIN();
-      }
+      VirtualFAT_ReadBlock(BlockAddress + i);
     } else {
-      if (disk_state_GLOBAL == DISK_STATE_INITIAL) {
-        return false; // should be marked as read_only anyway...
-      } else if (disk_state_GLOBAL == DISK_STATE_ENCRYPTING) {
-        uint8_t BlockBuffer[DISK_BLOCK_SIZE];
-        /* Buffer the entire block to be written from the host */
-        Endpoint_Read_Stream_LE(BlockBuffer, sizeof(BlockBuffer), NULL);
-        Endpoint_ClearOUT();
-        // do something with the data
-        //if(DISK_BLOCK_SIZE != CALLBACK_disk_writeSector(BlockBuffer,BlockAddress+i))
-        //  return false;
-        CALLBACK_disk_writeSector(BlockBuffer, BlockAddress+i);
-      }
+      return false; // should be marked as read_only anyway...
     }
   }
 
@@ -330,25 +678,974 @@ static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfa
   return true;
 }
 
-/** Command processing for an issued SCSI MODE SENSE (6) command. This command returns various informational pages about
- *  the SCSI device, as well as the device's Write Protect status.
+/** Sends \c TotalBlocks sectors of the encrypted disk, starting at \c BlockAddress, to the host. Reading and
+ *  decrypting a sector is overlapped with sending the previous one(s): whenever the IN endpoint bank is
+ *  full and waiting for the host, the next sector is read and decrypted in DISK_PIPELINE_CHUNK_BYTES steps
+ *  into one of the DISK_SECTOR_BUFFERS sector buffers. A sector is sent cut-through, each chunk as soon as
+ *  it's decrypted, so the first bytes of a command go out after one chunk rather than one whole sector.
+ *
+ *  If the command continues a sequential stream, it takes over the sectors fetched ahead by
+ *  \ref SCSI_ReadAhead_Task(); when it's done, the read-ahead is set up for the sectors that follow.
  *
  *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *  \param[in] BlockAddress     First sector to be read
+ *  \param[in] TotalBlocks      Number of sectors to be read
  *
  *  \return Boolean \c true if the command completed successfully, \c false otherwise.
  */
-static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+static bool SCSI_ReadSectors(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+                             const uint32_t BlockAddress,
+                             const uint16_t TotalBlocks)
 {
-  /* Send an empty header response with the Write Protect flag status */
-  Endpoint_Write_8(0x00);
-  Endpoint_Write_8(0x00);
-  Endpoint_Write_8(disk_read_only_GLOBAL ? 0x80 : 0x00);
-  Endpoint_Write_8(0x00);
-  Endpoint_ClearIN();
+  uint16_t Sending  = 0;     // index of the sector being sent to the host
+  uint16_t Fetching = 0;     // index of the sector being read/decrypted (or the next one to start)
+  bool     FetchActive = false;
+  bool     FetchFailed = false;
 
-  /* Update the bytes transferred counter and succeed the command */
-  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= 4;
+  /* Take over what was fetched ahead (a failed fetch is retried) */
+  if (BlockAddress == ReadAheadAddress)
+  {
+    Fetching    = ReadAheadFetched;
+    FetchActive = ReadAheadActive;
+  }
+  ReadAheadBlocks  = 0;
+  ReadAheadFetched = 0;
+  ReadAheadActive  = false;
+
+  for (Sending = 0; Sending < TotalBlocks; Sending++)
+  {
+    uint8_t* BlockBuffer = SectorBuffers[Sending % DISK_SECTOR_BUFFERS];
+    uint16_t BytesSent   = 0;
+    uint16_t BytesReady;
+    uint8_t  ErrorCode;
+
+    /* Make sure the sector to be sent is being fetched at least */
+    while (!FetchFailed && (Fetching == Sending) && !FetchActive)
+      SCSI_ReadSectors_Step(BlockAddress, TotalBlocks, Sending, &Fetching, &FetchActive, &FetchFailed);
+
+    /* Write the sector to the host chunk by chunk as it's decrypted (cut-through); while the host empties a bank,
+     * or the next chunk isn't decrypted yet, work on this and the next sectors. Stops if fetching it fails (on the
+     * way, or already when starting). */
+    while ((BytesSent < DISK_BLOCK_SIZE) && ((Fetching > Sending) || FetchActive))
+    {
+      BytesReady = (Fetching > Sending) ? DISK_BLOCK_SIZE : FetchedBytes;
+
+      if (((BytesReady == BytesSent) || !Endpoint_IsINReady()) &&
+          SCSI_ReadSectors_Step(BlockAddress, TotalBlocks, Sending, &Fetching, &FetchActive, &FetchFailed))
+        continue;
+
+      /* Send what's decrypted (if there's nothing else to do, this waits for the host to free the bank) */
+      ErrorCode = Endpoint_Write_Stream_LE(BlockBuffer, BytesReady, &BytesSent);
+
+      if (ErrorCode == ENDPOINT_RWSTREAM_NoError)
+        BytesSent = BytesReady;
+      else if (ErrorCode != ENDPOINT_RWSTREAM_IncompleteTransfer)
+        break;
+    }
+
+    if ((Fetching == Sending) && !FetchActive)
+    {
+      SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+                     SCSI_ASENSE_UNRECOVERED_READ_ERROR,
+                     SCSI_ASENSEQ_NO_QUALIFIER);
+      break;
+    }
+
+    if (BytesSent < DISK_BLOCK_SIZE)
+      break;
+
+    Endpoint_ClearIN();
+
+    /* Small reads are typically of the FAT and directories, which are worth keeping */
+    if (TotalBlocks <= READ_CACHE_SECTORS)
+      DiskCache_Keep(BlockBuffer, BlockAddress + Sending);
+
+    SCSI_Yield();
+  }
+
+  /* Leave the card in a consistent state if we stopped early (or a sector fetched ahead wasn't wanted) */
+  if (FetchActive)
+    while (CALLBACK_disk_readSector_continue() < DISK_BLOCK_SIZE);
+
+  /* Get ready to fetch the sectors that follow while the host is busy with this command's data */
+  ReadAheadAddress = BlockAddress + Sending;
+  ReadAheadFailed  = false;
+  if ((Sending == TotalBlocks) && (ReadAheadAddress < disk_size_GLOBAL))
+    ReadAheadBlocks = MIN(ReadAheadDepth, disk_size_GLOBAL - ReadAheadAddress);
+
+  /* Update the bytes transferred counter */
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ((uint32_t)Sending * DISK_BLOCK_SIZE);
+
+  return (Sending == TotalBlocks);
+}
+
+/** Does a step of the read-ahead: reads and decrypts the next chunk of the sectors following the last READ (10)
+ *  command, if it was a part of a sequential stream. Should be called periodically (in between commands).
+ */
+void SCSI_ReadAhead_Task(void)
+{
+  if (ReadAheadBlocks)
+    SCSI_ReadSectors_Step(ReadAheadAddress, ReadAheadBlocks, 0, &ReadAheadFetched, &ReadAheadActive, &ReadAheadFailed);
+}
+
+/** Drops the sectors fetched ahead, e.g. because they're about to be overwritten, or the host wants other ones.
+ *  The sector buffers are free for other use afterwards.
+ */
+static void SCSI_ReadAhead_Cancel(void)
+{
+  SCSI_ReadAhead_Borrow();
+  ReadAheadBlocks = 0;
+}
+
+/** Frees the sector buffers for a command that needs one for its data (LOG SENSE, UNMAP, ...), or the medium for
+ *  something else (the caches writing in the background): a sector being read ahead is finished, and the sectors
+ *  fetched ahead are dropped. The stream goes on, they're fetched again afterwards.
+ */
+void SCSI_ReadAhead_Borrow(void)
+{
+  if (ReadAheadActive)
+    while (CALLBACK_disk_readSector_continue() < DISK_BLOCK_SIZE);
+
+  ReadAheadFetched = 0;
+  ReadAheadActive  = false;
+}
+
+/** Does a single step of the read pipeline in \ref SCSI_ReadSectors(): either starts fetching the next sector
+ *  (if there is a free buffer for it), or reads and decrypts the next chunk of the one being fetched.
+ *
+ *  \return Boolean \c true if there was anything to do, \c false otherwise.
+ */
+static bool SCSI_ReadSectors_Step(const uint32_t BlockAddress,
+                                  const uint16_t TotalBlocks,
+                                  const uint16_t Sending,
+                                  uint16_t* const Fetching,
+                                  bool* const FetchActive,
+                                  bool* const FetchFailed)
+{
+  if (*FetchActive)
+  {
+    int16_t Done = CALLBACK_disk_readSector_continue();
+
+    if (Done < 0)
+    {
+      /* The sector couldn't be read or decrypted; its data is no good (not even the bytes ready so far) */
+      *FetchActive = false;
+      *FetchFailed = true;
+      FetchedBytes = 0;
+    }
+    else if (Done == DISK_BLOCK_SIZE)
+    {
+      *FetchActive = false;
+      (*Fetching)++;
+    }
+    else
+    {
+      FetchedBytes = Done;
+    }
+
+    return true;
+  }
+
+  /* Start the next sector only if it's wanted and its buffer is no longer being sent */
+  if (*FetchFailed || (*Fetching >= TotalBlocks) || (*Fetching >= Sending + DISK_SECTOR_BUFFERS))
+    return false;
+
+  /* Sectors waiting in the write-back cache are newer than what's on the medium; the read cache saves decrypting */
+  if (DiskCache_Read(SectorBuffers[*Fetching % DISK_SECTOR_BUFFERS], BlockAddress + *Fetching))
+  {
+    (*Fetching)++;
+    return true;
+  }
+
+  FetchedBytes = 0;
+
+  if (CALLBACK_disk_readSector_begin(SectorBuffers[*Fetching % DISK_SECTOR_BUFFERS], BlockAddress + *Fetching))
+    *FetchActive = true;
+  else
+    *FetchFailed = true;
 
   return true;
 }
 
+/** Receives \c TotalBlocks sectors from the host and writes them to the encrypted disk, starting at
+ *  \c BlockAddress. Encrypting and writing a sector (and waiting for the card to program it) is overlapped
+ *  with receiving the next one(s): whenever the OUT endpoint bank is empty and waiting for the host, the
+ *  pipeline does a step of work on the sectors already received into the DISK_SECTOR_BUFFERS buffers.
+ *
+ *  If a sector fails to be written, the rest of the data is still taken from the host (and dropped), so
+ *  that the command fails with a proper status.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *  \param[in] BlockAddress     First sector to be written
+ *  \param[in] TotalBlocks      Number of sectors to be written
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_WriteSectors(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+                              const uint32_t BlockAddress,
+                              const uint16_t TotalBlocks)
+{
+  uint16_t Receiving  = 0;   // index of the sector being received from the host
+  uint16_t Committing = 0;   // index of the sector being encrypted/written (or the next one to start)
+  bool     CommitActive = false;
+  bool     CommitFailed = false;
+
+  for (Receiving = 0; Receiving < TotalBlocks; Receiving++)
+  {
+    uint8_t* BlockBuffer = SectorBuffers[Receiving % DISK_SECTOR_BUFFERS];
+    uint16_t BytesProcessed = 0;
+    uint8_t  ErrorCode;
+
+    /* Make sure the buffer is not holding a sector that still needs to be written */
+    while (!CommitFailed && (Committing + DISK_SECTOR_BUFFERS <= Receiving))
+      SCSI_WriteSectors_Step(BlockAddress, Receiving, &Committing, &CommitActive, &CommitFailed);
+
+    /* Read the sector from the host bank by bank; while waiting for the host, work on the previous sectors */
+    while ((ErrorCode = Endpoint_Read_Stream_LE(BlockBuffer, DISK_BLOCK_SIZE, &BytesProcessed)) == ENDPOINT_RWSTREAM_IncompleteTransfer)
+    {
+      while (!Endpoint_IsOUTReceived() &&
+             SCSI_WriteSectors_Step(BlockAddress, Receiving, &Committing, &CommitActive, &CommitFailed));
+    }
+
+    if (ErrorCode != ENDPOINT_RWSTREAM_NoError)
+      break;
+
+    Endpoint_ClearOUT();
+
+    SCSI_Yield();
+  }
+
+  /* Write out what's left, and wait for the card to be done with it */
+  while (!CommitFailed &&
+         SCSI_WriteSectors_Step(BlockAddress, Receiving, &Committing, &CommitActive, &CommitFailed));
+
+  /* Update the bytes transferred counter */
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ((uint32_t)Receiving * DISK_BLOCK_SIZE);
+
+  if (CommitFailed)
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+                   SCSI_ASENSE_WRITE_ERROR,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  return (Receiving == TotalBlocks);
+}
+
+/** Receives \c TotalBlocks sectors from the host into the write-back cache (see DiskCache.h). The command is
+ *  done as soon as the data is in RAM; it gets encrypted and written to the medium later.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *  \param[in] BlockAddress     First sector to be written
+ *  \param[in] TotalBlocks      Number of sectors to be written
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_WriteSectors_Cached(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+                                     const uint32_t BlockAddress,
+                                     const uint16_t TotalBlocks)
+{
+  uint16_t Received;
+
+  for (Received = 0; Received < TotalBlocks; Received++)
+  {
+    uint8_t* BlockBuffer = DiskCache_WriteBuffer(BlockAddress + Received);
+
+    if (BlockBuffer == NULL)
+    {
+      /* Making room in the cache failed; drop the rest of the data */
+      SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+                     SCSI_ASENSE_WRITE_ERROR,
+                     SCSI_ASENSEQ_NO_QUALIFIER);
+
+      Endpoint_Discard_Stream((TotalBlocks - Received) * DISK_BLOCK_SIZE, NULL);
+      Endpoint_ClearOUT();
+      break;
+    }
+
+    if (Endpoint_Read_Stream_LE(BlockBuffer, DISK_BLOCK_SIZE, NULL) != ENDPOINT_RWSTREAM_NoError)
+    {
+      DiskCache_Discard(BlockAddress + Received, 1);
+      break;
+    }
+
+    Endpoint_ClearOUT();
+  }
+
+  /* Update the bytes transferred counter */
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ((uint32_t)Received * DISK_BLOCK_SIZE);
+
+  return (Received == TotalBlocks);
+}
+
+/** Does a single step of the write pipeline in \ref SCSI_WriteSectors(): either encrypts and writes out the next
+ *  chunk of the sector being committed, or waits (one poll) for the card to finish the previous one, or starts
+ *  committing the next received sector.
+ *
+ *  \return Boolean \c true if there was anything to do, \c false otherwise.
+ */
+static bool SCSI_WriteSectors_Step(const uint32_t BlockAddress,
+                                   const uint16_t Received,
+                                   uint16_t* const Committing,
+                                   bool* const CommitActive,
+                                   bool* const CommitFailed)
+{
+  if (*CommitActive)
+  {
+    int16_t Done = CALLBACK_disk_writeSector_continue();
+
+    if (Done < 0)
+    {
+      *CommitActive = false;
+      *CommitFailed = true;
+    }
+    else if (Done == DISK_BLOCK_SIZE)
+    {
+      *CommitActive = false;
+      (*Committing)++;
+    }
+
+    return true;
+  }
+
+  /* The card is still programming the last sector */
+  if (CALLBACK_disk_busy())
+    return true;
+
+  if (*CommitFailed || (*Committing >= Received))
+    return false;
+
+  if (CALLBACK_disk_writeSector_begin(SectorBuffers[*Committing % DISK_SECTOR_BUFFERS], BlockAddress + *Committing))
+    *CommitActive = true;
+  else
+    *CommitFailed = true;
+
+  return true;
+}
+
+/** Command processing for an issued SCSI SYNCHRONIZE CACHE (10) command (also used for START STOP UNIT). This
+ *  command writes all the sectors held in the write-back cache, and the changes to the allocation map, to the medium.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Synchronize_Cache_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength = 0;
+
+  if (!DiskCache_Flush() || !DiskMap_Flush())
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+                   SCSI_ASENSE_WRITE_ERROR,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  return true;
+}
+
+/** Command processing for an issued SCSI MODE SENSE (6) command. This command returns various informational pages about
+ *  the SCSI device, as well as the device's Write Protect status. The only page is the Caching page, which tells the host
+ *  whether the (encrypted) disk has a write-back cache; for other pages just the header is sent.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+  uint8_t Medium           = SCSI_LUN_Medium(MSInterfaceInfo);
+  uint8_t PageCode         = MSInterfaceInfo->State.CommandBlock.SCSICommandData[2] & 0x3F;
+  uint8_t PageControl      = MSInterfaceInfo->State.CommandBlock.SCSICommandData[2] >> 6;
+  uint8_t AllocationLength = MSInterfaceInfo->State.CommandBlock.SCSICommandData[4];
+  uint8_t ModeData[4 + 20];
+  uint8_t BytesTransferred;
+
+  memset(ModeData, 0, sizeof(ModeData));
+
+  /* Header with the Write Protect flag status; the encrypted disk supports FUA (DPOFUA) */
+  ModeData[0] = 3;
+  ModeData[2] = (SCSI_LUN_ReadOnly(Medium) ? 0x80 : 0x00) |
+                ((Medium == LUN_MEDIUM_ENCRYPTED) ? 0x10 : 0x00);
+
+  if ((PageCode == SCSI_MODEPAGE_CACHING) || (PageCode == SCSI_MODEPAGE_ALL))
+  {
+    uint8_t* CachingPage = &ModeData[4];
+
+    CachingPage[0] = SCSI_MODEPAGE_CACHING;
+    CachingPage[1] = 0x12;
+    /* WCE: write-back cache enabled (none of the values can be changed) */
+    if ((PageControl != SCSI_MODEPAGE_CHANGEABLE_VALUES) && (WRITE_CACHE_SECTORS > 0) &&
+        (Medium == LUN_MEDIUM_ENCRYPTED))
+      CachingPage[2] = (1 << 2);
+
+    ModeData[0] += 20;
+  }
+
+  BytesTransferred = MIN(AllocationLength, ModeData[0] + 1);
+
+  Endpoint_Write_Stream_LE(ModeData, BytesTransferred, NULL);
+  Endpoint_ClearIN();
+
+  /* Update the bytes transferred counter and succeed the command */
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+
+  return true;
+}
+
+
+/** Command processing for an issued SCSI SERVICE ACTION IN (16) command. The READ CAPACITY (16) and GET LBA STATUS
+ *  service actions are supported.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Service_Action_In_16(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+  switch (MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & 0x1F)
+  {
+    case SCSI_SAI_READ_CAPACITY_16:
+      return SCSI_Command_Read_Capacity_16(MSInterfaceInfo);
+    case SCSI_SAI_GET_LBA_STATUS:
+      return SCSI_Command_Get_LBA_Status(MSInterfaceInfo);
+    default:
+      SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                     SCSI_ASENSE_INVALID_COMMAND,
+                     SCSI_ASENSEQ_NO_QUALIFIER);
+
+      return false;
+  }
+}
+
+/** Command processing for an issued SCSI READ CAPACITY (16) service action. It returns the same information as
+ *  READ CAPACITY (10), and also tells the host that the encrypted disk is thin provisioned, i.e. that it can
+ *  discard sectors with UNMAP (and that discarded sectors read as zeros, if there's an allocation map); unless the
+ *  medium can't discard sectors (an MMC card).
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Read_Capacity_16(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+  uint32_t AllocationLength = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[10]);
+  uint8_t  Medium           = SCSI_LUN_Medium(MSInterfaceInfo);
+  uint8_t  CapacityData[32];
+  uint8_t  BytesTransferred;
+
+  memset(CapacityData, 0, sizeof(CapacityData));
+  *(uint32_t*)&CapacityData[4] = SwapEndian_32(SCSI_LUN_Blocks(Medium) - 1);
+  *(uint32_t*)&CapacityData[8] = SwapEndian_32(SCSI_LUN_BlockSize(Medium));
+  if ((Medium == LUN_MEDIUM_ENCRYPTED) && CALLBACK_disk_canDiscard())
+  {
+    CapacityData[14] = (1 << 7);   // LBPME: logical block provisioning (UNMAP) enabled
+    if (DiskMap_Active())
+      CapacityData[14] |= (1 << 6); // LBPRZ: unmapped sectors read as zeros
+  }
+
+  BytesTransferred = MIN(AllocationLength, sizeof(CapacityData));
+
+  Endpoint_Write_Stream_LE(CapacityData, BytesTransferred, NULL);
+  Endpoint_ClearIN();
+
+  /* Succeed the command and update the bytes transferred counter */
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+
+  return true;
+}
+
+/** Command processing for an issued SCSI GET LBA STATUS service action. This returns up to
+ *  \ref SCSI_LBA_STATUS_DESCRIPTORS ranges of blocks, starting at the given one, that are mapped (were written), or
+ *  deallocated (read as zeros), according to the allocation map of the encrypted disk (see DiskMap.h). Without a map,
+ *  all the blocks are mapped.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Get_LBA_Status(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+  uint32_t AllocationLength = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[10]);
+  uint32_t BlockAddress     = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[6]);
+  uint8_t  Medium           = SCSI_LUN_Medium(MSInterfaceInfo);
+  uint32_t DiskBlocks       = SCSI_LUN_Blocks(Medium);
+  uint8_t  StatusData[8 + (16 * SCSI_LBA_STATUS_DESCRIPTORS)];
+  uint8_t  StatusLength     = 8;
+  uint8_t  BytesTransferred;
+
+  /* Only 32-bit block addresses */
+  if (*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[2] || (BlockAddress >= DiskBlocks))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                   SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  memset(StatusData, 0, sizeof(StatusData));
+
+  while ((BlockAddress < DiskBlocks) && (StatusLength < sizeof(StatusData)))
+  {
+    uint8_t* Descriptor = &StatusData[StatusLength];
+    uint32_t TotalBlocks;
+    bool     Mapped;
+
+    if (Medium == LUN_MEDIUM_ENCRYPTED)
+    {
+      TotalBlocks = DiskMap_Extent(BlockAddress * ENCRYPTED_BLOCK_SECTORS,
+                                   (DiskBlocks - BlockAddress) * ENCRYPTED_BLOCK_SECTORS, &Mapped) / ENCRYPTED_BLOCK_SECTORS;
+    }
+    else
+    {
+      TotalBlocks = DiskBlocks - BlockAddress;
+      Mapped      = true;
+    }
+
+    *(uint32_t*)&Descriptor[4] = SwapEndian_32(BlockAddress);
+    *(uint32_t*)&Descriptor[8] = SwapEndian_32(TotalBlocks);
+    Descriptor[12]             = (Mapped ? 0x00 : 0x01); // provisioning status: mapped, or deallocated
+
+    BlockAddress += TotalBlocks;
+    StatusLength += 16;
+  }
+
+  *(uint32_t*)&StatusData[0] = SwapEndian_32(StatusLength - 4); // parameter data length
+
+  BytesTransferred = MIN(AllocationLength, StatusLength);
+
+  Endpoint_Write_Stream_LE(StatusData, BytesTransferred, NULL);
+  Endpoint_ClearIN();
+
+  /* Succeed the command and update the bytes transferred counter */
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+
+  return true;
+}
+
+/** Command processing for an issued SCSI UNMAP command. The host sends a list of sector ranges it no longer needs;
+ *  they are discarded (erased on the SD card) instead of being written over with encrypted garbage or zeros.
+ *  Nothing is discarded if any of the ranges is invalid. Not supported if the medium can't discard sectors (an MMC
+ *  card; READ CAPACITY (16) doesn't offer UNMAP then).
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Unmap(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+  uint16_t ParameterListLength = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+  uint8_t* ParameterList       = SectorBuffers[0];
+  uint8_t  TotalDescriptors;
+  uint32_t DiskBlocks          = SCSI_LUN_Blocks(LUN_MEDIUM_ENCRYPTED);
+
+  if (!CALLBACK_disk_canDiscard())
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                   SCSI_ASENSE_INVALID_COMMAND,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  if (SCSI_LUN_ReadOnly(SCSI_LUN_Medium(MSInterfaceInfo)))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
+                   SCSI_ASENSE_WRITE_PROTECTED,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  if (ParameterListLength > DISK_BLOCK_SIZE)
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                   SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  /* The parameter list goes into a sector buffer */
+  SCSI_ReadAhead_Borrow();
+
+  if (ParameterListLength)
+  {
+    if (Endpoint_Read_Stream_LE(ParameterList, ParameterListLength, NULL) != ENDPOINT_RWSTREAM_NoError)
+      return false;
+
+    Endpoint_ClearOUT();
+  }
+
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ParameterListLength;
+
+  /* A list shorter than the header means there's nothing to do */
+  if (ParameterListLength < 8)
+    return true;
+
+  TotalDescriptors = MIN(SwapEndian_16(*(uint16_t*)&ParameterList[2]), ParameterListLength - 8) / 16;
+
+  /* Check all the ranges first */
+  for (uint8_t i = 0; i < TotalDescriptors; i++)
+  {
+    uint8_t* Descriptor   = &ParameterList[8 + 16 * i];
+    uint32_t BlockAddress = SwapEndian_32(*(uint32_t*)&Descriptor[4]);
+    uint32_t TotalBlocks  = SwapEndian_32(*(uint32_t*)&Descriptor[8]);
+
+    if (TotalBlocks > SCSI_UNMAP_MAX_BLOCKS)
+    {
+      SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                     SCSI_ASENSE_INVALID_FIELD_IN_PARAMETER_LIST,
+                     SCSI_ASENSEQ_NO_QUALIFIER);
+
+      return false;
+    }
+
+    if (*(uint32_t*)&Descriptor[0] || (BlockAddress > DiskBlocks) ||
+        (TotalBlocks > DiskBlocks - BlockAddress))
+    {
+      SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                     SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                     SCSI_ASENSEQ_NO_QUALIFIER);
+
+      return false;
+    }
+  }
+
+  for (uint8_t i = 0; i < TotalDescriptors; i++)
+  {
+    uint8_t* Descriptor = &ParameterList[8 + 16 * i];
+
+    if (!SCSI_DiscardSectors(SwapEndian_32(*(uint32_t*)&Descriptor[4]) * ENCRYPTED_BLOCK_SECTORS,
+                             SwapEndian_32(*(uint32_t*)&Descriptor[8]) * ENCRYPTED_BLOCK_SECTORS))
+      return false;
+  }
+
+  return true;
+}
+
+/** Command processing for an issued SCSI WRITE SAME (10) command. The single sector sent by the host is written to all
+ *  the given sectors, or, if the UNMAP bit is set, the sectors are discarded instead (their contents are undefined
+ *  afterwards; hosts use this to discard sectors just like with UNMAP). With logical blocks bigger than a sector only
+ *  the latter is supported: the block sent by the host doesn't fit into a sector buffer.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Write_Same_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+  uint32_t BlockAddress = SwapEndian_32(*(uint32_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[2]);
+  uint16_t TotalBlocks  = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+  bool     Unmap        = (MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & SCSI_UNMAP_BIT);
+  uint32_t DiskBlocks   = SCSI_LUN_Blocks(LUN_MEDIUM_ENCRYPTED);
+
+  if (SCSI_LUN_ReadOnly(SCSI_LUN_Medium(MSInterfaceInfo)))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_DATA_PROTECT,
+                   SCSI_ASENSE_WRITE_PROTECTED,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  /* Zero sectors would mean "up to the end of the disk", which the Block Limits VPD page says is not supported;
+   * writing needs a second sector buffer to encrypt the sent sector (in place) again and again; unmapping needs a
+   * medium that can discard sectors */
+  if (!TotalBlocks || (TotalBlocks > SCSI_UNMAP_MAX_BLOCKS) ||
+      (Unmap && !CALLBACK_disk_canDiscard()) ||
+      (!Unmap && ((DISK_SECTOR_BUFFERS < 2) || (ENCRYPTED_BLOCK_SECTORS > 1))))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                   SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  if ((BlockAddress >= DiskBlocks) || (TotalBlocks > DiskBlocks - BlockAddress))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                   SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  /* The sector goes into a sector buffer (a bigger block is only needed for unmapping, so it's just dropped) */
+  SCSI_ReadAhead_Borrow();
+
+  for (uint8_t i = 0; i < ENCRYPTED_BLOCK_SECTORS; i++)
+  {
+    if (Endpoint_Read_Stream_LE(SectorBuffers[0], DISK_BLOCK_SIZE, NULL) != ENDPOINT_RWSTREAM_NoError)
+      return false;
+  }
+
+  Endpoint_ClearOUT();
+
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= ENCRYPTED_BLOCK_SIZE;
+
+  if (Unmap)
+    return SCSI_DiscardSectors(BlockAddress * ENCRYPTED_BLOCK_SECTORS, TotalBlocks * ENCRYPTED_BLOCK_SECTORS);
+
+  if (!SCSI_MapSectors(BlockAddress, TotalBlocks))
+    return false;
+
+  /* The cached copies of these sectors are outdated now */
+  DiskCache_Discard(BlockAddress, TotalBlocks);
+
+  for (uint16_t i = 0; i < TotalBlocks; i++)
+  {
+    memcpy(SectorBuffers[DISK_SECTOR_BUFFERS - 1], SectorBuffers[0], DISK_BLOCK_SIZE);
+
+    if (CALLBACK_disk_writeSector(SectorBuffers[DISK_SECTOR_BUFFERS - 1], BlockAddress + i) != DISK_BLOCK_SIZE)
+    {
+      SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+                     SCSI_ASENSE_WRITE_ERROR,
+                     SCSI_ASENSEQ_NO_QUALIFIER);
+
+      return false;
+    }
+
+    SCSI_Yield();
+  }
+
+  return true;
+}
+
+/** Called after each sector of a long transfer: services the other USB interfaces (serial console, keyboard, see
+ *  \ref usb_tasks_others()) after USB_SERVICE_SECTORS sectors, or USB_SERVICE_INTERVAL, since the last time. The
+ *  time this takes is counted in the performance counters.
+ */
+static void SCSI_Yield(void)
+{
+  uint8_t  PrevSelectedEndpoint;
+  uint32_t StartTicks;
+
+  if ((++YieldSectors < USB_SERVICE_SECTORS) && ((millis10() - YieldTime) < USB_SERVICE_INTERVAL))
+    return;
+
+  StartTicks           = timer_ticks();
+  PrevSelectedEndpoint = Endpoint_GetCurrentEndpoint();
+
+  usb_tasks_others();
+
+  /* They select their own endpoints */
+  Endpoint_SelectEndpoint(PrevSelectedEndpoint);
+
+  DiskStats_AddTime(&DiskStats.YieldMicros, StartTicks);
+  DiskStats.Yields++;
+
+  YieldSectors = 0;
+  YieldTime    = millis10();
+}
+
+/** Discards \c TotalBlocks sectors of the encrypted disk starting at \c BlockAddress, both from the caches and
+ *  from the medium (see \ref CALLBACK_disk_discardSectors()). Sets the SENSE data if it fails.
+ *
+ *  \param[in] BlockAddress  First sector to be discarded
+ *  \param[in] TotalBlocks   Number of sectors to be discarded
+ *
+ *  \return Boolean \c true if the sectors were discarded, \c false otherwise.
+ */
+static bool SCSI_DiscardSectors(const uint32_t BlockAddress,
+                                const uint16_t TotalBlocks)
+{
+  DiskCache_Discard(BlockAddress, TotalBlocks);
+
+  if (TotalBlocks && !CALLBACK_disk_discardSectors(BlockAddress, TotalBlocks))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+                   SCSI_ASENSE_WRITE_ERROR,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  return true;
+}
+
+/** Marks \c TotalBlocks sectors of the encrypted disk starting at \c BlockAddress as written in the allocation map,
+ *  before they are written (see \ref DiskMap_Map()); with the whole command at once, the map is updated on the medium
+ *  at most once per command rather than for each new sector. Sets the SENSE data if it fails.
+ *
+ *  \param[in] BlockAddress  First sector to be written
+ *  \param[in] TotalBlocks   Number of sectors to be written
+ *
+ *  \return Boolean \c true if the sectors can be written, \c false otherwise.
+ */
+static bool SCSI_MapSectors(const uint32_t BlockAddress,
+                            const uint16_t TotalBlocks)
+{
+  if (!DiskMap_Map(BlockAddress, TotalBlocks))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_MEDIUM_ERROR,
+                   SCSI_ASENSE_WRITE_ERROR,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  return true;
+}
+
+/** Finds the index of a SCSI command in the performance counters (\c DiskStats.Commands).
+ *
+ *  \param[in] Command  SCSI command opcode
+ *
+ *  \return Index of the command's counter; \c DISK_STATS_COMMANDS (the counter of all the others) if it's not counted separately.
+ */
+static uint8_t SCSI_CommandIndex(const uint8_t Command)
+{
+  uint8_t i;
+
+  for (i = 0; i < DISK_STATS_COMMANDS; i++)
+  {
+    if (SCSI_CountedCommands[i] == Command)
+      break;
+  }
+
+  return i;
+}
+
+/** Command processing for an issued SCSI LOG SENSE command. Besides the list of supported pages, there is one vendor
+ *  specific page with the performance counters of the encrypted disk (see DiskStats.h), cumulative since power up:
+ *
+ *   - 0x0000, 0x0001: sectors read, written (4 bytes)
+ *   - 0x0002, 0x0003: ciphertext bytes read, written over SPI (8 bytes)
+ *   - 0x0004, 0x0005: microseconds spent waiting for the SD card, and on the AES (8 bytes; on the xmega, the time
+ *                     spent starting it and waiting for it to finish, not what it does in the background)
+ *   - 0x0006, 0x0007: microseconds spent on the other USB interfaces during transfers (8 bytes), and how many
+ *                     times (4 bytes)
+ *   - 0x0010 - 0x0012: min/avg/max per-sector latency of READ (10) commands in microseconds (4 bytes)
+ *   - 0x0020 - 0x0022: min/avg/max per-sector latency of WRITE (10) commands in microseconds (4 bytes)
+ *   - 0x0030, 0x0031: read/write cache hits, misses (4 bytes)
+ *   - 0x0100 + opcode: number of the commands with the opcode sent to the encrypted disk (4 bytes)
+ *   - 0x0200: number of the other commands sent to it (4 bytes)
+ *
+ *  All the values are big-endian, so that e.g. \c sg_logs \c --page=0x30 shows them readably. The counters can't be
+ *  reset or saved, only the current cumulative values are supported.
+ *
+ *  \param[in] MSInterfaceInfo  Pointer to the Mass Storage class interface structure that the command is associated with
+ *
+ *  \return Boolean \c true if the command completed successfully, \c false otherwise.
+ */
+static bool SCSI_Command_Log_Sense(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo)
+{
+  uint8_t  PageCode         = MSInterfaceInfo->State.CommandBlock.SCSICommandData[2] & 0x3F;
+  uint8_t  PageControl      = MSInterfaceInfo->State.CommandBlock.SCSICommandData[2] >> 6;
+  uint16_t ParameterPointer = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[5]);
+  uint16_t AllocationLength = SwapEndian_16(*(uint16_t*)&MSInterfaceInfo->State.CommandBlock.SCSICommandData[7]);
+  uint8_t* PageData         = SectorBuffers[0];
+  uint16_t PageLength       = 4;
+  uint16_t BytesTransferred;
+  uint32_t Average;
+
+  /* Saving the parameters (SP) or other values than the cumulative ones aren't supported */
+  if ((MSInterfaceInfo->State.CommandBlock.SCSICommandData[1] & 0x01) ||
+      (PageControl != SCSI_LOGPAGE_CUMULATIVE_VALUES) ||
+      ((PageCode != SCSI_LOGPAGE_SUPPORTED_PAGES) && (PageCode != SCSI_LOGPAGE_DISK_STATS)))
+  {
+    SCSI_SET_SENSE(SCSI_SENSE_KEY_ILLEGAL_REQUEST,
+                   SCSI_ASENSE_INVALID_FIELD_IN_CDB,
+                   SCSI_ASENSEQ_NO_QUALIFIER);
+
+    return false;
+  }
+
+  /* The page is put together in a sector buffer */
+  SCSI_ReadAhead_Borrow();
+
+  memset(PageData, 0, 4);
+  PageData[0] = PageCode;
+
+  if (PageCode == SCSI_LOGPAGE_SUPPORTED_PAGES)
+  {
+    PageData[PageLength++] = SCSI_LOGPAGE_SUPPORTED_PAGES;
+    PageData[PageLength++] = SCSI_LOGPAGE_DISK_STATS;
+  }
+  else
+  {
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0000, &DiskStats.SectorsRead, 4);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0001, &DiskStats.SectorsWritten, 4);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0002, &DiskStats.SpiBytesRead, 8);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0003, &DiskStats.SpiBytesWritten, 8);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0004, &DiskStats.SdBusyMicros, 8);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0005, &DiskStats.AesMicros, 8);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0006, &DiskStats.YieldMicros, 8);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0007, &DiskStats.Yields, 4);
+
+    Average    = DiskStats_AverageMicros(&DiskStats.ReadLatency, DiskStats.SectorsRead);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0010, &DiskStats.ReadLatency.MinMicros, 4);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0011, &Average, 4);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0012, &DiskStats.ReadLatency.MaxMicros, 4);
+
+    Average    = DiskStats_AverageMicros(&DiskStats.WriteLatency, DiskStats.SectorsWritten);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0020, &DiskStats.WriteLatency.MinMicros, 4);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0021, &Average, 4);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0022, &DiskStats.WriteLatency.MaxMicros, 4);
+
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0030, &DiskCache_Hits, 4);
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0031, &DiskCache_Misses, 4);
+
+    for (uint8_t i = 0; i < DISK_STATS_COMMANDS; i++)
+    {
+      PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0100 | SCSI_CountedCommands[i],
+                                      &DiskStats.Commands[i], 4);
+    }
+    PageLength = SCSI_Log_Parameter(PageData, PageLength, ParameterPointer, 0x0200,
+                                    &DiskStats.Commands[DISK_STATS_COMMANDS], 4);
+  }
+
+  *(uint16_t*)&PageData[2] = SwapEndian_16(PageLength - 4);
+
+  BytesTransferred = MIN(AllocationLength, PageLength);
+
+  Endpoint_Write_Stream_LE(PageData, BytesTransferred, NULL);
+  Endpoint_ClearIN();
+
+  /* Succeed the command and update the bytes transferred counter */
+  MSInterfaceInfo->State.CommandBlock.DataTransferLength -= BytesTransferred;
+
+  return true;
+}
+
+/** Appends a parameter to a log page being put together by \ref SCSI_Command_Log_Sense(); parameters with codes below
+ *  the parameter pointer of the command are left out.
+ *
+ *  \param[in,out] PageData          The log page
+ *  \param[in]     PageLength        Length of the log page so far (including the header)
+ *  \param[in]     ParameterPointer  Parameter pointer of the LOG SENSE command
+ *  \param[in]     ParameterCode     Code of the parameter
+ *  \param[in]     Value             The (little-endian) value of the parameter
+ *  \param[in]     ValueLength       Length of the value in bytes
+ *
+ *  \return New length of the log page.
+ */
+static uint16_t SCSI_Log_Parameter(uint8_t* const PageData,
+                                   const uint16_t PageLength,
+                                   const uint16_t ParameterPointer,
+                                   const uint16_t ParameterCode,
+                                   const void* const Value,
+                                   const uint8_t ValueLength)
+{
+  uint8_t* Parameter = &PageData[PageLength];
+
+  if (ParameterCode < ParameterPointer)
+    return PageLength;
+
+  *(uint16_t*)&Parameter[0] = SwapEndian_16(ParameterCode);
+  Parameter[2] = 0x03; // binary format list
+  Parameter[3] = ValueLength;
+
+  /* Values are sent big-endian */
+  for (uint8_t i = 0; i < ValueLength; i++)
+    Parameter[4 + i] = ((const uint8_t*)Value)[ValueLength - 1 - i];
+
+  return PageLength + 4 + ValueLength;
+}
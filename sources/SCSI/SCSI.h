@@ -62,12 +62,21 @@
     // Size of the virtual disk to be reported to OS - in BLOCKS!
     GLOBALS_EXTERN_SCSI volatile uint32_t disk_size_GLOBAL;
 
+    // Preferred unit of writing to the disk (e.g. SD card's allocation unit) - in BLOCKS! 0 if unknown.
+    GLOBALS_EXTERN_SCSI volatile uint32_t disk_erase_size_GLOBAL;
+
     // Initial state or encrypting? (should detach/attach USB after changing)
     #define DISK_STATE_INITIAL 1
     #define DISK_STATE_ENCRYPTING 2
     GLOBALS_EXTERN_SCSI volatile uint8_t disk_state_GLOBAL;
 
   /* Macros: */
+    /** What a LUN presents to the host (see \ref SCSI_LUN_Medium()): nothing (the encrypted disk's LUN before
+     *  unlocking), the VirtualFAT volume or the encrypted disk. */
+    #define LUN_MEDIUM_NONE       0
+    #define LUN_MEDIUM_VIRTUALFAT 1
+    #define LUN_MEDIUM_ENCRYPTED  2
+
     /** Macro to set the current SCSI sense data to the given key, additional sense code and additional sense qualifier. This
      *  is for convenience, as it allows for all three sense values (returned upon request to the host to give information about
      *  the last command failure) in a quick and easy manner.
@@ -86,6 +95,81 @@
     /** Macro for the \ref SCSI_Command_ReadWrite_10() function, to indicate that data is to be written to the storage medium. */
     #define DATA_WRITE          false
 
+    /** SCSI SYNCHRONIZE CACHE (10) command opcode (not defined by LUFA). */
+    #define SCSI_CMD_SYNCHRONIZE_CACHE_10       0x35
+
+    /** Force Unit Access bit in byte 1 of the READ (10) / WRITE (10) command block. */
+    #define SCSI_FUA_BIT                        (1 << 3)
+
+    /** SCSI WRITE SAME (10), UNMAP and SERVICE ACTION IN (16) command opcodes (not defined by LUFA). */
+    #define SCSI_CMD_WRITE_SAME_10              0x41
+    #define SCSI_CMD_UNMAP                      0x42
+    #define SCSI_CMD_SERVICE_ACTION_IN_16       0x9E
+
+    /** READ CAPACITY (16) and GET LBA STATUS service actions of the SERVICE ACTION IN (16) command. */
+    #define SCSI_SAI_READ_CAPACITY_16           0x10
+    #define SCSI_SAI_GET_LBA_STATUS             0x12
+
+    /** Maximum number of LBA status descriptors returned by GET LBA STATUS. */
+    #define SCSI_LBA_STATUS_DESCRIPTORS         4
+
+    /** UNMAP bit in byte 1 of the WRITE SAME (10) command block. */
+    #define SCSI_UNMAP_BIT                      (1 << 3)
+
+    /** Enable Vital Product Data bit in byte 1 of the INQUIRY command block. */
+    #define SCSI_EVPD_BIT                       (1 << 0)
+
+    /** Vital Product Data pages supported by the device. */
+    #define SCSI_VPD_SUPPORTED_PAGES            0x00
+    #define SCSI_VPD_BLOCK_LIMITS               0xB0
+    #define SCSI_VPD_BLOCK_DEVICE_CHARACTERISTICS 0xB1
+    #define SCSI_VPD_LOGICAL_BLOCK_PROVISIONING 0xB2
+
+    /** SCSI LOG SENSE command opcode (not defined by LUFA). */
+    #define SCSI_CMD_LOG_SENSE                  0x4D
+
+    /** Log pages supported by the LOG SENSE command: the list of pages, and the (vendor specific) performance counters. */
+    #define SCSI_LOGPAGE_SUPPORTED_PAGES        0x00
+    #define SCSI_LOGPAGE_DISK_STATS             0x30
+
+    /** Page control value of the LOG SENSE command asking for the current cumulative values. */
+    #define SCSI_LOGPAGE_CUMULATIVE_VALUES      0x01
+
+    /** Mode pages supported by the MODE SENSE (6) command: the Caching page, and all of them. */
+    #define SCSI_MODEPAGE_CACHING               0x08
+    #define SCSI_MODEPAGE_ALL                   0x3F
+
+    /** Page control value of the MODE SENSE (6) command asking for the changeable values. */
+    #define SCSI_MODEPAGE_CHANGEABLE_VALUES     0x01
+
+    /** Largest number of (logical) blocks a single READ (10) / WRITE (10) command can transfer; the pipelines count
+     *  the sectors of the transfer in 16 bits. */
+    #define SCSI_MAX_TRANSFER_BLOCKS            (0xFFFF / ENCRYPTED_BLOCK_SECTORS)
+
+    /** Largest number of (logical) blocks a single UNMAP block descriptor or WRITE SAME (10) command may discard. */
+    #define SCSI_UNMAP_MAX_BLOCKS               (0xFFFF / ENCRYPTED_BLOCK_SECTORS)
+
+    /** Largest number of UNMAP block descriptors: the parameter list has to fit into a sector buffer. */
+    #define SCSI_UNMAP_MAX_DESCRIPTORS          ((DISK_BLOCK_SIZE - 8) / 16)
+
+    /** Additional sense codes for failed reads from/writes to the medium (not defined by LUFA). */
+    #define SCSI_ASENSE_WRITE_ERROR             0x0C
+    #define SCSI_ASENSE_UNRECOVERED_READ_ERROR  0x11
+
+    /** Additional sense code and qualifier for changed mode parameters, e.g. write protection (not defined by LUFA). */
+    #define SCSI_ASENSE_PARAMETERS_CHANGED      0x2A
+    #define SCSI_ASENSEQ_MODE_PARAMETERS_CHANGED 0x01
+
+    /** LUN presenting the encrypted disk (once unlocked). */
+    #if defined(DUAL_LUN)
+      #define ENCRYPTED_DISK_LUN                1
+    #else
+      #define ENCRYPTED_DISK_LUN                0
+    #endif
+
+    /** Additional sense code for a bad UNMAP parameter list (not defined by LUFA). */
+    #define SCSI_ASENSE_INVALID_FIELD_IN_PARAMETER_LIST 0x26
+
     /** Value for the DeviceType entry in the SCSI_Inquiry_Response_t enum, indicating a Block Media device. */
     #define DEVICE_TYPE_BLOCK   0x00
 
@@ -94,14 +178,63 @@
 
   /* Function Prototypes: */
     bool SCSI_DecodeSCSICommand(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+    void SCSI_ReadAhead_Task(void);
+    void SCSI_ReadAhead_Borrow(void);
+    void SCSI_Disk_Changed(const uint8_t Acode, const uint8_t Aqual);
 
     #if defined(_INCLUDED_FROM_SCSI_C_)
+      static uint8_t SCSI_LUN_Medium(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static uint32_t SCSI_LUN_Blocks(const uint8_t Medium);
+      static uint16_t SCSI_LUN_BlockSize(const uint8_t Medium);
+      static bool SCSI_LUN_ReadOnly(const uint8_t Medium);
+      static bool SCSI_NeedsMedium(const uint8_t Command);
       static bool SCSI_Command_Inquiry(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static bool SCSI_Command_Inquiry_VPD(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
       static bool SCSI_Command_Request_Sense(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
       static bool SCSI_Command_Read_Capacity_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
       static bool SCSI_Command_ReadWrite_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
                                             const bool IsDataRead);
       static bool SCSI_Command_ModeSense_6(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static bool SCSI_ReadSectors(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+                                   const uint32_t BlockAddress,
+                                   const uint16_t TotalBlocks);
+      static bool SCSI_ReadSectors_Step(const uint32_t BlockAddress,
+                                        const uint16_t TotalBlocks,
+                                        const uint16_t Sending,
+                                        uint16_t* const Fetching,
+                                        bool* const FetchActive,
+                                        bool* const FetchFailed);
+      static void SCSI_ReadAhead_Cancel(void);
+      static bool SCSI_WriteSectors(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+                                    const uint32_t BlockAddress,
+                                    const uint16_t TotalBlocks);
+      static bool SCSI_WriteSectors_Step(const uint32_t BlockAddress,
+                                         const uint16_t Received,
+                                         uint16_t* const Committing,
+                                         bool* const CommitActive,
+                                         bool* const CommitFailed);
+      static bool SCSI_WriteSectors_Cached(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo,
+                                           const uint32_t BlockAddress,
+                                           const uint16_t TotalBlocks);
+      static bool SCSI_Command_Synchronize_Cache_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static bool SCSI_Command_Service_Action_In_16(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static bool SCSI_Command_Read_Capacity_16(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static bool SCSI_Command_Get_LBA_Status(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static bool SCSI_Command_Unmap(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static bool SCSI_Command_Write_Same_10(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static bool SCSI_DiscardSectors(const uint32_t BlockAddress,
+                                      const uint16_t TotalBlocks);
+      static void SCSI_Yield(void);
+      static bool SCSI_MapSectors(const uint32_t BlockAddress,
+                                  const uint16_t TotalBlocks);
+      static uint8_t SCSI_CommandIndex(const uint8_t Command);
+      static bool SCSI_Command_Log_Sense(USB_ClassInfo_MS_Device_t* const MSInterfaceInfo);
+      static uint16_t SCSI_Log_Parameter(uint8_t* const PageData,
+                                         const uint16_t PageLength,
+                                         const uint16_t ParameterPointer,
+                                         const uint16_t ParameterCode,
+                                         const void* const Value,
+                                         const uint8_t ValueLength);
     #endif
 
 #endif
@@ -10,6 +10,7 @@
  */
 
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 #include "Timer.h"
 
@@ -17,6 +18,7 @@ volatile uint32_t current_time;
 
 #if (defined(__AVR_ATmega32U4__) || defined(__AVR_ATmega32U2__)) // use TIMER0 compare interrupt to keep track of time
 volatile uint8_t helper_counter;
+volatile uint32_t timer0_overflows; // for timer_ticks()
 void Timer_Init(void) {
   TCCR0B |= (1 << CS00)|(1 << CS01); // prescaler F_CPU/64
   TCNT0 = 0; // initalize the counter
@@ -35,6 +37,7 @@ void Timer_Init(void) {
 
 // TIMER0 overflow interrupt handler
 ISR(TIMER0_OVF_vect) {
+  timer0_overflows++;
   helper_counter++;
   if(helper_counter>=TIMER_HELPER_CONSTANT) {
     current_time++;
@@ -42,7 +45,21 @@ ISR(TIMER0_OVF_vect) {
   }
 }
 
+uint32_t timer_ticks(void) {
+  uint32_t overflows;
+  uint8_t count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    overflows = timer0_overflows;
+    count = TCNT0;
+    // an overflow that the interrupt hasn't counted yet
+    if((TIFR0 & (1 << TOV0)) && count < 0x80)
+      overflows++;
+  }
+  return (overflows << 8) | count;
+}
+
 #elif defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__) // use internal RTC oscillator to generate interrupts
+volatile uint16_t tcc1_overflows; // for timer_ticks()
 void Timer_Init(void) {
   current_time = 0;
   //############################### Clock für RTC aktivieren
@@ -65,6 +82,12 @@ void Timer_Init(void) {
   //Timerregister CNT auf 0 stellen
   RTC.CNT   = 0;
   //RTC.COMP  = 2; // note: if COMP>PER, no 'compare' interrupt will ever be generated
+
+  //############################### TCC1 for timer_ticks(): F_CPU/64, free running
+  TCC1.PER = 0xFFFF;
+  TCC1.CNT = 0;
+  TCC1.INTCTRLA = TC_OVFINTLVL_HI_gc;
+  TCC1.CTRLA = TC_CLKSEL_DIV64_gc;
 }
 
 //################################################## ISR RTC 1Hz
@@ -75,6 +98,23 @@ ISR(RTC_OVF_vect) {
   //  PORTE.OUTTGL = 1;
 }
 
+ISR(TCC1_OVF_vect) {
+  tcc1_overflows++;
+}
+
+uint32_t timer_ticks(void) {
+  uint16_t overflows;
+  uint16_t count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    overflows = tcc1_overflows;
+    count = TCC1.CNT;
+    // an overflow that the interrupt hasn't counted yet
+    if((TCC1.INTFLAGS & TC1_OVFIF_bm) && count < 0x8000)
+      overflows++;
+  }
+  return ((uint32_t)overflows << 16) | count;
+}
+
 #else
   #error "You should define some timer in Timer.c for your ATMEL chip."
 #endif
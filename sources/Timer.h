@@ -2,6 +2,7 @@
  * Timer.h
  * (c) 2015 flabbergast
  *  implements Arduino-like millis() function via RTC timer interrupt (on XMEGAs)
+ *  and a finer free running tick counter, for measuring short times
  */
 
 #ifndef _PROJECT_TIMER_H_
@@ -10,4 +11,12 @@
 void Timer_Init(void);
 uint32_t millis10(void);
 
+// free running, counts F_CPU/64 (so wraps around after a few hours);
+//   only differences of two readings make sense
+uint32_t timer_ticks(void);
+
+// length of a timer_ticks() tick in microseconds, and in CPU cycles
+#define TIMER_TICK_MICROS (64000000UL / F_CPU)
+#define TIMER_TICK_CYCLES 64
+
 #endif
@@ -10,18 +10,187 @@
  */
 
 #include "crypto.h"
-#include "aes.h" // software AES
 #include <avr/pgmspace.h>
+#include <avr/interrupt.h>
 #include <string.h> // memcpy
 
 #if defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__) // use hardware AES accelerator on the xmega for AES128
 
+bool aes128_ctx_init(const uint8_t* key, aes128_ctx_t* ctx) {
+  memcpy(ctx->key, key, 16);
+  return AES_lastsubkey_generate(key, ctx->lastsubkey);
+}
+
+// State of the CBC (or XTS) in progress (see aes128_cbc_enc_start). The AES
+//  module runs in AUTO mode (it starts when the 16th byte is written to its
+//  state memory) and its interrupt takes the result and loads the next block.
+static const uint8_t *cbc_key; // key (lastsubkey for decryption); it needs loading for every block
+static uint8_t *cbc_data; // the block being worked on
+static uint16_t cbc_blocks_left;
+static bool cbc_decrypt;
+static bool cbc_xts;
+static volatile bool cbc_busy;
+static volatile bool cbc_error;
+static uint8_t cbc_chain[16]; // decryption: the previous ciphertext block (or the iv); XTS: the tweak
+static uint8_t cbc_next_chain[16]; // decryption: the ciphertext of the current block
+
+// Load the key and the block at cbc_data: this starts the AES module.
+static void aes128_cbc_load_block(void) {
+  uint8_t i;
+
+  for(i = 0; i < 16; i++)
+    AES.KEY = cbc_key[i];
+
+  if(cbc_xts) {
+    for(i = 0; i < 16; i++)
+      AES.STATE = cbc_data[i] ^ cbc_chain[i];
+  } else if(cbc_decrypt) {
+    // the block gets overwritten with the plaintext, but the next one needs its ciphertext
+    for(i = 0; i < 16; i++)
+      AES.STATE = cbc_next_chain[i] = cbc_data[i];
+  } else {
+    // XORed with the previous ciphertext block (or the iv) still in the state memory
+    for(i = 0; i < 16; i++)
+      AES.STATE = cbc_data[i];
+  }
+}
+
+// The AES module is done with a block
+ISR(AES_INT_vect) {
+  uint8_t i;
+
+  if(AES.STATUS & AES_ERROR_bm) {
+    AES.STATUS = AES_ERROR_bm;
+    AES.INTCTRL = AES_INTLVL_OFF_gc;
+    cbc_error = true;
+    cbc_busy = false;
+    return;
+  }
+
+  if(cbc_decrypt || cbc_xts) {
+    // XOR the result with the previous ciphertext block (the tweak), without starting again
+    AES.CTRL = (AES.CTRL & ~AES_AUTO_bm) | AES_XOR_bm;
+    for(i = 0; i < 16; i++)
+      AES.STATE = cbc_chain[i];
+    for(i = 0; i < 16; i++)
+      cbc_data[i] = AES.STATE;
+    if(cbc_xts)
+      aes128_xts_next_tweak(cbc_chain);
+    else
+      memcpy(cbc_chain, cbc_next_chain, 16);
+    AES.CTRL = (AES.CTRL & ~AES_XOR_bm) | AES_AUTO_bm;
+  } else {
+    for(i = 0; i < 16; i++)
+      cbc_data[i] = AES.STATE;
+  }
+
+  cbc_data += 16;
+  if(--cbc_blocks_left > 0) {
+    aes128_cbc_load_block();
+  } else {
+    AES.INTCTRL = AES_INTLVL_OFF_gc;
+    cbc_busy = false;
+  }
+}
+
+static bool aes128_cbc_start(const uint8_t* key, const uint8_t* iv, void* data, const uint16_t data_len, const bool decrypt, const bool xts) {
+  uint8_t i;
+
+  aes128_finish();
+  if(data_len % 16 != 0) {
+    return false;
+  }
+  if(data_len == 0) {
+    return true;
+  }
+
+  cbc_key = key;
+  cbc_data = data;
+  cbc_blocks_left = data_len / 16;
+  cbc_decrypt = decrypt;
+  cbc_xts = xts;
+  cbc_error = false;
+  cbc_busy = true;
+
+  AES.STATUS = (AES_ERROR_bm | AES_SRIF_bm);
+  if(decrypt || xts) {
+    memcpy(cbc_chain, iv, 16);
+    AES.CTRL = (AES.CTRL & ~(AES_DECRYPT_bm | AES_XOR_bm)) | (decrypt ? AES_DECRYPT_bm : 0) | AES_AUTO_bm;
+  } else {
+    // the iv goes to the state memory first, the first block is XORed with it
+    AES.CTRL = AES.CTRL & ~(AES_DECRYPT_bm | AES_XOR_bm | AES_AUTO_bm);
+    for(i = 0; i < 16; i++)
+      AES.STATE = iv[i];
+    AES.CTRL |= (AES_XOR_bm | AES_AUTO_bm);
+  }
+  AES.INTCTRL = AES_INTLVL_LO_gc;
+
+  aes128_cbc_load_block();
+  return true;
+}
+
+bool aes128_cbc_enc_start(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len) {
+  return aes128_cbc_start(ctx->key, iv, data, data_len, false, false);
+}
+
+bool aes128_cbc_dec_start(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len) {
+  return aes128_cbc_start(ctx->lastsubkey, iv, data, data_len, true, false);
+}
+
+bool aes128_xts_enc_start(const aes128_ctx_t* ctx, uint8_t* tweak, void* data, const uint16_t data_len) {
+  if(!aes128_cbc_start(ctx->key, tweak, data, data_len, false, true))
+    return false;
+  // the caller's copy goes ahead already (the interrupt has its own)
+  for(uint16_t i = 0; i < data_len; i += 16)
+    aes128_xts_next_tweak(tweak);
+  return true;
+}
+
+bool aes128_xts_dec_start(const aes128_ctx_t* ctx, uint8_t* tweak, void* data, const uint16_t data_len) {
+  if(!aes128_cbc_start(ctx->lastsubkey, tweak, data, data_len, true, true))
+    return false;
+  for(uint16_t i = 0; i < data_len; i += 16)
+    aes128_xts_next_tweak(tweak);
+  return true;
+}
+
+bool aes128_finish(void) {
+  while(cbc_busy) {
+  }
+  // turn off XOR and AUTO (the other functions expect that)
+  AES.CTRL = (AES.CTRL & ~(AES_XOR_bm | AES_AUTO_bm));
+  return !cbc_error;
+}
+
+uint16_t aes128_cbc_enc_ctx(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len) {
+  if(!aes128_cbc_enc_start(ctx, iv, data, data_len) || !aes128_finish())
+    return 0;
+  return data_len;
+}
+
+uint16_t aes128_cbc_dec_ctx(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len) {
+  if(!aes128_cbc_dec_start(ctx, iv, data, data_len) || !aes128_finish())
+    return 0;
+  return data_len;
+}
+
+bool aes128_enc_single_ctx(const aes128_ctx_t* ctx, void* data) {
+  return aes128_enc_single(ctx->key, data);
+}
+
+bool aes128_dec_single_ctx(const aes128_ctx_t* ctx, void* data) {
+  return aes128_dec_single(ctx->lastsubkey, data);
+}
+
 // Encrypt or decrypt a single 128bit block. data and key are assumed
 //  to be 16 uint8_t's. The mode is directly used to set AES.CTRL register.
 bool aes128_do_single(const uint8_t* key, void* data, uint8_t mode) {
   bool ok;
   uint8_t i;
 
+  // the AES module may still be busy with a CBC in the background
+  aes128_finish();
+
   // Load key into AES key memory.
   for(i = 0; i < 16; i++)
     AES.KEY = key[i];
@@ -71,6 +240,8 @@ uint16_t aes128_cbc_enc(const uint8_t* key, const uint8_t* iv, void* data, const
   uint16_t counter = 0;
   uint8_t i;
 
+  aes128_finish();
+
   // the first block uses IV (will be XORed with data later)
   for(i = 0; i < 16; i++)
     AES.STATE =  iv[i];
@@ -110,12 +281,38 @@ uint16_t aes128_cbc_enc(const uint8_t* key, const uint8_t* iv, void* data, const
   return(counter);
 }
 
+// Decrypt data with AES128-CBC. key, iv are 16 uint8_t's, data assumed to have
+//   data_len bytes, data_len needs to be divisible by 16 (ie padded).
+// XORed input for hardware AES doesn't help much here; could "save" on manual
+//  xoring... let's do it the same way as software AES.
+// Note that "key" is supposed to be "lastsubkey" when using hardware AES.
+uint16_t aes128_cbc_dec(const uint8_t* key, const uint8_t* iv, void *data, const uint16_t data_len){
+  if(data_len % 16 != 0) {
+    return 0;
+  }
+  uint8_t next_iv[16];
+  uint8_t cur_iv[16];
+  uint16_t counter = 0;
+  memcpy(cur_iv, iv, 16);
+  while(counter < data_len) {
+    memcpy(next_iv, data+counter, 16);
+    aes128_dec_single(key, data+counter);
+    for(uint8_t i=0; i<16; i++)
+      *((uint8_t *)data+counter+i) ^= cur_iv[i];
+    memcpy(cur_iv, next_iv, 16);
+    counter += 16;
+  }
+  return(counter);
+}
+
 // Generate the last subkey of the Expanded Key needed during decryption.
-bool AES_lastsubkey_generate(uint8_t * key, uint8_t * last_sub_key)
+bool AES_lastsubkey_generate(const uint8_t * key, uint8_t * last_sub_key)
 {
   bool keygen_ok;
   uint8_t i;
 
+  aes128_finish();
+
   // do a software reset to put the AES module in a known state
   AES.CTRL = AES_RESET_bm;
 
@@ -150,21 +347,99 @@ bool AES_lastsubkey_generate(uint8_t * key, uint8_t * last_sub_key)
 
 #else // software AES128 if not on xmega128a3u
 
-uint16_t aes128_cbc_enc(const uint8_t* key, const uint8_t* iv, void* data, const uint16_t data_len){
+#include "aes.h" // software AES
+
+// AES128-CBC of "blocks" 16 byte blocks in place, the whole chain in
+//  assembler (aes_cbc-asm.S)
+void aes128_cbc_enc_blocks(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, uint16_t blocks);
+void aes128_cbc_dec_blocks(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, uint16_t blocks);
+
+bool aes128_ctx_init(const uint8_t* key, aes128_ctx_t* ctx) {
+  aes128_init(key, ctx);
+  return true;
+}
+
+uint16_t aes128_cbc_enc_ctx(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len){
   if(data_len % 16 != 0) {
     return 0;
   }
-  uint8_t cur_iv[16];
-  uint16_t counter = 0;
-  memcpy(cur_iv, iv, 16);
-  while(counter < data_len) {
+  aes128_cbc_enc_blocks(ctx, iv, data, data_len / 16);
+  return data_len;
+}
+
+uint16_t aes128_cbc_dec_ctx(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len){
+  if(data_len % 16 != 0) {
+    return 0;
+  }
+  aes128_cbc_dec_blocks(ctx, iv, data, data_len / 16);
+  return data_len;
+}
+
+bool aes128_enc_single_ctx(const aes128_ctx_t* ctx, void* data){
+  aes128_enc(data, (aes128_ctx_t *)ctx);
+  return true;
+}
+
+bool aes128_dec_single_ctx(const aes128_ctx_t* ctx, void* data){
+  aes128_dec(data, (aes128_ctx_t *)ctx);
+  return true;
+}
+
+// no AES module to do it in the background
+bool aes128_cbc_enc_start(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len){
+  return (aes128_cbc_enc_ctx(ctx, iv, data, data_len) == data_len);
+}
+
+bool aes128_cbc_dec_start(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len){
+  return (aes128_cbc_dec_ctx(ctx, iv, data, data_len) == data_len);
+}
+
+bool aes128_finish(void){
+  return true;
+}
+
+static bool aes128_xts_do(const aes128_ctx_t* ctx, uint8_t* tweak, void* data, const uint16_t data_len, const bool decrypt){
+  if(data_len % 16 != 0) {
+    return false;
+  }
+  uint8_t *block = data;
+  for(uint16_t counter = 0; counter < data_len; counter += 16) {
     for(uint8_t i=0; i<16; i++)
-      *((uint8_t *)data+counter+i) ^= cur_iv[i];
-    aes128_enc_single(key, data+counter);
-    memcpy(cur_iv, data+counter, 16);
-    counter += 16;
+      block[i] ^= tweak[i];
+    if(decrypt)
+      aes128_dec(block, (aes128_ctx_t *)ctx);
+    else
+      aes128_enc(block, (aes128_ctx_t *)ctx);
+    for(uint8_t i=0; i<16; i++)
+      block[i] ^= tweak[i];
+    aes128_xts_next_tweak(tweak);
+    block += 16;
   }
-  return(counter);
+  return true;
+}
+
+bool aes128_xts_enc_start(const aes128_ctx_t* ctx, uint8_t* tweak, void* data, const uint16_t data_len){
+  return aes128_xts_do(ctx, tweak, data, data_len, false);
+}
+
+bool aes128_xts_dec_start(const aes128_ctx_t* ctx, uint8_t* tweak, void* data, const uint16_t data_len){
+  return aes128_xts_do(ctx, tweak, data, data_len, true);
+}
+
+uint16_t aes128_cbc_enc(const uint8_t* key, const uint8_t* iv, void* data, const uint16_t data_len){
+  aes128_ctx_t ctx;
+  aes128_init(key, &ctx);
+  uint16_t done = aes128_cbc_enc_ctx(&ctx, iv, data, data_len);
+  aes128_ctx_wipe(&ctx);
+  return done;
+}
+
+uint16_t aes128_cbc_dec(const uint8_t* key, const uint8_t* iv, void *data, const uint16_t data_len){
+  aes128_ctx_t ctx;
+  aes128_init(key, &ctx);
+  uint16_t done = aes128_cbc_dec_ctx(&ctx, iv, data, data_len);
+  aes128_ctx_wipe(&ctx);
+  return done;
 }
 
 // encrypt single 128bit block. data is assumed to be 16 uint8_t's
@@ -173,6 +448,7 @@ bool aes128_enc_single(const uint8_t* key, void* data){
   aes128_ctx_t ctx;
   aes128_init(key, &ctx);
   aes128_enc(data, &ctx);
+  aes128_ctx_wipe(&ctx);
   return true;
 }
 
@@ -182,33 +458,23 @@ bool aes128_dec_single(const uint8_t* key, void* data){
   aes128_ctx_t ctx;
   aes128_init(key, &ctx);
   aes128_dec(data, &ctx);
+  aes128_ctx_wipe(&ctx);
   return true;
 }
 
 #endif
 
-// Decrypt data with AES128-CBC. key, iv are 16 uint8_t's, data assumed to have
-//   data_len bytes, data_len needs to be divisible by 16 (ie padded).
-// XORed input for hardware AES doesn't help much here; could "save" on manual
-//  xoring... let's do it the same way as software AES (_single call uses hardware
-//  when available).
-// Note that "key" is supposed to be "lastsubkey" when using hardware AES.
-uint16_t aes128_cbc_dec(const uint8_t* key, const uint8_t* iv, void *data, const uint16_t data_len){
-  if(data_len % 16 != 0) {
-    return 0;
-  }
-  uint8_t next_iv[16];
-  uint8_t cur_iv[16];
-  uint16_t counter = 0;
-  memcpy(cur_iv, iv, 16);
-  while(counter < data_len) {
-    memcpy(next_iv, data+counter, 16);
-    aes128_dec_single(key, data+counter);
-    for(uint8_t i=0; i<16; i++)
-      *((uint8_t *)data+counter+i) ^= cur_iv[i];
-    memcpy(cur_iv, next_iv, 16);
-    counter += 16;
-  }
-  return(counter);
+void aes128_ctx_wipe(aes128_ctx_t* ctx) {
+  memset(ctx, 0, sizeof(aes128_ctx_t));
 }
 
+void aes128_xts_next_tweak(uint8_t* tweak) {
+  uint8_t carry = 0;
+  for(uint8_t i = 0; i < 16; i++) {
+    uint8_t next_carry = tweak[i] >> 7;
+    tweak[i] = (tweak[i] << 1) | carry;
+    carry = next_carry;
+  }
+  if(carry)
+    tweak[0] ^= 0x87;
+}
@@ -11,6 +11,67 @@
 #ifdef __cplusplus
 extern "C"{
 #endif
+
+// a 128bit key, prepared for use with the *_ctx functions below
+#if defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__)
+// the hardware AES module expands the key by itself (for every block), but
+//  it needs the last subkey for decryption
+typedef struct {
+  uint8_t key[16];
+  uint8_t lastsubkey[16];
+} aes128_ctx_t;
+#else
+// the expanded key (avr-crypto-lib), 176 bytes
+#include "aes_types.h"
+#endif
+
+// prepare "key" (16 uint8_t's) in "ctx": the key schedule runs only once here,
+//  not for every block
+bool aes128_ctx_init(const uint8_t* key, aes128_ctx_t* ctx);
+
+// forget the key in "ctx"
+void aes128_ctx_wipe(aes128_ctx_t* ctx);
+
+// encrypt multiple blocks of 128bit data with the key in "ctx", data_len must
+// be divisible by 16; iv is 16 uint8_t's
+uint16_t aes128_cbc_enc_ctx(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len);
+
+// decrypt multiple blocks of 128bit data with the key in "ctx", data_len must
+// be divisible by 16; iv is 16 uint8_t's
+uint16_t aes128_cbc_dec_ctx(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len);
+
+// encrypt single 128bit block (16 uint8_t's) with the key in "ctx"
+bool aes128_enc_single_ctx(const aes128_ctx_t* ctx, void* data);
+
+// decrypt single 128bit block (16 uint8_t's) with the key in "ctx"
+bool aes128_dec_single_ctx(const aes128_ctx_t* ctx, void* data);
+
+// start encrypting (decrypting) multiple blocks of 128bit data in place with
+// AES128-CBC, like aes128_cbc_enc_ctx (aes128_cbc_dec_ctx). On the xmega the
+// AES module does it in the background (one block after another, from its
+// interrupt), the CPU can do something else meanwhile; software AES just does
+// it right away. "iv" is only needed until this returns; "ctx" and "data" are
+// needed until aes128_finish(). Any previous one is finished first.
+bool aes128_cbc_enc_start(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len);
+bool aes128_cbc_dec_start(const aes128_ctx_t* ctx, const uint8_t* iv, void* data, const uint16_t data_len);
+
+// AES128-XTS: encrypt (decrypt) multiple blocks of 128bit data in place, like
+// aes128_cbc_*_start (also in the background on the xmega). "tweak" (16
+// uint8_t's) is the tweak of the first block (the encrypted data unit number);
+// on return it's already the tweak of the block after "data", to continue with.
+// The same "ctx" does both directions (on the xmega, the AES module needs the
+// lastsubkey for decryption, which is in it).
+bool aes128_xts_enc_start(const aes128_ctx_t* ctx, uint8_t* tweak, void* data, const uint16_t data_len);
+bool aes128_xts_dec_start(const aes128_ctx_t* ctx, uint8_t* tweak, void* data, const uint16_t data_len);
+
+// multiply "tweak" by x (alpha) in GF(2^128): the tweak of the next block in XTS
+void aes128_xts_next_tweak(uint8_t* tweak);
+
+// wait until the data of the last aes128_cbc_*_start or aes128_xts_*_start is
+// done. returns false if the AES module had an error.
+bool aes128_finish(void);
+
+// The functions below take the plain key and prepare it for every call.
 // encrypt multiple blocks of 128bit data, data_len must be divisible by 16
 // key and iv are assumed to be both 128bit thus 16 uint8_t's
 uint16_t aes128_cbc_enc(const uint8_t* key, const uint8_t* iv, void* data, const uint16_t data_len);
@@ -30,7 +91,7 @@ bool aes128_dec_single(const uint8_t* key, void* data);
 #if defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__)
 // hardware AES module needs a different key for decryption
 // this function computes it from the main key
-bool AES_lastsubkey_generate(uint8_t * key, uint8_t * last_sub_key);
+bool AES_lastsubkey_generate(const uint8_t * key, uint8_t * last_sub_key);
 #endif
 
 #ifdef __cplusplus
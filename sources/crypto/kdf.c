@@ -0,0 +1,119 @@
+/*
+ * kdf.c
+ * (c) 2015 flabbergast
+ *  Passphrase hashing (PBKDF2-HMAC-SHA256).
+ *  Credits:
+ *   - SHA256 is avr-crypto-lib's
+ *     https://git.cryptolib.org/avr-crypto-lib.git
+ */
+
+#include "kdf.h"
+#include <string.h> // memcpy, memset
+
+// zero "length" bytes at "p": unlike a memset of something that isn't used
+//  afterwards, the compiler can't leave this out
+static void kdf_wipe(void* p, uint16_t length) {
+  volatile uint8_t* v = p;
+
+  while(length--)
+    *v++ = 0;
+}
+
+void sha256_chain_block_init(uint8_t* block, const uint8_t prefix_blocks) {
+  uint32_t length_b = 8*SHA256_HASH_BYTES + SHA256_BLOCK_BITS*(uint32_t)prefix_blocks;
+
+  memset(block + SHA256_HASH_BYTES, 0, SHA256_BLOCK_BYTES - SHA256_HASH_BYTES);
+  block[SHA256_HASH_BYTES] = 0x80;
+  // the length in bits, big endian
+  block[SHA256_BLOCK_BYTES-3] = length_b >> 16;
+  block[SHA256_BLOCK_BYTES-2] = length_b >> 8;
+  block[SHA256_BLOCK_BYTES-1] = length_b & 0xFF;
+}
+
+void sha256_chain_step(const sha256_ctx_t* start, uint8_t* block) {
+  sha256_ctx_t state;
+
+  memcpy(&state, start, sizeof(sha256_ctx_t));
+  sha256_nextBlock(&state, block);
+  sha256_ctx2hash((sha256_hash_t *)block, &state);
+}
+
+void hmac_sha256_init(hmac_sha256_ctx_t* ctx, const void* key, const uint16_t key_len) {
+  uint8_t block[SHA256_BLOCK_BYTES];
+  uint8_t i;
+
+  // a key longer than a block is hashed first
+  memset(block, 0, SHA256_BLOCK_BYTES);
+  if(key_len > SHA256_BLOCK_BYTES) {
+    sha256((sha256_hash_t *)block, key, 8*(uint32_t)key_len);
+  } else {
+    memcpy(block, key, key_len);
+  }
+
+  for(i=0; i<SHA256_BLOCK_BYTES; i++)
+    block[i] ^= 0x36;
+  sha256_init(&ctx->inner);
+  sha256_nextBlock(&ctx->inner, block);
+  for(i=0; i<SHA256_BLOCK_BYTES; i++)
+    block[i] ^= 0x36 ^ 0x5c;
+  sha256_init(&ctx->outer);
+  sha256_nextBlock(&ctx->outer, block);
+
+  kdf_wipe(block, SHA256_BLOCK_BYTES); // it's the key
+}
+
+void hmac_sha256(const hmac_sha256_ctx_t* ctx, const void* msg, const uint8_t msg_len, uint8_t* mac) {
+  sha256_ctx_t state;
+
+  memcpy(&state, &ctx->inner, sizeof(sha256_ctx_t));
+  sha256_lastBlock(&state, msg, 8*(uint16_t)msg_len);
+  sha256_ctx2hash((sha256_hash_t *)mac, &state);
+  memcpy(&state, &ctx->outer, sizeof(sha256_ctx_t));
+  sha256_lastBlock(&state, mac, 8*SHA256_HASH_BYTES);
+  sha256_ctx2hash((sha256_hash_t *)mac, &state);
+}
+
+void pbkdf2_sha256_start(pbkdf2_sha256_state_t* state, const void* pass, const uint16_t pass_len, const uint8_t* salt, const uint8_t salt_len, const uint32_t iterations) {
+  hmac_sha256_init(&state->hmac, pass, pass_len);
+
+  // U_1 = HMAC(salt || INT(1)), the block number being big endian; u has room for them
+  memcpy(state->u, salt, salt_len);
+  state->u[salt_len] = 0;
+  state->u[salt_len+1] = 0;
+  state->u[salt_len+2] = 0;
+  state->u[salt_len+3] = 1;
+  hmac_sha256(&state->hmac, state->u, salt_len+4, state->u);
+  memcpy(state->dk, state->u, SHA256_HASH_BYTES);
+
+  // then U_j = HMAC(U_j-1). Both the inner and the outer hash have a 32 byte
+  //  message after the key block: same padding
+  sha256_chain_block_init(state->u, 1);
+  state->left = iterations ? (iterations - 1) : 0;
+}
+
+bool pbkdf2_sha256_continue(pbkdf2_sha256_state_t* state, uint32_t steps) {
+  uint8_t i;
+
+  while(state->left && steps) {
+    sha256_chain_step(&state->hmac.inner, state->u);
+    sha256_chain_step(&state->hmac.outer, state->u);
+    for(i=0; i<SHA256_HASH_BYTES; i++)
+      state->dk[i] ^= state->u[i];
+    state->left--;
+    steps--;
+  }
+  return (state->left == 0);
+}
+
+void pbkdf2_sha256_finish(pbkdf2_sha256_state_t* state, uint8_t* dk) {
+  memcpy(dk, state->dk, SHA256_HASH_BYTES);
+  kdf_wipe(state, sizeof(pbkdf2_sha256_state_t)); // pbkdf2_sha256's is on its stack
+}
+
+void pbkdf2_sha256(uint8_t* dk, const void* pass, const uint16_t pass_len, const uint8_t* salt, const uint8_t salt_len, const uint32_t iterations) {
+  pbkdf2_sha256_state_t state;
+
+  pbkdf2_sha256_start(&state, pass, pass_len, salt, salt_len, iterations);
+  pbkdf2_sha256_continue(&state, iterations);
+  pbkdf2_sha256_finish(&state, dk);
+}
@@ -0,0 +1,66 @@
+/*
+ * kdf.h
+ * (c) 2015 flabbergast
+ *  Passphrase hashing (PBKDF2-HMAC-SHA256): header file.
+ */
+
+#ifndef KDF_H
+#define KDF_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "sha256.h"
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// Hash chains (hashing a 32 byte hash again and again) go one SHA256 block
+//  per step: the hash sits in the first 32 bytes of a block that has the
+//  padding and the length in place already, so it's just the compression
+//  function (no sha256_lastBlock, which pads and counts on every call).
+// fill in the padding of "block" (64 bytes) for a 32 byte message that comes
+//  after "prefix_blocks" whole blocks
+void sha256_chain_block_init(uint8_t* block, const uint8_t prefix_blocks);
+
+// hash the first 32 bytes of "block" (prepared by sha256_chain_block_init),
+//  continuing from "start" (sha256_init's state for a plain hash), and put
+//  the result in their place
+void sha256_chain_step(const sha256_ctx_t* start, uint8_t* block);
+
+// HMAC-SHA256 with a key, prepared: the states after hashing the key
+//  XORed with ipad (opad), so that each HMAC is just two more blocks
+typedef struct {
+  sha256_ctx_t inner;
+  sha256_ctx_t outer;
+} hmac_sha256_ctx_t;
+
+// prepare "key" ("key_len" bytes) in "ctx"
+void hmac_sha256_init(hmac_sha256_ctx_t* ctx, const void* key, const uint16_t key_len);
+
+// HMAC of "msg" ("msg_len" bytes, at most 55) with the key in "ctx" into "mac"
+void hmac_sha256(const hmac_sha256_ctx_t* ctx, const void* msg, const uint8_t msg_len, uint8_t* mac);
+
+// PBKDF2-HMAC-SHA256 in progress (see pbkdf2_sha256_start)
+typedef struct {
+  hmac_sha256_ctx_t hmac;
+  uint8_t u[SHA256_BLOCK_BYTES]; // U_j, padded for sha256_chain_step
+  uint8_t dk[SHA256_HASH_BYTES]; // U_1 ^ ... ^ U_j
+  uint32_t left; // iterations
+} pbkdf2_sha256_state_t;
+
+// PBKDF2-HMAC-SHA256 (RFC 2898) of "pass" with "salt" (at most 51 bytes),
+//  32 bytes long (one block), a piece at a time: start does the first
+//  iteration ("pass" and "salt" aren't needed afterwards), continue does (at
+//  most) "steps" more and returns true when all of them are done, finish
+//  puts the result into "dk" and wipes "state". An iteration is two SHA256
+//  blocks (two sha256_chain_step's).
+void pbkdf2_sha256_start(pbkdf2_sha256_state_t* state, const void* pass, const uint16_t pass_len, const uint8_t* salt, const uint8_t salt_len, const uint32_t iterations);
+bool pbkdf2_sha256_continue(pbkdf2_sha256_state_t* state, uint32_t steps);
+void pbkdf2_sha256_finish(pbkdf2_sha256_state_t* state, uint8_t* dk);
+
+// the same in one go
+void pbkdf2_sha256(uint8_t* dk, const void* pass, const uint16_t pass_len, const uint8_t* salt, const uint8_t salt_len, const uint32_t iterations);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
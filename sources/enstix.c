@@ -10,14 +10,45 @@
 
 #include "crypto/crypto.h"
 #include "crypto/sha256.h"
+#include "crypto/kdf.h"
 
 #include "sd_raw/sd_raw.h"
+#include "DiskCache/DiskCache.h"
+#include "DiskMap/DiskMap.h"
+#include "DiskStats/DiskStats.h"
+#include "Timer.h"
 
 #include "apipage.h"
 
 #include <avr/eeprom.h>
 #include "eeprom_contents.c"
 
+/* How the disk is encrypted (chosen when provisioning, see scripts/encrypt-image.py).
+ * Anything but DISK_FORMAT_XTS is CBC-ESSIV: so is an erased EEPROM byte, and an
+ * eeprom_contents.c from before there was a choice doesn't have the byte at all. */
+#define DISK_FORMAT_CBC_ESSIV 0
+#define DISK_FORMAT_XTS       1
+#if !defined(EEPROM_DISK_FORMAT)
+uint8_t EEMEM disk_format_eeprom[] = {DISK_FORMAT_CBC_ESSIV};
+#endif
+
+/* How the passphrase is hashed (see scripts/generate-pass.py --kdf). Anything but KDF_PBKDF2 is
+ * the original SHA256 chain: HASH_ITERATIONS times for the passphrase hash, as many again for
+ * the check value in passphrase_hash_hash. With KDF_PBKDF2, the passphrase hash is
+ * PBKDF2-HMAC-SHA256(passphrase, salt, iterations), and the check value is just its SHA256
+ * (it's stretched already). In EEPROM: the type, the iterations (little endian), the salt. */
+#define KDF_SHA256_CHAIN 0
+#define KDF_PBKDF2       1
+#define KDF_SALT_BYTES   16
+typedef struct {
+  uint8_t type; // KDF_*
+  uint32_t iterations;
+  uint8_t salt[KDF_SALT_BYTES];
+} kdf_record_t;
+#if !defined(EEPROM_KDF)
+uint8_t EEMEM kdf_eeprom[sizeof(kdf_record_t)] = {KDF_SHA256_CHAIN};
+#endif
+
 #include <string.h>
 
 /*************************************************************************
@@ -25,6 +56,7 @@
  *************************************************************************/
 
 #define HASH_ITERATIONS 1000
+#define KDF_CALIBRATION_ITERATIONS 32 // timed by kdf_calibrate()
 
 /*  Encryption related: used both in main() and disk read/write callbacks. */
 #define PASSPHRASE_MAX_LEN 100
@@ -33,11 +65,34 @@ char temp_buf[PASSPHRASE_MAX_LEN];
 uint8_t pp_hash[32];
 uint8_t pp_hash_hash[32];
 uint8_t key[16];
-#if defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__)
-uint8_t lastsubkey[16]; // hardware AES module needs a different key for decryption
-#endif
-uint8_t key_hash[32];
+aes128_ctx_t key_ctx; // the main key, prepared once when unlocking
+aes128_ctx_t essiv_ctx; // the hash of the main key (for ESSIV), prepared the same way
 uint8_t iv[16];
+uint8_t disk_format; // DISK_FORMAT_*
+kdf_record_t kdf; // how the passphrase is hashed
+
+/* Hashing the passphrase takes seconds: the main loop does it a slice at a time (hashing_continue),
+ * with the USB tasks in between, and then goes on with the job (passphrase_hashed). */
+#define HASHING_NONE   0
+#define HASHING_UNLOCK 1 // 'p': then check it and unlock the disk
+#define HASHING_VERIFY 2 // 'c': the current passphrase; then ask for the new one
+#define HASHING_CHANGE 3 // 'c': the new passphrase; then save it
+#define HASHING_SLICE_MICROS 2000 // a slice is at least one step, and then until this much time went by
+struct {
+  uint8_t job; // HASHING_*
+  kdf_record_t record; // how
+  uint32_t step;
+  uint32_t steps;
+  uint8_t progress; // tens of percents shown
+  union {
+    pbkdf2_sha256_state_t pbkdf2;
+    struct {
+      sha256_ctx_t start;
+      uint8_t block[64]; // padded, see sha256_chain_step
+      uint8_t hash[32]; // once the chain goes on to the check value
+    } chain;
+  };
+} hashing;
 #if defined(USE_SDCARD)
 uint8_t sd_exists = 0;
 struct sd_raw_info sd_card_info;
@@ -52,7 +107,23 @@ void print_header(void);
 void print_sd_card_info(void);
 #endif
 void compute_iv_for_sector(uint32_t sectorNumber);
-void compute_many_hashes(const void *source, uint8_t count, uint8_t *hash);
+void compute_essiv(uint8_t out[16], const aes128_ctx_t *ctx, uint32_t sectorNumber);
+bool start_chain(uint8_t chain[16], const uint32_t sectorNumber, const uint32_t next_sector);
+void encrypt_chunk_start(uint8_t chain[16], uint8_t *chunk);
+bool decrypt_chunk_start(uint8_t chain[16], uint8_t *chunk);
+bool sector_is_zero(const uint8_t sectordata[DISK_BLOCK_SIZE]);
+void hashing_start(const uint8_t job, const kdf_record_t *record, const char *pass);
+bool hashing_continue(void);
+void print_hashing_progress(void);
+void hashing_finish(uint8_t *hash, uint8_t *check);
+void hashing_abort(void);
+void passphrase_hashed(void);
+uint32_t kdf_calibrate(void);
+void print_kdf(void);
+void finish_read_in_progress(void);
+int16_t read_failed(void);
+bool crypto_self_test(void);
+void crypto_benchmark(void);
 
 #if defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__)
 #define DISABLE_JTAG CPU_CCP = CCP_IOREG_gc; MCU.MCUCR = MCU_JTAGD_bm
@@ -100,6 +171,8 @@ int main(void)
 
   /* read the eeprom data into SRAM */
   eeprom_read_block((void*)key, (const void*)aes_key_encrypted, 16); // it's still encrypted at this point
+  disk_format = eeprom_read_byte(disk_format_eeprom);
+  eeprom_read_block((void*)&kdf, (const void*)kdf_eeprom, sizeof(kdf_record_t));
 
   /* Must throw away unused bytes from the host, or it will lock up while waiting for the device */
   usb_serial_flush_input();
@@ -117,6 +190,9 @@ int main(void)
       button_press_registered = true;
       // announce the button press over the serial
       usb_serial_writeln_P(PSTR("Button pressed."));
+      // there's no serial console in the storage only mode; the button brings it back
+      if(usb_storage_only_GLOBAL)
+        usb_set_storage_only(false);
       //usb_keyboard_press(HID_KEYBOARD_SC_N, HID_KEYBOARD_MODIFIER_LEFTSHIFT);
     }
     // was the button released after being pressed?
@@ -127,14 +203,27 @@ int main(void)
     // check dtr
     dtr = usb_serial_dtr();
     if( dtr && !prev_dtr ) {
-      _delay_ms(50);
+      usb_wait(5);
       print_header();
       print_help();
     }
     prev_dtr = dtr;
 
+    /* Hashing a passphrase: a slice at a time, so that USB keeps going; any key aborts it */
+    if(hashing.job != HASHING_NONE) {
+      if(usb_serial_available() > 0) {
+        usb_serial_flush_input();
+        hashing_abort();
+        usb_serial_writeln_P(PSTR("\r\nAborted. Not doing anything."));
+      } else {
+        bool done = hashing_continue();
+        print_hashing_progress();
+        if(done)
+          passphrase_hashed();
+      }
+    }
     /* Handling of the serial dialogue */
-    if( usb_serial_available() > 0 ) {
+    else if( usb_serial_available() > 0 ) {
       switch(usb_serial_getchar()) {
         case 'i': // info
           print_header();
@@ -147,6 +236,13 @@ int main(void)
             usb_serial_writeln_P(PSTR("not connected/communicating"));
           }
 #endif
+          usb_serial_write_P(PSTR("Disk format: "));
+          if(disk_format == DISK_FORMAT_XTS) {
+            usb_serial_writeln_P(PSTR("aes128-xts"));
+          } else {
+            usb_serial_writeln_P(PSTR("aes128-cbc-essiv"));
+          }
+          print_kdf();
           if(disk_state_GLOBAL == DISK_STATE_INITIAL) {
             usb_serial_write_P(PSTR("Encrypted main AES key: "));
             hexprint(key, 16);
@@ -163,45 +259,26 @@ int main(void)
             } else {
               usb_serial_writeln_P(PSTR("writable"));
             }
+            usb_serial_write_P(PSTR("Allocation map: "));
+            if(DiskMap_Active()) {
+              usb_serial_writeln_P(PSTR("yes (thin provisioned)"));
+            } else {
+              usb_serial_writeln_P(PSTR("no"));
+            }
+            usb_serial_write_P(PSTR("Sectors read from cache: "));
+            usb_serial_write_dec32(DiskCache_Hits);
+            usb_serial_write_P(PSTR(", from disk: "));
+            usb_serial_writeln_dec32(DiskCache_Misses);
           }
           break;
         case 'c': // change the password
           if(disk_state_GLOBAL == DISK_STATE_ENCRYPTING) {
             usb_serial_writeln_P(PSTR("Enter current passphrase:"));
             usb_serial_readline(passphrase, PASSPHRASE_MAX_LEN, true);
-            // compute hashes
-            usb_serial_writeln_P(PSTR("Computing hashes..."));
-            usb_tasks(); // so that the serial message gets through before we start computing...
-            compute_many_hashes((const void*)passphrase, strlen(passphrase), (uint8_t *)temp_buf);
-            compute_many_hashes((const void*)temp_buf, 32, (uint8_t *)passphrase); // reuse passphrase buffer for hash^^
-            int compare = memcmp((const void *)passphrase, (const void *)pp_hash_hash, 32);
+            // the rest comes once the hashes are computed (see passphrase_hashed)
+            usb_serial_write_P(PSTR("Computing hashes (any key aborts): "));
+            hashing_start(HASHING_VERIFY, &kdf, passphrase);
             memset(passphrase, 0xFF, PASSPHRASE_MAX_LEN); // wipe the passphrase from memory
-            if(compare == 0) {
-              usb_serial_writeln_P(PSTR("Enter a new passphrase:"));
-              usb_serial_readline(passphrase, PASSPHRASE_MAX_LEN, true);
-              usb_serial_writeln_P(PSTR("Enter the new passphrase again:"));
-              usb_serial_readline(temp_buf, PASSPHRASE_MAX_LEN, true);
-              compare = strcmp(passphrase, temp_buf);
-              memset(temp_buf, 0xFF, PASSPHRASE_MAX_LEN);
-              if(compare == 0) {
-                usb_serial_writeln_P(PSTR("Match. Changing the passphrase."));
-                usb_serial_writeln_P(PSTR("Computing hashes..."));
-                usb_tasks(); // so that the serial message gets through before we start computing...
-                compute_many_hashes((const void*)passphrase, strlen(passphrase), pp_hash);
-                memset(passphrase, 0xFF, PASSPHRASE_MAX_LEN); // wipe the passphrase from memory
-                compute_many_hashes((const void*)pp_hash, 32, pp_hash_hash);
-                memcpy(temp_buf, key, 16); // copy the key to a temp buffer for encrypting
-                aes128_enc_single(pp_hash, temp_buf); // encrypt the aes key
-                // save the new pp_hash_hash and encr.aes.key to EEPROM
-                eeprom_write_block((const void*)temp_buf, (void*)aes_key_encrypted, 16);
-                eeprom_write_block((const void*)pp_hash_hash, (void*)passphrase_hash_hash, 32);
-                usb_serial_writeln_P(PSTR("Done."));
-              } else {
-                usb_serial_writeln_P(PSTR("The passphrases don't match. Not changing anything."));
-              }
-            } else {
-              usb_serial_writeln_P(PSTR("Entered passphrase is not correct."));
-            }
           } else {
             usb_serial_writeln_P(PSTR("Passphrase changing works only in encrypted mode."));
           }
@@ -218,30 +295,21 @@ int main(void)
             char c = usb_serial_getchar();
             if(disk_read_only_GLOBAL) {
               if(c == 'Y' || c == 'y') {
-                usb_serial_write_P(PSTR("Switching to writable."));
-                usb_serial_writeln_P(PSTR("Everything will disconnect."));
-                usb_serial_write_P(PSTR("Press a key to continue..."));
-                usb_serial_wait_for_key();
-                USB_Disable();
+                usb_serial_writeln_P(PSTR("Switching to writable."));
                 disk_read_only_GLOBAL = false;
-                _delay_ms(1000);
-                USB_Init();
-                _delay_ms(200);
-                usb_serial_flush_input();
+                // the host learns about it on its next command to the disk
+                SCSI_Disk_Changed(SCSI_ASENSE_PARAMETERS_CHANGED, SCSI_ASENSEQ_MODE_PARAMETERS_CHANGED);
                 break;
               }
             } else {
               if(c != 'N' && c != 'n') {
-                usb_serial_write_P(PSTR("Switching to read-only."));
-                usb_serial_writeln_P(PSTR("Everything will disconnect."));
-                usb_serial_write_P(PSTR("Press a key to continue..."));
-                usb_serial_wait_for_key();
-                USB_Disable();
+                if(!DiskCache_Flush() || !DiskMap_Flush()) {
+                  usb_serial_writeln_P(PSTR("Problem: writing out the cached sectors failed. Staying writable."));
+                  break;
+                }
+                usb_serial_writeln_P(PSTR("Switching to read-only."));
                 disk_read_only_GLOBAL = true;
-                _delay_ms(1000);
-                USB_Init();
-                _delay_ms(200);
-                usb_serial_flush_input();
+                SCSI_Disk_Changed(SCSI_ASENSE_PARAMETERS_CHANGED, SCSI_ASENSEQ_MODE_PARAMETERS_CHANGED);
                 break;
               }
             }
@@ -254,54 +322,102 @@ int main(void)
           if(disk_state_GLOBAL == DISK_STATE_INITIAL) {
             usb_serial_writeln_P(PSTR("Enter passphrase:"));
             usb_serial_readline(passphrase, PASSPHRASE_MAX_LEN, true);
-            // compute hashes
-            usb_serial_writeln_P(PSTR("Computing hashes..."));
-            usb_tasks(); // so that the serial message gets through before we start computing...
-            compute_many_hashes((const void*)passphrase, strlen(passphrase), pp_hash);
-            compute_many_hashes((const void*)pp_hash, 32, pp_hash_hash);
+            // the hashes get computed by the main loop (see passphrase_hashed)
+            usb_serial_write_P(PSTR("Computing hashes (any key aborts): "));
+            hashing_start(HASHING_UNLOCK, &kdf, passphrase);
             // wipe the passphrase from memory
             memset(passphrase, 0xFF, PASSPHRASE_MAX_LEN);
-            // compare the hash of hash of the passphrase with the eeprom
-            bool match = true;
-            for(uint8_t i=0; i<32; i++) {
-              if(eeprom_read_byte(passphrase_hash_hash+i) != pp_hash_hash[i]) {
-                match = false;
+          } else {
+            usb_serial_writeln_P(PSTR("Already in encrypted disk mode."));
+          }
+          break;
+        case 'l': // lock
+          if(disk_state_GLOBAL == DISK_STATE_ENCRYPTING) {
+            usb_serial_writeln_P(PSTR("Locking the encrypted disk."));
+            if(!DiskCache_Flush() || !DiskMap_Flush())
+              usb_serial_writeln_P(PSTR("Problem: writing out the cached sectors failed."));
+            SCSI_Disk_Changed(SCSI_ASENSE_NOT_READY_TO_READY_CHANGE, SCSI_ASENSEQ_NO_QUALIFIER);
+            disk_state_GLOBAL = DISK_STATE_INITIAL;
+            disk_read_only_GLOBAL = true;
+            // forget everything about the key (the cached sectors get wiped by usb_tasks())
+            memset(pp_hash, 0, 32);
+            memset(pp_hash_hash, 0, 32);
+            aes128_ctx_wipe(&key_ctx);
+            aes128_ctx_wipe(&essiv_ctx);
+            memset(iv, 0, 16);
+            eeprom_read_block((void*)key, (const void*)aes_key_encrypted, 16); // encrypted again
+          } else {
+            usb_serial_writeln_P(PSTR("Not in encrypted disk mode."));
+          }
+          break;
+        case 't': // thin provisioning: create the allocation map
+#if defined(THIN_PROVISIONING)
+          if(disk_state_GLOBAL == DISK_STATE_ENCRYPTING && !disk_read_only_GLOBAL && sd_exists) {
+            usb_serial_writeln_P(PSTR("Create a new allocation map? The whole disk will read as zeros afterwards. [yN]"));
+            usb_serial_wait_for_key();
+            char c = usb_serial_getchar();
+            if(c == 'Y' || c == 'y') {
+              if(!DiskCache_Flush() || !DiskMap_Flush()) {
+                usb_serial_writeln_P(PSTR("Problem: writing out the cached sectors failed. Not doing anything."));
                 break;
               }
+              usb_serial_writeln_P(PSTR("Creating the allocation map..."));
+              // the disk has no medium meanwhile; usb_tasks() drops the cached sectors and the old map
+              SCSI_Disk_Changed(SCSI_ASENSE_NOT_READY_TO_READY_CHANGE, SCSI_ASENSEQ_NO_QUALIFIER);
+              disk_state_GLOBAL = DISK_STATE_INITIAL;
+              usb_tasks();
+              disk_size_GLOBAL = DiskMap_Format((uint32_t)(sd_card_info.capacity / DISK_BLOCK_SIZE), usb_tasks);
+              if(disk_size_GLOBAL) {
+                usb_serial_writeln_P(PSTR("Done. The disk is thin provisioned now."));
+              } else {
+                usb_serial_writeln_P(PSTR("Problem: writing the map failed."));
+                disk_size_GLOBAL = DiskMap_Open((uint32_t)(sd_card_info.capacity / DISK_BLOCK_SIZE));
+              }
+              disk_state_GLOBAL = DISK_STATE_ENCRYPTING;
+              SCSI_Disk_Changed(SCSI_ASENSE_NOT_READY_TO_READY_CHANGE, SCSI_ASENSEQ_NO_QUALIFIER);
+            } else {
+              usb_serial_writeln_P(PSTR("Not doing anything."));
             }
-            if(match) { // if the passphrase is correct
-#if defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__)
-                // hardware AES decryption needs another key
-                AES_lastsubkey_generate(pp_hash, lastsubkey);
-                aes128_dec_single(lastsubkey, key); // decrypt the aes key
-                AES_lastsubkey_generate(key, lastsubkey);
+          } else {
+            usb_serial_writeln_P(PSTR("This only works in encrypted mode, with the disk writable."));
+          }
 #else
-                aes128_dec_single(pp_hash, key); // decrypt the aes key
-#endif
-              sha256((sha256_hash_t *)key_hash, (const void*)key, 8*16); // remember the hash as well, for ESSIV
-              usb_serial_writeln_P(PSTR("Password OK. Switching to encrypted disk mode (everything will disconnect)."));
-              usb_serial_write_P(PSTR("Press a key to continue..."));
-              usb_serial_wait_for_key();
-              disk_state_GLOBAL = DISK_STATE_ENCRYPTING;
-              disk_read_only_GLOBAL = true;
-#if defined(USE_SDCARD)
-              if(sd_exists) {
-                disk_size_GLOBAL = (uint32_t)(sd_card_info.capacity / DISK_BLOCK_SIZE);
-              }
+          usb_serial_writeln_P(PSTR("Thin provisioning is not supported by this build."));
 #endif
-              USB_Disable();
-              // which to use? _Detach and _Attach; or _Disable and _Init; or _ResetInterface
-              // best experience with Disable/Init so far
-              _delay_ms(1000);
-              USB_Init();
-              _delay_ms(200);
-              usb_serial_flush_input();
-            } else {
-              usb_serial_writeln_P(PSTR("Problem: the entered passphrase is not correct. Not doing anything."));
+          break;
+        case 's': // storage only mode
+          if(disk_state_GLOBAL == DISK_STATE_ENCRYPTING) {
+            usb_serial_writeln_P(PSTR("Switch to storage only mode (faster disk, but no serial and keyboard)? [yN]"));
+            usb_serial_writeln_P(PSTR("Everything will disconnect; press the button to get the serial back."));
+            usb_serial_wait_for_key();
+            char c = usb_serial_getchar();
+            if(c == 'Y' || c == 'y') {
+              usb_serial_writeln_P(PSTR("Switching to storage only mode."));
+              usb_serial_flush_output();
+              usb_set_storage_only(true);
+              break;
             }
+            usb_serial_writeln_P(PSTR("Not doing anything."));
           } else {
-            usb_serial_writeln_P(PSTR("Already in encrypted disk mode."));
+            usb_serial_writeln_P(PSTR("This only works in encrypted mode."));
+          }
+          break;
+        case 'b': // crypto self-test and benchmark
+          crypto_self_test();
+          crypto_benchmark();
+          break;
+        case 'k': // passphrase hashing: calibrate PBKDF2
+          usb_serial_writeln_P(PSTR("Calibrating..."));
+          usb_tasks();
+          {
+            uint32_t iterations = kdf_calibrate();
+            usb_serial_write_P(PSTR("PBKDF2-HMAC-SHA256 iterations for "));
+            usb_serial_write_dec32(KDF_TARGET_MILLIS);
+            usb_serial_write_P(PSTR("ms here: "));
+            usb_serial_writeln_dec32(iterations);
           }
+          usb_serial_writeln_P(PSTR("(Changing the passphrase uses that; for the scripts: --kdf pbkdf2 --iterations N.)"));
+          print_kdf();
           break;
         default:
           print_help();
@@ -326,14 +442,56 @@ int main(void)
 // this should be 1 on atxmega128a3u
 
 int16_t CALLBACK_disk_readSector(uint8_t out_sectordata[DISK_BLOCK_SIZE], const uint32_t sectorNumber) {
-  /* compute iv */
-  compute_iv_for_sector(sectorNumber);
+  int16_t done;
 
-#if defined(USE_SDCARD)
-  if(sd_exists) {
-    sd_raw_read_block(sectorNumber, out_sectordata);
-  } else {
+  if(!CALLBACK_disk_readSector_begin(out_sectordata, sectorNumber))
     return 0;
+  do {
+    done = CALLBACK_disk_readSector_continue();
+  } while(done >= 0 && done < DISK_BLOCK_SIZE);
+
+  return (done < 0) ? 0 : DISK_BLOCK_SIZE;
+}
+
+/* State of the sector read in progress (see CALLBACK_disk_readSector_begin) */
+uint8_t *read_sectordata;
+uint16_t read_position = DISK_BLOCK_SIZE;
+uint8_t read_iv[16]; // CBC chaining value carried between the chunks
+uint32_t read_next_sector; // read_iv continues into this sector (0: into none, see start_chain)
+
+/* A read may be left unfinished in between USB/SCSI commands (read-ahead);
+ * the card has to be done with it before it can be used for anything else.
+ * (Nobody wants its data any more, so it doesn't matter if it fails.) */
+void finish_read_in_progress(void) {
+  while(read_position < DISK_BLOCK_SIZE)
+    CALLBACK_disk_readSector_continue();
+}
+
+bool CALLBACK_disk_readSector_begin(uint8_t out_sectordata[DISK_BLOCK_SIZE], const uint32_t sectorNumber) {
+  finish_read_in_progress();
+
+  /* never written (or discarded): zeros, nothing to read or decrypt */
+  if(!DiskMap_IsMapped(sectorNumber)) {
+    memset(out_sectordata, 0, DISK_BLOCK_SIZE);
+    read_next_sector = 0;
+    read_position = DISK_BLOCK_SIZE;
+    return true;
+  }
+
+  /* iv, or the chaining value from the previous sector of the logical block */
+  if(!start_chain(read_iv, sectorNumber, read_next_sector)) {
+    read_next_sector = 0;
+    return false;
+  }
+  read_next_sector = sectorNumber + 1;
+
+  read_sectordata = out_sectordata;
+  read_position = 0;
+
+#if defined(USE_SDCARD)
+  if(!sd_exists || !sd_raw_read_block_begin(sectorNumber)) {
+    read_next_sector = 0;
+    return false;
   }
 #else
   #if (defined(__AVR_ATxmega128A3U__))
@@ -345,87 +503,743 @@ int16_t CALLBACK_disk_readSector(uint8_t out_sectordata[DISK_BLOCK_SIZE], const
   #endif
 #endif
 
-  /* decrypt */
-#if defined(__AVR_ATxmega128A3U__) || defined(__AVR_ATxmega128A4U__)
-    // hardware AES module needs a different key for decryption
-    aes128_cbc_dec(lastsubkey, iv, out_sectordata, DISK_BLOCK_SIZE);
-#else
-    aes128_cbc_dec(key, iv, out_sectordata, DISK_BLOCK_SIZE);
+  return true;
+}
+
+/* The sector read in progress failed: it's over (the card is let go of), and
+ * the next sector can't continue its chain. */
+int16_t read_failed(void) {
+  aes128_finish();
+#if defined(USE_SDCARD)
+  sd_raw_read_block_end();
 #endif
+  read_position = DISK_BLOCK_SIZE;
+  read_next_sector = 0;
+  return -1;
+}
 
-  return DISK_BLOCK_SIZE;
+int16_t CALLBACK_disk_readSector_continue(void) {
+  uint8_t *chunk = read_sectordata + read_position;
+  uint32_t aes_start;
+  bool aes_ok;
+
+  if(read_position >= DISK_BLOCK_SIZE)
+    return DISK_BLOCK_SIZE;
+
+#if defined(USE_SDCARD)
+  // (meanwhile, the AES module may still be decrypting the previous chunk)
+  if(!sd_raw_read_block_chunk(chunk, DISK_PIPELINE_CHUNK_BYTES))
+    return read_failed();
+  DiskStats.SpiBytesRead += DISK_PIPELINE_CHUNK_BYTES;
+#endif
+
+  /* start decrypting (in the background, on the xmega), once the previous
+   * chunk is done: starting would wait for it anyway, but lose its result */
+  aes_start = timer_ticks();
+  aes_ok = aes128_finish() && decrypt_chunk_start(read_iv, chunk);
+  if(aes_ok && read_position + DISK_PIPELINE_CHUNK_BYTES == DISK_BLOCK_SIZE)
+    aes_ok = aes128_finish(); // the last one
+  DiskStats_AddTime(&DiskStats.AesMicros, aes_start);
+  if(!aes_ok)
+    return read_failed();
+
+  read_position += DISK_PIPELINE_CHUNK_BYTES;
+  if(read_position < DISK_BLOCK_SIZE) {
+    // the chunk being decrypted isn't ready yet
+    return read_position - DISK_PIPELINE_CHUNK_BYTES;
+  }
+
+#if defined(USE_SDCARD)
+  if(!sd_raw_read_block_end()) {
+    read_next_sector = 0;
+    return -1;
+  }
+#endif
+
+  return read_position;
 }
 
 int16_t CALLBACK_disk_writeSector(uint8_t in_sectordata[DISK_BLOCK_SIZE], const uint32_t sectorNumber) {
-  /* compute iv */
-  compute_iv_for_sector(sectorNumber);
+  int16_t done;
 
-  /* encrypt the data */
-  aes128_cbc_enc(key, iv, in_sectordata, DISK_BLOCK_SIZE);
+  if(!CALLBACK_disk_writeSector_begin(in_sectordata, sectorNumber))
+    return 0;
+  do {
+    done = CALLBACK_disk_writeSector_continue();
+  } while(done >= 0 && done < DISK_BLOCK_SIZE);
+  while(CALLBACK_disk_busy());
+
+  return (done < 0) ? 0 : DISK_BLOCK_SIZE;
+}
+
+/* State of the sector write in progress (see CALLBACK_disk_writeSector_begin) */
+uint8_t *write_sectordata;
+uint32_t write_sectornumber;
+uint16_t write_position;
+uint8_t write_iv[16]; // CBC chaining value carried between the chunks
+uint32_t write_next_sector; // write_iv continues into this sector (0: into none, see start_chain)
+bool write_aes_failed; // the card still gets the whole sector, but the write fails
+bool write_encrypted; // write_sectordata holds ciphertext (see CALLBACK_disk_writeSector_restore)
+
+bool CALLBACK_disk_writeSector_begin(uint8_t in_sectordata[DISK_BLOCK_SIZE], const uint32_t sectorNumber) {
+  write_encrypted = false;
+  finish_read_in_progress();
+  // the sector's ciphertext changes, the read chain can't continue from it
+  read_next_sector = 0;
+
+  /* zeros just unmap the sector (it reads back as zeros), nothing to encrypt or write */
+  if(DiskMap_Active() && sector_is_zero(in_sectordata) && DiskMap_Unmap(sectorNumber, 1)) {
+    write_next_sector = 0;
+    write_position = DISK_BLOCK_SIZE;
+    return true;
+  }
+  // otherwise the map has to say it's written before it is
+  if(!DiskMap_Map(sectorNumber, 1))
+    return false;
+
+  /* iv, or the chaining value from the previous sector of the logical block */
+  if(!start_chain(write_iv, sectorNumber, write_next_sector)) {
+    write_next_sector = 0;
+    return false;
+  }
+  // only valid once the whole sector went through (see CALLBACK_disk_writeSector_continue)
+  write_next_sector = 0;
+
+  write_sectordata = in_sectordata;
+  write_sectornumber = sectorNumber;
+  write_position = 0;
+  write_aes_failed = false;
 
 #if defined(USE_SDCARD)
-  if(sd_exists) {
-    sd_raw_write_block(sectorNumber, in_sectordata);
-  } else {
-    return 0;
+  if(!sd_exists || !sd_raw_write_block_begin(sectorNumber)) {
+    return false;
   }
 #else
   #if (defined(__AVR_ATxmega128A3U__)) // this can only happen on x128a3u
   if(__checkmagic()==0) { // do not run the code if not on Stephan Baerwolf's hardware/bootloader
-    return 0;
+    return false;
   }
+  #else
+  return false;
+  #endif
+#endif
+
+  return true;
+}
+
+int16_t CALLBACK_disk_writeSector_continue(void) {
+  uint8_t *chunk = write_sectordata + write_position;
+  uint32_t aes_start;
+
+  if(write_position >= DISK_BLOCK_SIZE)
+    return DISK_BLOCK_SIZE;
+
+  /* encrypt the data; the next chunk gets encrypted (in the background, on the
+   * xmega) while this one goes to the media */
+  aes_start = timer_ticks();
+  if(write_position == 0) {
+    encrypt_chunk_start(write_iv, chunk);
+    write_encrypted = true;
+  }
+  if(!aes128_finish())
+    write_aes_failed = true;
+  if(disk_format != DISK_FORMAT_XTS)
+    memcpy(write_iv, chunk + DISK_PIPELINE_CHUNK_BYTES - 16, 16); // the last ciphertext block chains into the next chunk
+  if(write_position + DISK_PIPELINE_CHUNK_BYTES < DISK_BLOCK_SIZE)
+    encrypt_chunk_start(write_iv, chunk + DISK_PIPELINE_CHUNK_BYTES);
+  DiskStats_AddTime(&DiskStats.AesMicros, aes_start);
+
+#if defined(USE_SDCARD)
+  sd_raw_write_block_chunk(chunk, DISK_PIPELINE_CHUNK_BYTES);
+  DiskStats.SpiBytesWritten += DISK_PIPELINE_CHUNK_BYTES;
+#endif
+
+  write_position += DISK_PIPELINE_CHUNK_BYTES;
+  if(write_position < DISK_BLOCK_SIZE)
+    return write_position;
+
+#if defined(USE_SDCARD)
+  if(!sd_raw_write_block_end() || write_aes_failed)
+    return -1;
+#else
+  #if (defined(__AVR_ATxmega128A3U__))
   /* write the data to flash */
   // figure out how many memory pages we need to write
-  uint_farptr_t write_to_page = DISK_AREA_BEGIN_PAGE + (sectorNumber * MEM_PAGES_PER_DISK_BLOCK);
+  uint_farptr_t write_to_page = DISK_AREA_BEGIN_PAGE + (write_sectornumber * MEM_PAGES_PER_DISK_BLOCK);
   // check that we're not going into the bootloader area
   if(write_to_page+MEM_PAGES_PER_DISK_BLOCK <= PROGMEM_PAGECOUNT-__reportBLSpagesize())
     for(uint8_t i=0; i<MEM_PAGES_PER_DISK_BLOCK; i++)
-      flash_writepage(in_sectordata+(BOOT_SECTION_PAGE_SIZE*i), write_to_page+i);
-  #else
-  return 0;
+      flash_writepage(write_sectordata+(BOOT_SECTION_PAGE_SIZE*i), write_to_page+i);
   #endif
 #endif
 
+  write_next_sector = write_sectornumber + 1;
   return DISK_BLOCK_SIZE;
 }
 
+bool CALLBACK_disk_writeSector_restore(void) {
+  uint8_t chain[16];
+  uint32_t aes_start;
+  bool aes_ok;
+
+  if(!write_encrypted)
+    return true;
+  write_encrypted = false;
+
+  // (with bigger logical blocks, this reads the chaining value from the media)
+  if(!start_chain(chain, write_sectornumber, 0))
+    return false;
+
+  aes_start = timer_ticks();
+  aes_ok = true;
+  for(uint16_t i = 0; aes_ok && i < DISK_BLOCK_SIZE; i += DISK_PIPELINE_CHUNK_BYTES)
+    aes_ok = decrypt_chunk_start(chain, write_sectordata + i) && aes128_finish();
+  DiskStats_AddTime(&DiskStats.AesMicros, aes_start);
+
+  return aes_ok;
+}
+
+bool CALLBACK_disk_busy(void) {
+#if defined(USE_SDCARD)
+  return sd_exists && sd_raw_busy();
+#else
+  return false;
+#endif
+}
+
+bool CALLBACK_disk_discardSectors(const uint32_t sectorNumber, const uint32_t count) {
+  read_next_sector = 0;
+  write_next_sector = 0;
+#if defined(USE_SDCARD)
+  finish_read_in_progress();
+  // with the allocation map, discarded sectors read back as zeros
+  if(DiskMap_Active() && !DiskMap_Unmap(sectorNumber, count))
+    return false;
+  return sd_exists && sd_raw_erase(sectorNumber, count);
+#else
+  return true; // the flash just keeps the old data
+#endif
+}
+
+bool CALLBACK_disk_canDiscard(void) {
+#if defined(USE_SDCARD)
+  return sd_exists && sd_card_info.flag_erase;
+#else
+  return true;
+#endif
+}
+
 /*************************************************************************
  * ----------------- Helper functions implementation --------------------*
  *************************************************************************/
 
-// uses global variables: iv, key_hash. Assumes key_hash has the hash of the key in it :)
+/* A logical block of the encrypted disk (ENCRYPTED_BLOCK_SECTORS sectors) is one CBC chain: its first
+ * sector starts with the iv, the others continue with the last ciphertext block of the previous
+ * sector. That's carried over when the sectors are done in order ("next_sector" is the sector the
+ * "chain" continues into); otherwise it's read from the media here.
+ * With XTS, a logical block is one data unit: "chain" is the tweak, which starts with the iv
+ * (the encrypted logical block number) and is multiplied by alpha for every AES block; that's
+ * just computed, nothing to read.
+ * Puts the value to start "sectorNumber" with into "chain"; false if reading the media failed. */
+bool start_chain(uint8_t chain[16], const uint32_t sectorNumber, const uint32_t next_sector) {
+  if(sectorNumber % ENCRYPTED_BLOCK_SECTORS == 0) {
+    compute_iv_for_sector(sectorNumber / ENCRYPTED_BLOCK_SECTORS);
+    memcpy(chain, iv, 16);
+    return true;
+  }
+  if(sectorNumber == next_sector)
+    return true;
+
+  if(disk_format == DISK_FORMAT_XTS) {
+    compute_iv_for_sector(sectorNumber / ENCRYPTED_BLOCK_SECTORS);
+    memcpy(chain, iv, 16);
+    for(uint16_t i = 0; i < (sectorNumber % ENCRYPTED_BLOCK_SECTORS) * (DISK_BLOCK_SIZE / 16); i++)
+      aes128_xts_next_tweak(chain);
+    return true;
+  }
+
+#if defined(USE_SDCARD)
+  if(!sd_exists || !sd_raw_read_block_begin(sectorNumber - 1))
+    return false;
+  for(uint16_t i = 0; i < DISK_BLOCK_SIZE; i += 16)
+    sd_raw_read_block_chunk(chain, 16);
+  if(!sd_raw_read_block_end())
+    return false;
+#else
+  #if (defined(__AVR_ATxmega128A3U__))
+  memcpy_PF(chain, (uint_farptr_t)DISK_AREA_BEGIN_BYTE+(uint_farptr_t)(sectorNumber*DISK_BLOCK_SIZE)-16, 16);
+  #else
+  memset(chain, ~((sectorNumber-1) & 0xff), 16);
+  #endif
+#endif
+  return true;
+}
+
+/* Start encrypting (decrypting) DISK_PIPELINE_CHUNK_BYTES at "chunk" (in place), continuing "chain"
+ * (see start_chain). When decrypting, "chain" is ready for the next chunk right away; when encrypting
+ * with CBC, it's the last ciphertext block, so only once aes128_finish() is done. Decrypting returns
+ * false if it couldn't be started. */
+void encrypt_chunk_start(uint8_t chain[16], uint8_t *chunk) {
+  if(disk_format == DISK_FORMAT_XTS)
+    aes128_xts_enc_start(&key_ctx, chain, chunk, DISK_PIPELINE_CHUNK_BYTES);
+  else
+    aes128_cbc_enc_start(&key_ctx, chain, chunk, DISK_PIPELINE_CHUNK_BYTES);
+}
+
+bool decrypt_chunk_start(uint8_t chain[16], uint8_t *chunk) {
+  uint8_t next_chain[16];
+
+  if(disk_format == DISK_FORMAT_XTS)
+    return aes128_xts_dec_start(&key_ctx, chain, chunk, DISK_PIPELINE_CHUNK_BYTES);
+
+  memcpy(next_chain, chunk + DISK_PIPELINE_CHUNK_BYTES - 16, 16);
+  if(!aes128_cbc_dec_start(&key_ctx, chain, chunk, DISK_PIPELINE_CHUNK_BYTES))
+    return false;
+  memcpy(chain, next_chain, 16);
+  return true;
+}
+
+bool sector_is_zero(const uint8_t sectordata[DISK_BLOCK_SIZE]) {
+  uint8_t bits = 0;
+  for(uint16_t i = 0; i < DISK_BLOCK_SIZE; i++)
+    bits |= sectordata[i];
+  return (bits == 0);
+}
+
+// uses global variables: iv, essiv_ctx. Assumes essiv_ctx has the hash of the key in it :)
+// with ENCRYPTED_BLOCK_SECTORS > 1, "sectorNumber" is the number of the logical block
+// (with XTS, this is the tweak of the first AES block: the hash of the key is the tweak key)
 void compute_iv_for_sector(uint32_t sectorNumber) {
-  /* compute iv for the sector */
+  uint32_t aes_start = timer_ticks();
+  compute_essiv(iv, &essiv_ctx, sectorNumber);
+  DiskStats_AddTime(&DiskStats.AesMicros, aes_start);
+}
+
+// the ESSIV value of "sectorNumber" into "out", "ctx" having the hash of the key
+void compute_essiv(uint8_t out[16], const aes128_ctx_t *ctx, uint32_t sectorNumber) {
   // prepare for encrypting sector number (endianness matters!)
-  memset(iv, 0, 16);
-  memcpy(iv, (const void*)&sectorNumber, sizeof(uint32_t));
+  memset(out, 0, 16);
+  memcpy(out, (const void*)&sectorNumber, sizeof(uint32_t));
   // encrypt the sn with aes128, the key being the hash of the main key
-  aes128_enc_single(key_hash, iv);
+  aes128_enc_single_ctx(ctx, out);
 }
 
 void print_help(void) {
-  usb_serial_writeln_P(PSTR("-> Help: [i]nfo | [r]o/rw | enter [p]assphrase | [c]hange passphrase"));
+  usb_serial_writeln_P(PSTR("-> Help: [i]nfo | [r]o/rw | enter [p]assphrase | [l]ock | [c]hange passphrase | [t]hin provisioning | [s]torage only | crypto [b]enchmark | [k]df calibration"));
 }
 
 void print_header(void) {
   usb_serial_writeln_P(FIRMWARE_VERSION);
 }
 
-void compute_many_hashes(const void *source, uint8_t count, uint8_t *hash) {
-  uint8_t temp_hash[32];
-  uint8_t *cur_src;
-  uint8_t *cur_dst;
-  uint8_t *swap_ptr;
+// the hashes of the passphrase given to hashing_start are ready: go on with what they were for
+void passphrase_hashed(void) {
+  uint8_t job = hashing.job;
 
-  sha256((sha256_hash_t *)hash, source, 8*count);
-  cur_src = hash;
-  cur_dst = temp_hash;
-  for(uint16_t j=1; j<HASH_ITERATIONS; j++) { // going to repeatedly hash
-    sha256((sha256_hash_t *)cur_dst, (const void*)cur_src, 8*32);
-    swap_ptr = cur_src; cur_src = cur_dst; cur_dst = swap_ptr; // switch src/dest (pp_hash vs temp_hash)
+  if(job == HASHING_UNLOCK) {
+    hashing_finish(pp_hash, pp_hash_hash);
+    // compare the hash of hash of the passphrase with the eeprom
+    bool match = true;
+    for(uint8_t i=0; i<32; i++) {
+      if(eeprom_read_byte(passphrase_hash_hash+i) != pp_hash_hash[i]) {
+        match = false;
+        break;
+      }
+    }
+    if(match) { // if the passphrase is correct
+      aes128_ctx_init(pp_hash, &key_ctx);
+      aes128_dec_single_ctx(&key_ctx, key); // decrypt the aes key
+      // the key schedules are done just once, here; the sectors use the contexts
+      aes128_ctx_init(key, &key_ctx);
+      sha256((sha256_hash_t *)temp_buf, (const void*)key, 8*16); // the hash of the key, for ESSIV
+      aes128_ctx_init((const uint8_t *)temp_buf, &essiv_ctx);
+      memset(temp_buf, 0xFF, 32);
+#if defined(DUAL_LUN)
+      usb_serial_writeln_P(PSTR("Password OK. The encrypted disk is now ready (second drive)."));
+#else
+      usb_serial_writeln_P(PSTR("Password OK. Switching to encrypted disk mode."));
+#endif
+      disk_read_only_GLOBAL = true;
+#if defined(USE_SDCARD)
+      if(sd_exists) {
+        // the allocation map (if there is one) takes the end of the card
+        disk_size_GLOBAL = DiskMap_Open((uint32_t)(sd_card_info.capacity / DISK_BLOCK_SIZE));
+        disk_erase_size_GLOBAL = sd_card_info.erase_size;
+        if(DiskMap_Active())
+          usb_serial_writeln_P(PSTR("The disk is thin provisioned (has an allocation map)."));
+      }
+#endif
+      // the encrypted disk's LUN gets its medium now: it's like inserting a disk
+      disk_state_GLOBAL = DISK_STATE_ENCRYPTING;
+      SCSI_Disk_Changed(SCSI_ASENSE_NOT_READY_TO_READY_CHANGE, SCSI_ASENSEQ_NO_QUALIFIER);
+    } else {
+      usb_serial_writeln_P(PSTR("Problem: the entered passphrase is not correct. Not doing anything."));
+    }
+  } else if(job == HASHING_VERIFY) {
+    hashing_finish((uint8_t *)temp_buf, (uint8_t *)temp_buf+32);
+    int compare = memcmp((const void *)(temp_buf+32), (const void *)pp_hash_hash, 32);
+    memset(temp_buf, 0xFF, PASSPHRASE_MAX_LEN);
+    if(compare == 0) {
+      usb_serial_writeln_P(PSTR("Enter a new passphrase:"));
+      usb_serial_readline(passphrase, PASSPHRASE_MAX_LEN, true);
+      usb_serial_writeln_P(PSTR("Enter the new passphrase again:"));
+      usb_serial_readline(temp_buf, PASSPHRASE_MAX_LEN, true);
+      compare = strcmp(passphrase, temp_buf);
+      memset(temp_buf, 0xFF, PASSPHRASE_MAX_LEN);
+      if(compare == 0) {
+        usb_serial_writeln_P(PSTR("Match. Changing the passphrase."));
+        // the new passphrase gets PBKDF2, with as many iterations as this chip does in KDF_TARGET_MILLIS
+        usb_serial_writeln_P(PSTR("Calibrating..."));
+        usb_tasks();
+        kdf_record_t record;
+        record.type = KDF_PBKDF2;
+        record.iterations = kdf_calibrate();
+        // the salt only needs to be new: the hash of the old one and the time (the user's typing)
+        memcpy(record.salt, kdf.salt, KDF_SALT_BYTES);
+        *(uint32_t *)record.salt ^= timer_ticks();
+        sha256((sha256_hash_t *)temp_buf, (const void*)&record, 8*sizeof(kdf_record_t));
+        memcpy(record.salt, temp_buf, KDF_SALT_BYTES);
+        memset(temp_buf, 0xFF, 32);
+        usb_serial_write_P(PSTR("Computing hashes (any key aborts): "));
+        hashing_start(HASHING_CHANGE, &record, passphrase);
+        memset(passphrase, 0xFF, PASSPHRASE_MAX_LEN); // wipe the passphrase from memory
+      } else {
+        memset(passphrase, 0xFF, PASSPHRASE_MAX_LEN);
+        usb_serial_writeln_P(PSTR("The passphrases don't match. Not changing anything."));
+      }
+    } else {
+      usb_serial_writeln_P(PSTR("Entered passphrase is not correct."));
+    }
+  } else if(job == HASHING_CHANGE) {
+    memcpy(&kdf, &hashing.record, sizeof(kdf_record_t));
+    hashing_finish(pp_hash, pp_hash_hash);
+    print_kdf();
+    memcpy(temp_buf, key, 16); // copy the key to a temp buffer for encrypting
+    aes128_enc_single(pp_hash, temp_buf); // encrypt the aes key
+    // save the new pp_hash_hash, encr.aes.key and the way they were computed to EEPROM
+    eeprom_write_block((const void*)temp_buf, (void*)aes_key_encrypted, 16);
+    eeprom_write_block((const void*)pp_hash_hash, (void*)passphrase_hash_hash, 32);
+    eeprom_write_block((const void*)&kdf, (void*)kdf_eeprom, sizeof(kdf_record_t));
+    memset(temp_buf, 0xFF, 32);
+    usb_serial_writeln_P(PSTR("Done."));
+  }
+}
+
+void hashing_start(const uint8_t job, const kdf_record_t *record, const char *pass) {
+  memset(&hashing, 0, sizeof(hashing));
+  hashing.job = job;
+  memcpy(&hashing.record, record, sizeof(kdf_record_t));
+  if(record->type == KDF_PBKDF2) {
+    pbkdf2_sha256_start(&hashing.pbkdf2, pass, strlen(pass), record->salt, KDF_SALT_BYTES, record->iterations);
+    hashing.steps = hashing.pbkdf2.left;
+  } else {
+    // the hash chain: after the first HASH_ITERATIONS (counting this one) it's the hash, after as
+    // many more the check value
+    sha256((sha256_hash_t *)hashing.chain.block, (const void*)pass, 8*strlen(pass));
+    sha256_chain_block_init(hashing.chain.block, 0);
+    sha256_init(&hashing.chain.start);
+    hashing.steps = 2*HASH_ITERATIONS - 1;
+  }
+}
+
+bool hashing_continue(void) {
+  uint32_t start = timer_ticks();
+
+  while(hashing.step < hashing.steps) {
+    if(hashing.record.type == KDF_PBKDF2) {
+      pbkdf2_sha256_continue(&hashing.pbkdf2, 1);
+    } else {
+      if(hashing.step == HASH_ITERATIONS - 1)
+        memcpy(hashing.chain.hash, hashing.chain.block, 32);
+      sha256_chain_step(&hashing.chain.start, hashing.chain.block);
+    }
+    hashing.step++;
+    if((timer_ticks() - start) * TIMER_TICK_MICROS >= HASHING_SLICE_MICROS)
+      break;
+  }
+  return (hashing.step == hashing.steps);
+}
+
+// show how far hashing_continue got, in tens of percents
+void print_hashing_progress(void) {
+  uint8_t progress = (hashing.steps ? (hashing.step * 10 / hashing.steps) : 10);
+
+  while(hashing.progress < progress) {
+    hashing.progress++;
+    usb_serial_write_dec8(hashing.progress * 10);
+    usb_serial_write_P(hashing.progress < 10 ? PSTR("% ") : PSTR("%\r\n"));
+  }
+}
+
+void hashing_finish(uint8_t *hash, uint8_t *check) {
+  if(hashing.record.type == KDF_PBKDF2) {
+    pbkdf2_sha256_finish(&hashing.pbkdf2, hash);
+    sha256((sha256_hash_t *)check, hash, 8*32);
+  } else {
+    memcpy(hash, hashing.chain.hash, 32);
+    memcpy(check, hashing.chain.block, 32);
+  }
+  hashing_abort();
+}
+
+void hashing_abort(void) {
+  memset(&hashing, 0, sizeof(hashing)); // also the job: HASHING_NONE
+}
+
+// how many PBKDF2 iterations this chip does in KDF_TARGET_MILLIS
+uint32_t kdf_calibrate(void) {
+  uint8_t dk[32];
+  uint32_t start = timer_ticks();
+  pbkdf2_sha256(dk, "enstix", 6, kdf.salt, KDF_SALT_BYTES, KDF_CALIBRATION_ITERATIONS);
+  uint32_t micros = (timer_ticks() - start) * TIMER_TICK_MICROS;
+  if(micros == 0)
+    micros = 1;
+  uint32_t iterations = (uint32_t)KDF_TARGET_MILLIS * 1000 * KDF_CALIBRATION_ITERATIONS / micros;
+  if(iterations < KDF_CALIBRATION_ITERATIONS)
+    iterations = KDF_CALIBRATION_ITERATIONS;
+  return iterations;
+}
+
+void print_kdf(void) {
+  usb_serial_write_P(PSTR("Passphrase hashing: "));
+  if(kdf.type == KDF_PBKDF2) {
+    usb_serial_write_P(PSTR("pbkdf2-hmac-sha256, "));
+    usb_serial_write_dec32(kdf.iterations);
+    usb_serial_write_P(PSTR(" iterations, salt "));
+    hexprint(kdf.salt, KDF_SALT_BYTES);
+  } else {
+    usb_serial_writeln_P(PSTR("sha256 chain (the original; changing the passphrase switches to pbkdf2)"));
   }
-  if( HASH_ITERATIONS % 2 == 0 )
-    memcpy(hash, temp_hash, 32);
+}
+
+/* Known answers for crypto_self_test(): FIPS-197 C.1, SP800-38A F.2.1, IEEE 1619 vector 2,
+ * FIPS 180-2 "abc", PBKDF2-HMAC-SHA256 of "password" and "salt" with 2 iterations (the
+ * SHA256 counterpart of the RFC 6070 vectors, which are HMAC-SHA1) and RFC 7914 section 11
+ * ("passwd" and "salt", 1 iteration; the first 32 of its 64 bytes), and what
+ * scripts/encrypt-image.py makes of the 64 bytes 0x00..0x3f at the start of sector 5 with
+ * the FIPS-197 key as the main key (ESSIV, CBC, XTS), and of the passphrase "abc"
+ * (hash^HASH_ITERATIONS). */
+const uint8_t PROGMEM test_fips_key[16] = {0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f};
+const uint8_t PROGMEM test_fips_pt[16] = {0x00,0x11,0x22,0x33,0x44,0x55,0x66,0x77,0x88,0x99,0xaa,0xbb,0xcc,0xdd,0xee,0xff};
+const uint8_t PROGMEM test_fips_ct[16] = {0x69,0xc4,0xe0,0xd8,0x6a,0x7b,0x04,0x30,0xd8,0xcd,0xb7,0x80,0x70,0xb4,0xc5,0x5a};
+const uint8_t PROGMEM test_cbc_key[16] = {0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c};
+const uint8_t PROGMEM test_cbc_pt[64] = {
+  0x6b,0xc1,0xbe,0xe2,0x2e,0x40,0x9f,0x96,0xe9,0x3d,0x7e,0x11,0x73,0x93,0x17,0x2a,
+  0xae,0x2d,0x8a,0x57,0x1e,0x03,0xac,0x9c,0x9e,0xb7,0x6f,0xac,0x45,0xaf,0x8e,0x51,
+  0x30,0xc8,0x1c,0x46,0xa3,0x5c,0xe4,0x11,0xe5,0xfb,0xc1,0x19,0x1a,0x0a,0x52,0xef,
+  0xf6,0x9f,0x24,0x45,0xdf,0x4f,0x9b,0x17,0xad,0x2b,0x41,0x7b,0xe6,0x6c,0x37,0x10};
+const uint8_t PROGMEM test_cbc_ct[64] = {
+  0x76,0x49,0xab,0xac,0x81,0x19,0xb2,0x46,0xce,0xe9,0x8e,0x9b,0x12,0xe9,0x19,0x7d,
+  0x50,0x86,0xcb,0x9b,0x50,0x72,0x19,0xee,0x95,0xdb,0x11,0x3a,0x91,0x76,0x78,0xb2,
+  0x73,0xbe,0xd6,0xb8,0xe3,0xc1,0x74,0x3b,0x71,0x16,0xe6,0x9e,0x22,0x22,0x95,0x16,
+  0x3f,0xf1,0xca,0xa1,0x68,0x1f,0xac,0x09,0x12,0x0e,0xca,0x30,0x75,0x86,0xe1,0xa7};
+const uint8_t PROGMEM test_xts_ct[32] = { // key1 = 0x11.., key2 = 0x22.., unit 0x3333333333, plaintext 0x44..
+  0xc4,0x54,0x18,0x5e,0x6a,0x16,0x93,0x6e,0x39,0x33,0x40,0x38,0xac,0xef,0x83,0x8b,
+  0xfb,0x18,0x6f,0xff,0x74,0x80,0xad,0xc4,0x28,0x93,0x82,0xec,0xd6,0xd3,0x94,0xf0};
+const uint8_t PROGMEM test_sha256_abc[32] = {
+  0xba,0x78,0x16,0xbf,0x8f,0x01,0xcf,0xea,0x41,0x41,0x40,0xde,0x5d,0xae,0x22,0x23,
+  0xb0,0x03,0x61,0xa3,0x96,0x17,0x7a,0x9c,0xb4,0x10,0xff,0x61,0xf2,0x00,0x15,0xad};
+const uint8_t PROGMEM test_pbkdf2[32] = {
+  0xae,0x4d,0x0c,0x95,0xaf,0x6b,0x46,0xd3,0x2d,0x0a,0xdf,0xf9,0x28,0xf0,0x6d,0xd0,
+  0x2a,0x30,0x3f,0x8e,0xf3,0xc2,0x51,0xdf,0xd6,0xe2,0xd8,0x5a,0x95,0x47,0x4c,0x43};
+const uint8_t PROGMEM test_pbkdf2_rfc7914[32] = {
+  0x55,0xac,0x04,0x6e,0x56,0xe3,0x08,0x9f,0xec,0x16,0x91,0xc2,0x25,0x44,0xb6,0x05,
+  0xf9,0x41,0x85,0x21,0x6d,0xde,0x04,0x65,0xe6,0x8b,0x9d,0x57,0xc2,0x0d,0xac,0xbc};
+const uint8_t PROGMEM test_tool_essiv[16] = {0x67,0x70,0x17,0xd8,0xcf,0x70,0xa0,0x7d,0xd0,0x81,0xfe,0xea,0x3e,0x60,0x64,0x7d};
+const uint8_t PROGMEM test_tool_cbc[16] = { // the last AES block
+  0xe8,0xe1,0x40,0x71,0xb6,0xdb,0x6c,0xc5,0x68,0xe6,0x76,0x49,0xe1,0x12,0x10,0xcd};
+const uint8_t PROGMEM test_tool_xts[16] = { // the last AES block
+  0x52,0xd6,0xfb,0x45,0x1d,0x47,0xde,0xac,0x06,0x3f,0xdf,0xd8,0x88,0xb4,0xd1,0x7f};
+const uint8_t PROGMEM test_tool_hash[32] = {
+  0xfc,0x8a,0x6b,0x86,0xa1,0x3f,0x71,0xcd,0x9a,0x67,0xf5,0x58,0xab,0x6f,0xd8,0x2a,
+  0x3d,0xd8,0x91,0x86,0x16,0x3a,0x01,0x7e,0xd8,0x05,0x1a,0xcf,0x6d,0x3f,0x8f,0x99};
+
+#ifndef SELF_TEST_ROUNDS // (the host build goes through more, its timer is relatively coarse)
+#define SELF_TEST_ROUNDS 16 // each benchmark goes through SELF_TEST_ROUNDS * 64 bytes
+#endif
+
+bool self_test_result(const char *name, const bool ok) {
+  usb_serial_write_P(name);
+  usb_serial_writeln_P(ok ? PSTR(": ok") : PSTR(": FAILED"));
+  return ok;
+}
+
+bool self_test_check(const char *name, const uint8_t *data, const uint8_t *expected_P, const uint8_t length) {
+  return self_test_result(name, memcmp_P(data, expected_P, length) == 0);
+}
+
+void self_test_report(const char *name, const uint32_t start_ticks, const uint32_t bytes) {
+  usb_serial_write_P(name);
+  usb_serial_write_P(PSTR(": "));
+  usb_serial_write_dec32((timer_ticks() - start_ticks) * TIMER_TICK_CYCLES / bytes);
+  usb_serial_writeln_P(PSTR(" cycles/byte"));
+}
+
+/* Check the crypto against known answers (including the ones of the python tools); returns
+ * whether all of them came out right. Only uses its own keys (the disk's are left alone)
+ * and the temp_buf. */
+bool crypto_self_test(void) {
+  aes128_ctx_t ctx;
+  sha256_ctx_t sha_start;
+  uint8_t *buf = (uint8_t *)temp_buf; // 64 bytes of data, then 16 of key/iv/tweak
+  uint8_t *aux = buf + 64;
+  uint16_t i;
+  bool ok = true;
+
+  usb_serial_writeln_P(PSTR("Crypto self-test:"));
+  memcpy_P(aux, test_fips_key, 16);
+  aes128_ctx_init(aux, &ctx);
+  memcpy_P(buf, test_fips_pt, 16);
+  aes128_enc_single_ctx(&ctx, buf);
+  ok &= self_test_check(PSTR("aes128 encrypt"), buf, test_fips_ct, 16);
+  aes128_dec_single_ctx(&ctx, buf);
+  ok &= self_test_check(PSTR("aes128 decrypt"), buf, test_fips_pt, 16);
+
+  memcpy_P(aux, test_cbc_key, 16);
+  aes128_ctx_init(aux, &ctx);
+  for(i = 0; i < 16; i++)
+    aux[i] = i;
+  memcpy_P(buf, test_cbc_pt, 64);
+  aes128_cbc_enc_start(&ctx, aux, buf, 64);
+  aes128_finish();
+  ok &= self_test_check(PSTR("aes128-cbc encrypt"), buf, test_cbc_ct, 64);
+  aes128_cbc_dec_start(&ctx, aux, buf, 64);
+  aes128_finish();
+  ok &= self_test_check(PSTR("aes128-cbc decrypt"), buf, test_cbc_pt, 64);
+
+  memset(aux, 0x11, 16);
+  aes128_ctx_init(aux, &ctx);
+  memset(aux, 0, 16);
+  aux[0] = aux[1] = aux[2] = aux[3] = aux[4] = 0x33; // the data unit (little endian)
+  memset(buf, 0x22, 16);
+  aes128_ctx_t tweak_ctx; // the tweak key: only needed for a moment
+  aes128_ctx_init(buf, &tweak_ctx);
+  aes128_enc_single_ctx(&tweak_ctx, aux);
+  aes128_ctx_wipe(&tweak_ctx);
+  memcpy(buf + 32, aux, 16); // the tweak again, for decrypting
+  memset(buf, 0x44, 32);
+  aes128_xts_enc_start(&ctx, aux, buf, 32);
+  aes128_finish();
+  ok &= self_test_check(PSTR("aes128-xts encrypt"), buf, test_xts_ct, 32);
+  aes128_xts_dec_start(&ctx, buf + 32, buf, 32);
+  aes128_finish();
+  for(i = 0; i < 32 && buf[i] == 0x44; i++)
+    ;
+  ok &= self_test_result(PSTR("aes128-xts decrypt"), i == 32);
+
+  sha256((sha256_hash_t *)buf, "abc", 8*3);
+  ok &= self_test_check(PSTR("sha256"), buf, test_sha256_abc, 32);
+  for(i = 0; i < 32; i++)
+    buf[i] = i;
+  sha256((sha256_hash_t *)aux, buf, 8*32); // into the 32 bytes after buf's 64
+  sha256_init(&sha_start);
+  sha256_chain_block_init(buf, 0);
+  sha256_chain_step(&sha_start, buf);
+  ok &= self_test_result(PSTR("sha256 hash chain step"), memcmp(buf, aux, 32) == 0);
+  pbkdf2_sha256(buf, "password", 8, (const uint8_t *)"salt", 4, 2);
+  ok &= self_test_check(PSTR("pbkdf2-hmac-sha256"), buf, test_pbkdf2, 32);
+  pbkdf2_sha256(buf, "passwd", 6, (const uint8_t *)"salt", 4, 1);
+  ok &= self_test_check(PSTR("pbkdf2-hmac-sha256 (rfc 7914)"), buf, test_pbkdf2_rfc7914, 32);
+
+  // the way scripts/encrypt-image.py does it
+  memcpy_P(aux, test_fips_key, 16);
+  sha256((sha256_hash_t *)buf, aux, 8*16);
+  aes128_ctx_init(buf, &ctx);
+  compute_essiv(aux, &ctx, 5);
+  ok &= self_test_check(PSTR("tool: essiv"), aux, test_tool_essiv, 16);
+  memcpy_P(buf, test_fips_key, 16);
+  aes128_ctx_init(buf, &ctx);
+  for(i = 0; i < 64; i++)
+    buf[i] = i;
+  aes128_cbc_enc_start(&ctx, aux, buf, 64);
+  aes128_finish();
+  ok &= self_test_check(PSTR("tool: aes128-cbc-essiv"), buf + 48, test_tool_cbc, 16);
+  for(i = 0; i < 64; i++)
+    buf[i] = i;
+  aes128_xts_enc_start(&ctx, aux, buf, 64); // the essiv is the tweak
+  aes128_finish();
+  ok &= self_test_check(PSTR("tool: aes128-xts"), buf + 48, test_tool_xts, 16);
+  kdf_record_t record;
+  record.type = KDF_SHA256_CHAIN;
+  hashing_start(HASHING_NONE, &record, "abc");
+  while(!hashing_continue())
+    usb_tasks();
+  hashing_finish(buf, buf + 32);
+  ok &= self_test_check(PSTR("tool: passphrase hash"), buf, test_tool_hash, 32);
+
+  usb_serial_writeln_P(ok ? PSTR("All OK.") : PSTR("Problem: some of the results are wrong!"));
+
+  aes128_ctx_wipe(&ctx);
+  memset(temp_buf, 0xFF, PASSPHRASE_MAX_LEN);
+  return ok;
+}
+
+/* Time the primitives that the disk uses, like crypto_self_test() with its own key and
+ * the temp_buf. */
+void crypto_benchmark(void) {
+  aes128_ctx_t ctx;
+  sha256_ctx_t sha_start;
+  uint8_t *buf = (uint8_t *)temp_buf;
+  uint8_t *aux = buf + 64;
+  uint32_t start;
+  uint16_t i;
+
+  usb_serial_writeln_P(PSTR("Crypto benchmark:"));
+  usb_tasks();
+  memset(buf, 0, 80);
+  sha256_init(&sha_start);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS; i++)
+    aes128_ctx_init(aux, &ctx);
+  self_test_report(PSTR("aes128 key schedule (per key byte)"), start, SELF_TEST_ROUNDS * 16);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS * 4; i++)
+    aes128_enc_single_ctx(&ctx, buf + (i % 4) * 16);
+  self_test_report(PSTR("aes128 block"), start, SELF_TEST_ROUNDS * 64);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS; i++) {
+    aes128_cbc_enc_start(&ctx, aux, buf, 64);
+    aes128_finish();
+  }
+  self_test_report(PSTR("aes128-cbc encrypt"), start, SELF_TEST_ROUNDS * 64);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS; i++) {
+    aes128_cbc_dec_start(&ctx, aux, buf, 64);
+    aes128_finish();
+  }
+  self_test_report(PSTR("aes128-cbc decrypt"), start, SELF_TEST_ROUNDS * 64);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS; i++) {
+    aes128_xts_enc_start(&ctx, aux, buf, 64);
+    aes128_finish();
+  }
+  self_test_report(PSTR("aes128-xts encrypt"), start, SELF_TEST_ROUNDS * 64);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS; i++) {
+    aes128_xts_dec_start(&ctx, aux, buf, 64);
+    aes128_finish();
+  }
+  self_test_report(PSTR("aes128-xts decrypt"), start, SELF_TEST_ROUNDS * 64);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS; i++)
+    compute_essiv(aux, &ctx, i);
+  self_test_report(PSTR("essiv (per sector byte)"), start, SELF_TEST_ROUNDS * DISK_BLOCK_SIZE);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS; i++)
+    sha256((sha256_hash_t *)aux, buf, 8*64);
+  self_test_report(PSTR("sha256"), start, SELF_TEST_ROUNDS * 64);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS; i++)
+    sha256((sha256_hash_t *)buf, buf, 8*32);
+  self_test_report(PSTR("sha256 of a hash (per hash byte)"), start, SELF_TEST_ROUNDS * 32);
+  sha256_chain_block_init(buf, 0);
+  start = timer_ticks();
+  for(i = 0; i < SELF_TEST_ROUNDS; i++)
+    sha256_chain_step(&sha_start, buf);
+  self_test_report(PSTR("sha256 hash chain step (per hash byte)"), start, SELF_TEST_ROUNDS * 32);
+
+  aes128_ctx_wipe(&ctx);
+  memset(temp_buf, 0xFF, PASSPHRASE_MAX_LEN);
 }
 
 #if defined(USE_SDCARD)
@@ -440,6 +1254,8 @@ void print_sd_card_info() {
                                           usb_serial_writeln_dec8(sd_card_info.manufacturing_year);
   usb_serial_write_P(PSTR("size:     ")); usb_serial_write_dec32(sd_card_info.capacity / 1024 / 1024);
                                           usb_serial_writeln_P(PSTR("MB"));
+  usb_serial_write_P(PSTR("alloc.u.: ")); usb_serial_write_dec32(sd_card_info.erase_size / 2);
+                                          usb_serial_writeln_P(PSTR("kB"));
   usb_serial_write_P(PSTR("content:  ")); (sd_card_info.flag_copy ?
                                            usb_serial_writeln_P(PSTR("original")) :
                                            usb_serial_writeln_P(PSTR("copy")));
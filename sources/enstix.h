@@ -12,10 +12,28 @@
  * Its purpose is to:
  * (1) read a sector "sectorNumber" (starting at 0),
  * (2) put the secotors content into "out_sectordata"
- * (3) return the number of bytes read - usually 512 (DISK_BLOCK_SIZE).
+ * (3) return the number of bytes read - usually 512 (DISK_BLOCK_SIZE),
+ *     0 if it failed.
  */
 int16_t CALLBACK_disk_readSector(uint8_t out_sectordata[DISK_BLOCK_SIZE], const uint32_t sectorNumber);
 
+/* "CALLBACK_disk_readSector_begin" and "CALLBACK_disk_readSector_continue"
+ * do the same work as CALLBACK_disk_readSector, but in small steps, so that
+ * the USB/SCSI stack can feed the previous sector to the host in between.
+ * Only one such read can be in progress at a time.
+ * _begin:
+ * (1) start reading sector "sectorNumber" into "out_sectordata",
+ * (2) return false if the read can't be started.
+ * _continue:
+ * (1) read and decrypt the next DISK_PIPELINE_CHUNK_BYTES of the sector,
+ * (2) return the number of bytes of "out_sectordata" that are ready
+ *     (DISK_BLOCK_SIZE when the sector is done), or -1 if reading or
+ *     decrypting failed; the read is over then (the next call returns
+ *     DISK_BLOCK_SIZE, but the sector's data is no good).
+ */
+bool CALLBACK_disk_readSector_begin(uint8_t out_sectordata[DISK_BLOCK_SIZE], const uint32_t sectorNumber);
+int16_t CALLBACK_disk_readSector_continue(void);
+
 /* "CALLBACK_disk_writeSector" is called internally by the USB/SCSI stack.
  * Its purpose is to:
  * (1) put the content "in_sectordata" on the media at sector "sectorNumber"
@@ -23,4 +41,52 @@ int16_t CALLBACK_disk_readSector(uint8_t out_sectordata[DISK_BLOCK_SIZE], const
  */
 int16_t CALLBACK_disk_writeSector(uint8_t in_sectordata[DISK_BLOCK_SIZE], const uint32_t sectorNumber);
 
+/* "CALLBACK_disk_writeSector_begin" and "CALLBACK_disk_writeSector_continue"
+ * split the work of CALLBACK_disk_writeSector into small steps, so that the
+ * USB/SCSI stack can receive the next sector from the host in between.
+ * Only one such write can be in progress at a time; "in_sectordata" is
+ * encrypted in place.
+ * _begin:
+ * (1) start writing "in_sectordata" to the media at sector "sectorNumber",
+ * (2) return false if the write can't be started.
+ * _continue:
+ * (1) encrypt the next DISK_PIPELINE_CHUNK_BYTES of the sector and pass
+ *     them on to the media,
+ * (2) return the number of bytes done (DISK_BLOCK_SIZE when the whole
+ *     sector was handed over to the media), or -1 if the media refused it.
+ */
+bool CALLBACK_disk_writeSector_begin(uint8_t in_sectordata[DISK_BLOCK_SIZE], const uint32_t sectorNumber);
+int16_t CALLBACK_disk_writeSector_continue(void);
+
+/* "CALLBACK_disk_writeSector_restore" is for a caller that keeps using the
+ * sector after writing it (the allocation map), instead of a copy. Its
+ * purpose is to:
+ * (1) decrypt the "in_sectordata" of the last CALLBACK_disk_writeSector
+ *     back in place, whether the write succeeded or not (nothing to do
+ *     if it didn't get as far as encrypting it),
+ * (2) return false if decrypting failed (the data is no good then).
+ */
+bool CALLBACK_disk_writeSector_restore(void);
+
+/* "CALLBACK_disk_busy" returns true while the media is still busy storing
+ * the last written sector. It shouldn't block.
+ */
+bool CALLBACK_disk_busy(void);
+
+/* "CALLBACK_disk_discardSectors" is called by the USB/SCSI stack when the
+ * host doesn't need "count" sectors starting at "sectorNumber" any more
+ * (UNMAP, WRITE SAME with the UNMAP bit). Its purpose is to:
+ * (1) let the media forget about them (e.g. erase them on the SD card);
+ *     their contents are undefined afterwards,
+ * (2) return false if that failed.
+ * It may return before the media is done (see CALLBACK_disk_busy).
+ */
+bool CALLBACK_disk_discardSectors(const uint32_t sectorNumber, const uint32_t count);
+
+/* "CALLBACK_disk_canDiscard" tells whether CALLBACK_disk_discardSectors
+ * works with the media at all (e.g. not with MMC cards), so that the
+ * USB/SCSI stack only offers UNMAP to the host if it does.
+ */
+bool CALLBACK_disk_canDiscard(void);
+
 #endif
@@ -0,0 +1,139 @@
+/*
+ * card.c
+ * (c) 2015 flabbergast
+ *  Host build: the SD card (the sd_raw API the firmware uses), a file. A
+ *  block is read (written) as a whole at the end of the transfer, the
+ *  chunks go through a block buffer like they'd go over SPI.
+ */
+
+#define _HOST_NO_COUNTING_
+#include "host.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../sd_raw/sd_raw.h"
+
+static int card_fd = -1;
+static offset_t card_blocks;
+
+/* the block being read or written, and where in it the next chunk goes */
+static uint8_t card_block[SD_BLOCK_SIZE];
+static offset_t card_block_number;
+static uint16_t card_position;
+
+/* reading this block fails half way through (see card_fail_read) */
+static offset_t card_failing_block = (offset_t)-1;
+static uint16_t card_read_limit; // of the block being read
+
+/* writing this block fails (see card_fail_write) */
+static offset_t card_failing_write = (offset_t)-1;
+
+bool card_open(const char *filename) {
+  struct stat st;
+
+  card_fd = open(filename, O_RDWR);
+  if(card_fd < 0 || fstat(card_fd, &st) < 0) {
+    perror(filename);
+    return false;
+  }
+  card_blocks = st.st_size / SD_BLOCK_SIZE;
+  return true;
+}
+
+void card_fail_read(const uint32_t block) {
+  card_failing_block = (block == UINT32_MAX) ? (offset_t)-1 : block;
+}
+
+void card_fail_write(const uint32_t block) {
+  card_failing_write = (block == UINT32_MAX) ? (offset_t)-1 : block;
+}
+
+void card_close(void) {
+  if(card_fd >= 0)
+    close(card_fd);
+  card_fd = -1;
+}
+
+uint8_t sd_raw_init(void) {
+  return card_fd >= 0;
+}
+
+uint8_t sd_raw_available(void) {
+  return card_fd >= 0;
+}
+
+uint8_t sd_raw_locked(void) {
+  return 0;
+}
+
+uint8_t sd_raw_get_info(struct sd_raw_info* info) {
+  memset(info, 0, sizeof(*info));
+  memcpy(info->product, "IMAGE", 5);
+  info->capacity = card_blocks * SD_BLOCK_SIZE;
+  info->erase_size = 8192; // 4MB, like most cards
+  info->flag_erase = 1;
+  return card_fd >= 0;
+}
+
+uint8_t sd_raw_read_block_begin(offset_t block) {
+  if(block >= card_blocks ||
+     pread(card_fd, card_block, SD_BLOCK_SIZE, block * SD_BLOCK_SIZE) != SD_BLOCK_SIZE)
+    return 0;
+  card_block_number = block;
+  card_position = 0;
+  card_read_limit = (block == card_failing_block) ? SD_BLOCK_SIZE / 2 : SD_BLOCK_SIZE;
+  return 1;
+}
+
+uint8_t sd_raw_read_block_chunk(uint8_t* buffer, uint16_t length) {
+  if(card_position + length > card_read_limit)
+    return 0;
+  memcpy(buffer, card_block + card_position, length);
+  card_position += length;
+  host_counters.CardBytesRead += length;
+  return 1;
+}
+
+uint8_t sd_raw_read_block_end(void) {
+  return card_position == SD_BLOCK_SIZE;
+}
+
+uint8_t sd_raw_write_block_begin(offset_t block) {
+  if(block >= card_blocks)
+    return 0;
+  card_block_number = block;
+  card_position = 0;
+  return 1;
+}
+
+void sd_raw_write_block_chunk(const uint8_t* buffer, uint16_t length) {
+  if(card_position + length > SD_BLOCK_SIZE)
+    length = SD_BLOCK_SIZE - card_position;
+  memcpy(card_block + card_position, buffer, length);
+  card_position += length;
+  host_counters.CardBytesWritten += length;
+}
+
+uint8_t sd_raw_write_block_end(void) {
+  return card_position == SD_BLOCK_SIZE && card_block_number != card_failing_write &&
+         pwrite(card_fd, card_block, SD_BLOCK_SIZE, card_block_number * SD_BLOCK_SIZE) == SD_BLOCK_SIZE;
+}
+
+uint8_t sd_raw_busy(void) {
+  return 0;
+}
+
+// erased blocks read back as zeros (DATA_STAT_AFTER_ERASE of most cards)
+uint8_t sd_raw_erase(offset_t block, uint32_t count) {
+  static const uint8_t zeros[SD_BLOCK_SIZE];
+
+  if(block + count > card_blocks)
+    return 0;
+  for(; count; count--, block++)
+    if(pwrite(card_fd, zeros, SD_BLOCK_SIZE, block * SD_BLOCK_SIZE) != SD_BLOCK_SIZE)
+      return 0;
+  return 1;
+}
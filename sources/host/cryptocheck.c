@@ -0,0 +1,55 @@
+/*
+ * cryptocheck.c
+ * (c) 2015 flabbergast
+ *  Host build: the console's crypto self-test ('b', crypto_self_test() and
+ *  crypto_benchmark() in enstix.c) on the PC. The portable parts run as
+ *  they are: the XTS tweaks and the CBC/XTS glue of crypto.c, kdf.c (the
+ *  hash chain step, PBKDF2) and compute_essiv(); the AES and SHA256 block
+ *  functions underneath are the C ones of the host build (aes.c,
+ *  sha256.c), in place of the AVR assembly. The known answers are the
+ *  same, so a change to the portable code can be checked (and timed)
+ *  without the stick.
+ *
+ *  Only that C reference path runs here. The code that does the work on
+ *  the stick doesn't: neither the AVR assembly (crypto/aes_*-asm.S,
+ *  including the CBC kernels of aes_cbc-asm.S, and sha256-asm.S) nor the
+ *  xmega's AES module with its interrupt driven CBC/XTS (the xmega part
+ *  of crypto.c). They're only checked by 'b' on the stick itself.
+ *
+ *  With -b, the benchmark runs too, in the PC's cycles (see host_cpu_ticks):
+ *  good for comparing versions of the portable code with each other, not
+ *  with the stick.
+ */
+
+#define _HOST_NO_COUNTING_
+#include "host.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+/* from enstix.c */
+bool crypto_self_test(void);
+void crypto_benchmark(void);
+
+int main(int argc, char *argv[]) {
+  bool benchmark = false;
+  bool ok;
+  int opt;
+
+  while((opt = getopt(argc, argv, "bh")) != -1) {
+    switch(opt) {
+      case 'b': benchmark = true; break;
+      default:
+        fprintf(stderr, "Usage: %s [-b]\n"
+                        "Checks the firmware's crypto against known answers (-b: and times it).\n", argv[0]);
+        return 1;
+    }
+  }
+
+  ok = crypto_self_test();
+  if(benchmark) {
+    host_cpu_ticks = true;
+    crypto_benchmark();
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,5 @@
+/* Host build: an EEPROM without a passphrase (see scripts/generate-pass.py);
+ * copied to build/eeprom_contents.c unless there's ../eeprom_contents.c.
+ * The replay sets the disk key by itself. */
+uint8_t EEMEM aes_key_encrypted[16];
+uint8_t EEMEM passphrase_hash_hash[32];
@@ -0,0 +1,65 @@
+/*
+ * host.h
+ * (c) 2015 flabbergast
+ *  Host build: what the host files provide besides the firmware's own APIs (the
+ *  file-backed card, the USB host side of the endpoints, the counters).
+ *  Included first into every firmware source (gcc -include), so that their
+ *  memcpy's and memmove's are counted.
+ */
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* What the firmware did, counted since the last host_counters_reset(). */
+typedef struct {
+  uint64_t CopiedBytes;    // by memcpy/memmove (and memcpy_P) in the firmware sources
+  uint64_t UsbBytesIn;     // to the host (Endpoint_Write_*, Endpoint_Null_Stream)
+  uint64_t UsbBytesOut;    // from the host (Endpoint_Read_Stream_LE, Endpoint_Discard_Stream)
+  uint64_t CardBytesRead;  // sd_raw, data only
+  uint64_t CardBytesWritten;
+} host_counters_t;
+
+extern host_counters_t host_counters;
+
+void host_counters_reset(void);
+
+static inline void *host_memcpy(void *dest, const void *src, size_t n) {
+  host_counters.CopiedBytes += n;
+  return (memcpy)(dest, src, n);
+}
+
+static inline void *host_memmove(void *dest, const void *src, size_t n) {
+  host_counters.CopiedBytes += n;
+  return (memmove)(dest, src, n);
+}
+
+#if !defined(_HOST_NO_COUNTING_)
+  #define memcpy(d, s, n)  host_memcpy((d), (s), (n))
+  #define memmove(d, s, n) host_memmove((d), (s), (n))
+#endif
+
+/* card.c: the SD card, a file (an encrypted image, as the card would hold it) */
+bool card_open(const char *filename);
+void card_close(void);
+void card_fail_read(const uint32_t block); // reading "block" fails half way from now on (UINT32_MAX: none)
+void card_fail_write(const uint32_t block); // writing "block" fails (the card keeps what it had) from now on
+
+/* usb.c: the host side of the Mass Storage endpoints. The device reads what
+ *  usb_host_out() supplied, and what it sends ends up in the buffer given to
+ *  usb_host_in() (beyond its size, it's only counted). */
+void usb_host_out(const uint8_t *data, const uint32_t length);
+void usb_host_in(uint8_t *buffer, const uint32_t size);
+uint32_t usb_host_in_length(void); // bytes sent by the device since usb_host_in()
+uint32_t usb_host_out_left(void);  // bytes supplied but not read by the device
+
+/* usb.c: time. With host_cpu_ticks set, timer_ticks() counts the CPU's cycles
+ *  (TIMER_TICK_CYCLES per tick) instead of the firmware's (on x86; elsewhere
+ *  nanoseconds), for the benchmarks' cycles per byte. */
+uint64_t host_micros(void);
+extern bool host_cpu_ticks;
+
+#endif
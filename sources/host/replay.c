@@ -0,0 +1,784 @@
+/*
+ * replay.c
+ * (c) 2015 flabbergast
+ *  Host build: replays SCSI commands (from a usbmon capture, or a synthetic
+ *  pattern) against the firmware's SCSI code, sector callbacks and crypto,
+ *  with the card being an image file; reports the time each kind of
+ *  command took and what it cost per sector (bytes copied, moved over USB
+ *  and to/from the card). Like scripts/replay-bench.py, but without the
+ *  stick: the code paths can be compared on the PC.
+ *
+ *  The image is used as it is (see scripts/encrypt-image.py): with its key,
+ *  the data reads back as it should; with any other key, it's just slower
+ *  to tell. Writes are replayed by writing back what the sectors already
+ *  contain (read beforehand, not counted), so the image doesn't change.
+ *  Commands that would change it in other ways (UNMAP, WRITE SAME, ...)
+ *  are skipped.
+ *
+ *  With -c, it checks the sector reader instead: the one the SCSI code uses
+ *  (CALLBACK_disk_readSector_begin/_continue, a chunk at a time) has to
+ *  give the same bytes as CALLBACK_disk_readSector, and a sector that
+ *  can't be read (the card fails half way through it) has to fail both,
+ *  and READ(10) with a MEDIUM ERROR.
+ *
+ *  With -C, it checks the caches (read cache, write-back cache and the
+ *  allocation map; only there in the build with HOST_CACHES, see the
+ *  makefile): that they're hit, what they drop when full, that a write to
+ *  the card failing leaves them as they were, and that a sector read ahead
+ *  failing while they're written out in the background isn't sent as good.
+ *  It creates a new map on the image and writes to it.
+ */
+
+#define _HOST_NO_COUNTING_
+#include "host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "../LufaLayer.h"
+#include "../Descriptors.h"
+#include "../crypto/crypto.h"
+#include "../crypto/sha256.h"
+#include "../DiskCache/DiskCache.h"
+#include "../DiskMap/DiskMap.h"
+#include "../DiskStats/DiskStats.h"
+#include "../sd_raw/sd_raw.h"
+#include "../Timer.h"
+#include "../enstix.h"
+
+/* from enstix.c */
+extern uint8_t key[16];
+extern aes128_ctx_t key_ctx;
+extern aes128_ctx_t essiv_ctx;
+extern uint8_t disk_format;
+extern uint8_t sd_exists;
+extern struct sd_raw_info sd_card_info;
+
+#define REPLAY_LUN      ENCRYPTED_DISK_LUN
+#define MAX_COMMANDS    1000000
+#define MAX_TRANSFER    (0xFFFF * (uint32_t)DISK_BLOCK_SIZE)
+
+typedef struct {
+  uint8_t Lun;
+  uint8_t Cdb[16];
+  uint8_t CdbLength;
+  uint32_t DataLength; // from the CBW; patterns: what the command transfers
+} command_t;
+
+typedef struct {
+  uint32_t Count;
+  uint32_t Failed;
+  uint64_t Micros;
+  uint64_t Sectors;
+  host_counters_t Counters;
+} opcode_stats_t;
+
+static command_t *commands;
+static uint32_t command_count;
+static opcode_stats_t opcode_stats[256];
+static opcode_stats_t task_stats; // usb_tasks() in between the commands
+static uint8_t *data_buffer;
+
+static USB_ClassInfo_MS_Device_t ms_interface = {
+  .Config = {
+    .TotalLUNs = TOTAL_LUNS,
+  },
+};
+
+static const char *opcode_name(const uint8_t op) {
+  switch(op) {
+    case 0x00: return "TEST UNIT READY";
+    case 0x03: return "REQUEST SENSE";
+    case 0x12: return "INQUIRY";
+    case 0x1a: return "MODE SENSE (6)";
+    case 0x1b: return "START STOP UNIT";
+    case 0x1e: return "PREVENT ALLOW MEDIUM REMOVAL";
+    case 0x25: return "READ CAPACITY (10)";
+    case 0x28: return "READ (10)";
+    case 0x2a: return "WRITE (10)";
+    case 0x2f: return "VERIFY (10)";
+    case 0x35: return "SYNCHRONIZE CACHE (10)";
+    case 0x41: return "WRITE SAME (10)";
+    case 0x42: return "UNMAP";
+    case 0x4d: return "LOG SENSE";
+    case 0x9e: return "SERVICE ACTION IN (16)";
+  }
+  return NULL;
+}
+
+// the commands that don't change anything (besides WRITE (10), see above)
+static bool opcode_is_safe(const uint8_t op) {
+  switch(op) {
+    case 0x00: case 0x03: case 0x12: case 0x1a: case 0x1e: case 0x25:
+    case 0x28: case 0x2f: case 0x35: case 0x4d: case 0x9e:
+      return true;
+  }
+  return false;
+}
+
+static uint16_t be16(const uint8_t *p) {
+  return (uint16_t)p[0] << 8 | p[1];
+}
+
+static void add_command(const uint8_t lun, const uint8_t *cdb, const uint8_t cdb_length, const uint32_t data_length) {
+  command_t *c;
+
+  if(command_count == MAX_COMMANDS)
+    return;
+  c = &commands[command_count++];
+  memset(c, 0, sizeof(*c));
+  c->Lun = lun;
+  memcpy(c->Cdb, cdb, cdb_length);
+  c->CdbLength = cdb_length;
+  c->DataLength = data_length;
+}
+
+static void add_readwrite(const uint8_t op, const uint32_t lba, const uint16_t blocks) {
+  uint8_t cdb[10] = {op, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, blocks >> 8, blocks, 0};
+
+  add_command(REPLAY_LUN, cdb, 10, (uint32_t)blocks * DISK_BLOCK_SIZE);
+}
+
+static void add_simple(const uint8_t op, const uint8_t length_byte4, const uint8_t cdb_length) {
+  uint8_t cdb[10] = {op, 0, 0, 0, length_byte4, 0, 0, 0, 0, 0};
+
+  add_command(REPLAY_LUN, cdb, cdb_length, (op == 0x25) ? 8 : length_byte4);
+}
+
+/* The same patterns as scripts/replay-bench.py */
+static bool pattern_commands(const char *pattern, const uint32_t count, uint16_t blocks, const uint32_t span) {
+  uint32_t lba = 0;
+
+  if(blocks > span)
+    blocks = span;
+  if(!strcmp(pattern, "seq-read") || !strcmp(pattern, "seq-write")) {
+    for(uint32_t i = 0; i < count; i++) {
+      if(lba + blocks > span)
+        lba = 0;
+      add_readwrite(pattern[4] == 'r' ? 0x28 : 0x2a, lba, blocks);
+      lba += blocks;
+    }
+  } else if(!strcmp(pattern, "random-read") || !strcmp(pattern, "random-write")) {
+    for(uint32_t i = 0; i < count; i++) {
+      lba = (uint32_t)(random() % (span - blocks + 1)) / blocks * blocks;
+      add_readwrite(pattern[7] == 'r' ? 0x28 : 0x2a, lba, blocks);
+    }
+  } else if(!strcmp(pattern, "mkfs")) {
+    // what formatting looks like: probing, then small writes of the boot
+    //  sector, FATs and root directory, with the FAT sectors re-read
+    uint32_t fat_sectors = span / 1024;
+
+    if(fat_sectors < 1)
+      fat_sectors = 1;
+    if(fat_sectors > 64)
+      fat_sectors = 64;
+    add_simple(0x00, 0, 6);
+    add_simple(0x12, 36, 6);
+    add_simple(0x25, 0, 10);
+    add_readwrite(0x28, 0, 8);
+    for(uint32_t i = 0; i < count; i++) {
+      lba = 1 + i % (2 * fat_sectors + 32);
+      add_readwrite(0x2a, lba, 1);
+      if(i % 4 == 3)
+        add_readwrite(0x28, lba, 1);
+    }
+    add_readwrite(0x2a, 0, 1);
+    add_simple(0x35, 0, 10);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* The Command Block Wrappers (31 bytes, "USBC") of a usbmon text capture, e.g.
+ *  cat /sys/kernel/debug/usb/usbmon/1u > capture.txt */
+static bool usbmon_commands(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  char line[1024];
+
+  if(!f) {
+    perror(filename);
+    return false;
+  }
+  while(fgets(line, sizeof(line), f)) {
+    char type[8], endpoint[32];
+    char *data = strstr(line, " = ");
+    uint8_t cbw[31];
+    uint8_t n = 0;
+
+    if(!data || sscanf(line, "%*s %*s %7s %31s", type, endpoint) != 2 ||
+       strcmp(type, "S") || strncmp(endpoint, "Bo:", 3))
+      continue;
+    for(data += 3; *data && n < sizeof(cbw); data++) {
+      unsigned int byte;
+
+      if(*data == ' ' || *data == '\n')
+        continue;
+      if(sscanf(data, "%2x", &byte) != 1)
+        break;
+      cbw[n++] = byte;
+      data++;
+    }
+    if(n == sizeof(cbw) && !memcmp(cbw, "USBC", 4))
+      add_command(cbw[13], cbw + 15, cbw[14] & 0x1f,
+                  cbw[8] | (uint32_t)cbw[9] << 8 | (uint32_t)cbw[10] << 16 | (uint32_t)cbw[11] << 24);
+  }
+  fclose(f);
+  return true;
+}
+
+/* Runs a command like LUFA's Mass Storage class driver would: the data
+ *  going to the device comes from "out", what comes back ends up in
+ *  data_buffer. Returns the command's success. */
+static bool run_command(const command_t *c, const uint8_t *out) {
+  MS_CommandBlockWrapper_t *cbw = &ms_interface.State.CommandBlock;
+
+  memset(cbw, 0, sizeof(*cbw));
+  cbw->Signature = 0x43425355;
+  cbw->DataTransferLength = c->DataLength;
+  cbw->Flags = out ? 0 : MS_COMMAND_DIR_DATA_IN;
+  cbw->LUN = c->Lun;
+  cbw->SCSICommandLength = c->CdbLength;
+  memcpy(cbw->SCSICommandData, c->Cdb, c->CdbLength);
+
+  usb_host_out(out, out ? c->DataLength : 0);
+  usb_host_in(data_buffer, MAX_TRANSFER);
+  return SCSI_DecodeSCSICommand(&ms_interface);
+}
+
+static void print_sense(const command_t *c) {
+  command_t sense = {c->Lun, {0x03, 0, 0, 0, 18, 0}, 6, 18};
+
+  if(run_command(&sense, NULL) && usb_host_in_length() >= 14)
+    fprintf(stderr, "  (sense key %02x, additional sense %02x/%02x)\n",
+            data_buffer[2] & 0x0f, data_buffer[12], data_buffer[13]);
+}
+
+static void counters_add(host_counters_t *sum, const host_counters_t *add) {
+  sum->CopiedBytes += add->CopiedBytes;
+  sum->UsbBytesIn += add->UsbBytesIn;
+  sum->UsbBytesOut += add->UsbBytesOut;
+  sum->CardBytesRead += add->CardBytesRead;
+  sum->CardBytesWritten += add->CardBytesWritten;
+}
+
+/* The main loop's usb_tasks() in between the commands (the host would be busy
+ *  with the data meanwhile): the read-ahead, the write cache and the map */
+static void run_tasks(void) {
+  host_counters_t saved = host_counters;
+  uint64_t start;
+
+  host_counters_reset();
+  start = host_micros();
+  usb_tasks();
+  task_stats.Micros += host_micros() - start;
+  task_stats.Count++;
+  counters_add(&task_stats.Counters, &host_counters);
+  host_counters = saved;
+}
+
+static bool replay(void) {
+  uint32_t skipped = 0;
+
+  for(uint32_t i = 0; i < command_count; i++) {
+    const command_t *c = &commands[i];
+    uint8_t op = c->Cdb[0];
+    opcode_stats_t *stats = &opcode_stats[op];
+    const uint8_t *out = NULL;
+    uint64_t start;
+    bool success;
+
+    run_tasks();
+
+    if(op == 0x2a) {
+      // write back what's there; reading it isn't counted (nor is what it does to DiskStats)
+      command_t read = *c;
+      DiskStats_t saved_stats = DiskStats;
+      host_counters_t saved = host_counters;
+
+      read.Cdb[0] = 0x28;
+      if(!run_command(&read, NULL)) {
+        skipped++;
+        continue;
+      }
+      DiskStats = saved_stats;
+      host_counters = saved;
+      out = data_buffer;
+    } else if(!opcode_is_safe(op)) {
+      skipped++;
+      continue;
+    }
+
+    host_counters_reset();
+    start = host_micros();
+    success = run_command(c, out);
+    stats->Micros += host_micros() - start;
+    stats->Count++;
+    if(op == 0x28 || op == 0x2a)
+      stats->Sectors += be16(c->Cdb + 7);
+    counters_add(&stats->Counters, &host_counters);
+    if(!success) {
+      stats->Failed++;
+      fprintf(stderr, "Command %d (%02x, LUN %d) failed.\n", i, op, c->Lun);
+      print_sense(c);
+    }
+  }
+  run_tasks();
+
+  if(skipped)
+    printf("(%u commands skipped)\n", skipped);
+  return true;
+}
+
+static void print_per_sector(const char *what, const uint64_t total, const uint64_t sectors) {
+  printf("  %-26s %10.1f\n", what, (double)total / sectors);
+}
+
+static void print_report(void) {
+  printf("\n%-30s %8s %8s %12s %12s\n", "command", "count", "failed", "total [ms]", "avg [ms]");
+  for(uint16_t op = 0; op < 256; op++) {
+    opcode_stats_t *s = &opcode_stats[op];
+    const char *name = opcode_name(op);
+    char unknown[8];
+
+    if(!s->Count)
+      continue;
+    if(!name) {
+      snprintf(unknown, sizeof(unknown), "0x%02x", op);
+      name = unknown;
+    }
+    printf("%-30s %8u %8u %12.1f %12.3f\n", name, s->Count, s->Failed,
+           s->Micros / 1000.0, s->Micros / 1000.0 / s->Count);
+  }
+  printf("%-30s %8u %8s %12.1f %12.3f\n", "(tasks in between)", task_stats.Count, "",
+         task_stats.Micros / 1000.0, task_stats.Micros / 1000.0 / task_stats.Count);
+
+  for(uint8_t op = 0x28; op <= 0x2a; op += 2) {
+    opcode_stats_t *s = &opcode_stats[op];
+
+    if(!s->Sectors || !s->Micros)
+      continue;
+    printf("\nSectors %s: %llu, %.1f sectors/s (%.1f kB/s); per sector:\n", (op == 0x28) ? "read" : "written",
+           (unsigned long long)s->Sectors, s->Sectors * 1e6 / s->Micros,
+           s->Sectors * 1e6 / s->Micros * DISK_BLOCK_SIZE / 1024);
+    print_per_sector("bytes copied", s->Counters.CopiedBytes, s->Sectors);
+    print_per_sector("bytes over USB", s->Counters.UsbBytesIn + s->Counters.UsbBytesOut, s->Sectors);
+    print_per_sector("bytes read from the card", s->Counters.CardBytesRead, s->Sectors);
+    print_per_sector("bytes written to the card", s->Counters.CardBytesWritten, s->Sectors);
+  }
+  if(task_stats.Counters.CopiedBytes || task_stats.Counters.CardBytesRead || task_stats.Counters.CardBytesWritten)
+    printf("\nIn between the commands: %llu bytes copied, %llu read from and %llu written to the card.\n",
+           (unsigned long long)task_stats.Counters.CopiedBytes,
+           (unsigned long long)task_stats.Counters.CardBytesRead,
+           (unsigned long long)task_stats.Counters.CardBytesWritten);
+
+  printf("\nDiskStats: %lu sectors read, %lu written; AES %llu us, yields %lu.\n",
+         (unsigned long)DiskStats.SectorsRead, (unsigned long)DiskStats.SectorsWritten,
+         (unsigned long long)DiskStats.AesMicros, (unsigned long)DiskStats.Yields);
+}
+
+/* The stepped reader: returns the sector's result like CALLBACK_disk_readSector
+ *  does, having checked that the bytes ready only ever grow */
+static int16_t read_stepped(uint8_t *sector, const uint32_t sector_number) {
+  int16_t done, ready = 0;
+
+  if(!CALLBACK_disk_readSector_begin(sector, sector_number))
+    return 0;
+  do {
+    done = CALLBACK_disk_readSector_continue();
+    if(done >= 0 && done < ready) {
+      fprintf(stderr, "Sector %u: %d bytes ready after %d.\n", sector_number, done, ready);
+      return 0;
+    }
+    ready = done;
+  } while(done >= 0 && done < DISK_BLOCK_SIZE);
+  if(done < 0 && CALLBACK_disk_readSector_continue() != DISK_BLOCK_SIZE) {
+    fprintf(stderr, "Sector %u: the read isn't over after failing.\n", sector_number);
+    return 0;
+  }
+  return (done < 0) ? 0 : DISK_BLOCK_SIZE;
+}
+
+static bool read_command(const uint32_t lba, const uint16_t blocks) {
+  command_t read = {REPLAY_LUN, {0x28, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, blocks >> 8, blocks}, 10,
+                    blocks * (uint32_t)DISK_BLOCK_SIZE};
+
+  return run_command(&read, NULL);
+}
+
+/* Did the last command fail with this sense key and additional sense code? */
+static bool sense_is(const uint8_t key, const uint8_t asc) {
+  command_t sense = {REPLAY_LUN, {0x03, 0, 0, 0, 18, 0}, 6, 18};
+
+  return run_command(&sense, NULL) && usb_host_in_length() >= 14 &&
+         (data_buffer[2] & 0x0f) == key && data_buffer[12] == asc;
+}
+
+/* -c: see the top of the file */
+static bool check_reader(const uint32_t span) {
+  static uint8_t whole[DISK_BLOCK_SIZE], stepped[DISK_BLOCK_SIZE];
+  uint32_t failing = span / 2;
+  bool ok = true;
+
+  for(uint32_t s = 0; s < span; s++) {
+    memset(whole, 0x55, sizeof(whole));
+    memset(stepped, 0xaa, sizeof(stepped));
+    if(CALLBACK_disk_readSector(whole, s) != DISK_BLOCK_SIZE || read_stepped(stepped, s) != DISK_BLOCK_SIZE) {
+      fprintf(stderr, "Sector %u: reading failed.\n", s);
+      return false;
+    }
+    if(memcmp(whole, stepped, DISK_BLOCK_SIZE)) {
+      fprintf(stderr, "Sector %u: the stepped reader read something else.\n", s);
+      return false;
+    }
+    // and what the host gets
+    if(!read_command(s, 1) || usb_host_in_length() != DISK_BLOCK_SIZE || memcmp(data_buffer, whole, DISK_BLOCK_SIZE)) {
+      fprintf(stderr, "Sector %u: READ(10) sent something else.\n", s);
+      return false;
+    }
+  }
+  printf("%u sectors read the same, whole and a chunk at a time.\n", span);
+
+  if(!DiskMap_IsMapped(failing)) {
+    printf("(sector %u isn't on the card, no failure to check)\n", failing);
+    return true;
+  }
+  card_fail_read(failing);
+  if(CALLBACK_disk_readSector(whole, failing) != 0 || read_stepped(stepped, failing) != 0) {
+    fprintf(stderr, "Sector %u: reading didn't fail.\n", failing);
+    ok = false;
+  }
+  if(read_command(failing > 0 ? failing - 1 : 0, 3)) {
+    fprintf(stderr, "Sector %u: READ(10) didn't fail.\n", failing);
+    ok = false;
+  } else if(!sense_is(SCSI_SENSE_KEY_MEDIUM_ERROR, SCSI_ASENSE_UNRECOVERED_READ_ERROR)) {
+    fprintf(stderr, "Sector %u: READ(10) failed, but not with a MEDIUM ERROR.\n", failing);
+    ok = false;
+  }
+  card_fail_read(UINT32_MAX);
+  // and it's over: the next sectors read fine
+  if(read_stepped(stepped, failing) != DISK_BLOCK_SIZE || !read_command(failing, 2)) {
+    fprintf(stderr, "Sector %u: reading fails after the failure.\n", failing);
+    ok = false;
+  }
+  if(ok)
+    printf("Sector %u failing half way through: failed as it should.\n", failing);
+  return ok;
+}
+
+#if (READ_CACHE_SECTORS >= 2) && (WRITE_CACHE_SECTORS > 0) && defined(THIN_PROVISIONING)
+static bool write_command(const uint32_t lba, const uint16_t blocks, const uint8_t *data, const bool fua) {
+  command_t write = {REPLAY_LUN, {0x2a, fua ? SCSI_FUA_BIT : 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, blocks >> 8, blocks}, 10,
+                     blocks * (uint32_t)DISK_BLOCK_SIZE};
+
+  return run_command(&write, data);
+}
+
+static bool sync_command(void) {
+  command_t sync = {REPLAY_LUN, {0x35}, 10, 0};
+
+  return run_command(&sync, NULL);
+}
+
+/* What the caches check writes to "sector": "version" tells the writes apart */
+static void fill(uint8_t *data, const uint32_t sector, const uint8_t version) {
+  for(uint16_t i = 0; i < DISK_BLOCK_SIZE; i++)
+    data[i] = sector + i + version * 0x55;
+}
+
+/* Does the card hold "version" of "sector" (past the caches)? */
+static bool on_card(const uint32_t sector, const uint8_t version) {
+  static uint8_t expected[DISK_BLOCK_SIZE], read[DISK_BLOCK_SIZE];
+
+  SCSI_ReadAhead_Borrow();
+  fill(expected, sector, version);
+  return CALLBACK_disk_readSector(read, sector) == DISK_BLOCK_SIZE && !memcmp(read, expected, DISK_BLOCK_SIZE);
+}
+
+/* Does READ(10) of "sector" give "version" of it, reading this many bytes from the card? */
+static bool reads_back(const uint32_t sector, const uint8_t version, const uint32_t card_bytes) {
+  static uint8_t expected[DISK_BLOCK_SIZE];
+
+  fill(expected, sector, version);
+  host_counters_reset();
+  return read_command(sector, 1) && usb_host_in_length() == DISK_BLOCK_SIZE &&
+         !memcmp(data_buffer, expected, DISK_BLOCK_SIZE) && host_counters.CardBytesRead == card_bytes;
+}
+
+static bool write_sectors(const uint32_t lba, const uint16_t blocks, const uint8_t version, const bool fua) {
+  static uint8_t data[16 * DISK_BLOCK_SIZE];
+
+  for(uint16_t i = 0; i < blocks && i < 16; i++)
+    fill(data + i * DISK_BLOCK_SIZE, lba + i, version);
+  return blocks <= 16 && write_command(lba, blocks, data, fua);
+}
+
+static bool failed_check(const char *what) {
+  fprintf(stderr, "Caches: %s.\n", what);
+  return false;
+}
+
+static void no_idle(void) {
+}
+
+/* -C: see the top of the file */
+static bool check_caches(void) {
+  static const uint8_t zeros[DISK_BLOCK_SIZE];
+  uint32_t media_sectors = sd_card_info.capacity / DISK_BLOCK_SIZE;
+  uint32_t hits, flush_start;
+  uint8_t i;
+
+  disk_size_GLOBAL = DiskMap_Format(media_sectors, no_idle);
+  if(disk_size_GLOBAL < 1024)
+    return failed_check("creating the map failed (or the image is too small)");
+
+  // never written: zeros, without the card (once the first read loaded the map)
+  if(!read_command(100, 1) || memcmp(data_buffer, zeros, DISK_BLOCK_SIZE))
+    return failed_check("a sector never written doesn't read as zeros");
+  host_counters_reset();
+  if(!read_command(101, 1) || memcmp(data_buffer, zeros, DISK_BLOCK_SIZE) || host_counters.CardBytesRead)
+    return failed_check("a sector never written is read from the card");
+
+  // the write-back cache: the sector stays in RAM (only the map goes to the card), and reads back from there
+  host_counters_reset();
+  if(!write_sectors(100, 1, 1, false) || host_counters.CardBytesWritten != DISK_BLOCK_SIZE)
+    return failed_check("WRITE(10) of a sector didn't go to the write-back cache");
+  hits = DiskCache_Hits;
+  if(!reads_back(100, 1, 0) || DiskCache_Hits != hits + 1)
+    return failed_check("a sector in the write-back cache didn't read back from it");
+  if(on_card(100, 1))
+    return failed_check("a sector in the write-back cache is on the card already");
+
+  // full: the oldest sector is written out for a new one; SYNCHRONIZE CACHE writes out the rest
+  for(i = 1; i <= WRITE_CACHE_SECTORS; i++)
+    if(!write_sectors(100 + i, 1, 1, false))
+      return failed_check("WRITE(10) to a full write-back cache failed");
+  if(!on_card(100, 1) || on_card(100 + WRITE_CACHE_SECTORS, 1))
+    return failed_check("the full write-back cache didn't write out (just) the oldest sector");
+  if(!sync_command())
+    return failed_check("SYNCHRONIZE CACHE failed");
+  for(i = 1; i <= WRITE_CACHE_SECTORS; i++)
+    if(!on_card(100 + i, 1))
+      return failed_check("SYNCHRONIZE CACHE didn't write out the write-back cache");
+
+  // writing out fails: the sector stays cached, as it was (it gets encrypted in place on the way), until it works
+  if(!write_sectors(110, 1, 1, false))
+    return failed_check("WRITE(10) of a sector failed");
+  card_fail_write(110);
+  if(sync_command() || !sense_is(SCSI_SENSE_KEY_MEDIUM_ERROR, SCSI_ASENSE_WRITE_ERROR))
+    return failed_check("SYNCHRONIZE CACHE didn't fail with a WRITE ERROR when the card did");
+  if(!reads_back(110, 1, 0))
+    return failed_check("a sector that failed to be written out isn't cached as it was");
+  card_fail_write(UINT32_MAX);
+  if(!sync_command() || !on_card(110, 1))
+    return failed_check("a sector that failed to be written out wasn't written out later");
+
+  // the read cache (written through, as it's more than the write-back cache takes): a miss, then hits
+  if(!write_sectors(300, 8, 1, false))
+    return failed_check("WRITE(10) of 8 sectors failed");
+  hits = DiskCache_Hits;
+  if(!reads_back(300, 1, DISK_BLOCK_SIZE) || !reads_back(300, 1, 0) || DiskCache_Hits != hits + 1)
+    return failed_check("a sector read didn't read back from the read cache");
+
+  // full: the least recently used sector is dropped for a new one
+  for(i = 1; i < READ_CACHE_SECTORS; i++)
+    if(!reads_back(300 + i, 1, DISK_BLOCK_SIZE))
+      return failed_check("reading a sector failed");
+  if(!reads_back(300, 1, 0) || !reads_back(300 + READ_CACHE_SECTORS, 1, DISK_BLOCK_SIZE) ||
+     !reads_back(300, 1, 0) || !reads_back(301, 1, DISK_BLOCK_SIZE))
+    return failed_check("the full read cache didn't drop the least recently used sector");
+
+  // writes replace what's in the read cache: cached, and written through (FUA)
+  if(!reads_back(300, 1, 0) || !write_sectors(300, 1, 2, false) || !reads_back(300, 2, 0))
+    return failed_check("a sector written to the write-back cache reads back the old data");
+  if(!write_sectors(300, 1, 3, true) || !reads_back(300, 3, DISK_BLOCK_SIZE) || !on_card(300, 3))
+    return failed_check("a sector written through reads back the old data");
+
+  // writing out the map fails: it stays in RAM as it was (it gets encrypted in place on the way), until it works
+  card_fail_write(disk_size_GLOBAL);
+  if(write_sectors(400, 1, 1, false) || !sense_is(SCSI_SENSE_KEY_MEDIUM_ERROR, SCSI_ASENSE_WRITE_ERROR))
+    return failed_check("WRITE(10) of a new sector didn't fail with a WRITE ERROR when writing the map did");
+  for(uint32_t s = 0; s < 1024; s++)
+    if(DiskMap_IsMapped(s) != ((s >= 100 && s <= 100 + WRITE_CACHE_SECTORS) || s == 110 ||
+                               (s >= 300 && s < 308) || s == 400))
+      return failed_check("the map in RAM changed when writing it out failed");
+  card_fail_write(UINT32_MAX);
+  if(!sync_command())
+    return failed_check("SYNCHRONIZE CACHE failed");
+  DiskMap_Close();
+  if(DiskMap_Open(media_sectors) != disk_size_GLOBAL || !DiskMap_IsMapped(400) || DiskMap_IsMapped(401))
+    return failed_check("the map on the card isn't the one in RAM");
+
+  // a sector read ahead fails while the write-back cache is written out in the background: READ(10) fails
+  if(!write_sectors(500, 16, 1, false) || !write_sectors(700, 1, 1, false))
+    return failed_check("WRITE(10) failed");
+  flush_start = millis10();
+  card_fail_read(510);
+  // the stream: the read-ahead gets going in between the two (not long enough for the write-back cache to be written out)
+  if(!read_command(500, 5))
+    return failed_check("READ(10) failed");
+  for(i = 0; i < 64; i++)
+    usb_tasks();
+  if(!read_command(505, 5))
+    return failed_check("READ(10) failed");
+  if(on_card(700, 1))
+    return failed_check("the write-back cache was written out too early");
+  for(i = 0; i < 3; i++)
+    SCSI_ReadAhead_Task(); // half way into sector 510, not yet failing
+  while(millis10() - flush_start <= WRITE_CACHE_FLUSH_DELAY)
+    usleep(1000);
+  usb_tasks();
+  // (cut-through: the chunks before the failure may be out, but not the whole sector)
+  if(read_command(510, 2) || usb_host_in_length() >= DISK_BLOCK_SIZE ||
+     !sense_is(SCSI_SENSE_KEY_MEDIUM_ERROR, SCSI_ASENSE_UNRECOVERED_READ_ERROR))
+    return failed_check("a sector read ahead that failed while writing out the write-back cache was sent");
+  card_fail_read(UINT32_MAX);
+  if(!on_card(700, 1) || !reads_back(510, 1, DISK_BLOCK_SIZE))
+    return failed_check("the write-back cache wasn't written out in the background");
+
+  printf("The read cache, the write-back cache and the map were hit, filled and failed as they should.\n");
+  return true;
+}
+#else
+static bool check_caches(void) {
+  fprintf(stderr, "Error: this build has no caches or map to check (see make check-caches).\n");
+  return false;
+}
+#endif
+
+/* What passphrase_hashed() in enstix.c does once the passphrase is right */
+static void unlock(void) {
+  uint8_t essiv_key[32];
+
+  aes128_ctx_init(key, &key_ctx);
+  sha256((sha256_hash_t *)essiv_key, key, 8*16);
+  aes128_ctx_init(essiv_key, &essiv_ctx);
+  disk_size_GLOBAL = DiskMap_Open((uint32_t)(sd_card_info.capacity / DISK_BLOCK_SIZE));
+  disk_erase_size_GLOBAL = sd_card_info.erase_size;
+  disk_state_GLOBAL = DISK_STATE_ENCRYPTING;
+  SCSI_Disk_Changed(SCSI_ASENSE_NOT_READY_TO_READY_CHANGE, SCSI_ASENSEQ_NO_QUALIFIER);
+  // writable, like after the 'r' command
+  disk_read_only_GLOBAL = false;
+}
+
+static bool parse_key(const char *hex) {
+  for(uint8_t i = 0; i < 16; i++) {
+    unsigned int byte;
+
+    if(sscanf(hex + 2*i, "%2x", &byte) != 1)
+      return false;
+    key[i] = byte;
+  }
+  return hex[32] == '\0';
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options] IMAGE\n"
+          "Replays SCSI commands against the enstix firmware, with the (encrypted) IMAGE as the card.\n"
+          "  -k KEY      the disk key (32 hex digits; default: all zeros)\n"
+          "  -x          the image is encrypted with XTS (default: CBC-ESSIV)\n"
+          "  -p PATTERN  seq-read (default), seq-write, random-read, random-write or mkfs\n"
+          "  -u FILE     replay the commands of this usbmon text capture instead of a pattern\n"
+          "  -n COUNT    number of READ/WRITE commands of the pattern (default: 256)\n"
+          "  -b BLOCKS   sectors per READ/WRITE command of the pattern (default: 64)\n"
+          "  -s SPAN     sectors of the disk the pattern covers (default: all of them)\n"
+          "  -r SEED     seed for the random patterns (default: 0)\n"
+          "  -c          check the sector reader on the first SPAN sectors (default: 1024) instead\n"
+          "  -C          check the caches instead (this writes to IMAGE)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+  const char *pattern = "seq-read";
+  const char *usbmon_file = NULL;
+  uint32_t count = 256;
+  uint32_t blocks = 64;
+  uint32_t span = 0;
+  bool check = false;
+  bool check_cache = false;
+  int opt;
+
+  while((opt = getopt(argc, argv, "k:xp:u:n:b:s:r:cCh")) != -1) {
+    switch(opt) {
+      case 'k':
+        if(!parse_key(optarg)) {
+          fprintf(stderr, "Error: the key has to be 32 hex digits.\n");
+          return 1;
+        }
+        break;
+      case 'x': disk_format = 1; break; // DISK_FORMAT_XTS
+      case 'p': pattern = optarg; break;
+      case 'u': usbmon_file = optarg; break;
+      case 'n': count = strtoul(optarg, NULL, 0); break;
+      case 'b': blocks = strtoul(optarg, NULL, 0); break;
+      case 's': span = strtoul(optarg, NULL, 0); break;
+      case 'r': srandom(strtoul(optarg, NULL, 0)); break;
+      case 'c': check = true; break;
+      case 'C': check_cache = true; break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(optind != argc - 1 || blocks == 0 || blocks > 0xFFFF) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  commands = malloc(MAX_COMMANDS * sizeof(command_t));
+  data_buffer = malloc(MAX_TRANSFER);
+  if(!commands || !data_buffer || !card_open(argv[optind]))
+    return 1;
+  if(!sd_raw_init() || !sd_raw_get_info(&sd_card_info) || sd_card_info.capacity < DISK_BLOCK_SIZE) {
+    fprintf(stderr, "Error: %s is no card image.\n", argv[optind]);
+    return 1;
+  }
+  sd_exists = 1;
+  unlock();
+  printf("Card: %llu sectors, the disk: %lu sectors (%s%s).\n",
+         (unsigned long long)(sd_card_info.capacity / DISK_BLOCK_SIZE), (unsigned long)disk_size_GLOBAL,
+         disk_format ? "XTS" : "CBC-ESSIV", DiskMap_Active() ? ", thin provisioned" : "");
+
+  if(check || check_cache) {
+    command_t ready = {REPLAY_LUN, {0x00}, 6, 0};
+
+    run_command(&ready, NULL); // the UNIT ATTENTION
+    if(!span)
+      span = 1024;
+    if(span > disk_size_GLOBAL)
+      span = disk_size_GLOBAL;
+    check = check_cache ? check_caches() : check_reader(span);
+    card_close();
+    return check ? 0 : 1;
+  }
+
+  if(usbmon_file) {
+    if(!usbmon_commands(usbmon_file))
+      return 1;
+    printf("Replaying %u commands from %s.\n", command_count, usbmon_file);
+  } else {
+    if(!span || span > disk_size_GLOBAL)
+      span = disk_size_GLOBAL;
+    if(!pattern_commands(pattern, count, blocks, span)) {
+      usage(argv[0]);
+      return 1;
+    }
+    printf("Replaying the %s pattern: %u commands over %u sectors.\n", pattern, command_count, span);
+  }
+
+  // the host's first command after the disk appeared gets the UNIT ATTENTION
+  {
+    command_t ready = {REPLAY_LUN, {0x00}, 6, 0};
+
+    run_command(&ready, NULL);
+  }
+  memset(&DiskStats, 0, sizeof(DiskStats));
+
+  replay();
+  print_report();
+
+  card_close();
+  return 0;
+}
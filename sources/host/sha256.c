@@ -0,0 +1,110 @@
+/*
+ * sha256.c
+ * (c) 2015 flabbergast
+ *  Host build: SHA256 in C, with the API of avr-crypto-lib's
+ *  crypto/sha256-asm.S (see crypto/sha256.h), for crypto/kdf.c and the
+ *  passphrase hashing in enstix.c.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../crypto/sha256.h"
+
+static const uint32_t k[64] = {
+  0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+  0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+  0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+  0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+  0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+  0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+  0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+  0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2};
+
+static uint32_t rotr(const uint32_t x, const uint8_t n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+void sha256_init(sha256_ctx_t *state) {
+  static const uint32_t h0[8] = {
+    0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+
+  memcpy(state->h, h0, sizeof(h0));
+  state->length = 0;
+}
+
+void sha256_nextBlock(sha256_ctx_t *state, const void *block) {
+  const uint8_t *b = block;
+  uint32_t w[64];
+  uint32_t a[8];
+  uint8_t i;
+
+  for(i = 0; i < 16; i++)
+    w[i] = (uint32_t)b[4*i] << 24 | (uint32_t)b[4*i+1] << 16 | (uint32_t)b[4*i+2] << 8 | b[4*i+3];
+  for(i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+    uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+    w[i] = w[i-16] + s0 + w[i-7] + s1;
+  }
+
+  memcpy(a, state->h, sizeof(a));
+  for(i = 0; i < 64; i++) {
+    uint32_t t1 = a[7] + (rotr(a[4], 6) ^ rotr(a[4], 11) ^ rotr(a[4], 25))
+                  + ((a[4] & a[5]) ^ (~a[4] & a[6])) + k[i] + w[i];
+    uint32_t t2 = (rotr(a[0], 2) ^ rotr(a[0], 13) ^ rotr(a[0], 22))
+                  + ((a[0] & a[1]) ^ (a[0] & a[2]) ^ (a[1] & a[2]));
+    memmove(a + 1, a, 7 * sizeof(uint32_t));
+    a[4] += t1;
+    a[0] = t1 + t2;
+  }
+  for(i = 0; i < 8; i++)
+    state->h[i] += a[i];
+  state->length += SHA256_BLOCK_BITS;
+}
+
+void sha256_lastBlock(sha256_ctx_t *state, const void *block, uint16_t length_b) {
+  uint8_t buffer[SHA256_BLOCK_BYTES];
+  uint64_t length;
+  uint8_t i;
+
+  while(length_b >= SHA256_BLOCK_BITS) {
+    sha256_nextBlock(state, block);
+    block = (const uint8_t *)block + SHA256_BLOCK_BYTES;
+    length_b -= SHA256_BLOCK_BITS;
+  }
+  // the total length is taken before any padding block gets counted
+  length = state->length + length_b;
+
+  memset(buffer, 0, SHA256_BLOCK_BYTES);
+  memcpy(buffer, block, (length_b + 7) / 8);
+  buffer[length_b / 8] |= 0x80 >> (length_b % 8);
+  if(length_b >= SHA256_BLOCK_BITS - 64) {
+    sha256_nextBlock(state, buffer);
+    memset(buffer, 0, SHA256_BLOCK_BYTES);
+  }
+  for(i = 0; i < 8; i++)
+    buffer[SHA256_BLOCK_BYTES - 1 - i] = (uint8_t)(length >> (8 * i));
+  sha256_nextBlock(state, buffer);
+}
+
+void sha256_ctx2hash(sha256_hash_t *dest, const sha256_ctx_t *state) {
+  for(uint8_t i = 0; i < 8; i++) {
+    (*dest)[4*i]   = state->h[i] >> 24;
+    (*dest)[4*i+1] = state->h[i] >> 16;
+    (*dest)[4*i+2] = state->h[i] >> 8;
+    (*dest)[4*i+3] = state->h[i];
+  }
+}
+
+void sha256(sha256_hash_t *dest, const void *msg, uint32_t length_b) {
+  sha256_ctx_t state;
+
+  sha256_init(&state);
+  while(length_b >= SHA256_BLOCK_BITS) {
+    sha256_nextBlock(&state, msg);
+    msg = (const uint8_t *)msg + SHA256_BLOCK_BYTES;
+    length_b -= SHA256_BLOCK_BITS;
+  }
+  sha256_lastBlock(&state, msg, length_b);
+  sha256_ctx2hash(dest, &state);
+}
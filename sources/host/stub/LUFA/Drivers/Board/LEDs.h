@@ -0,0 +1,17 @@
+/*
+ * LUFA/Drivers/Board/LEDs.h
+ * (c) 2015 flabbergast
+ *  Host build: no LEDs.
+ */
+
+#ifndef _HOST_LEDS_H_
+#define _HOST_LEDS_H_
+
+#define LEDS_LED1 (1 << 0)
+#define LEDS_LED2 (1 << 1)
+
+#define LEDs_TurnOnLEDs(mask)
+#define LEDs_TurnOffLEDs(mask)
+#define LEDs_SetAllLEDs(mask)
+
+#endif
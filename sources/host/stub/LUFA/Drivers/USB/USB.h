@@ -0,0 +1,213 @@
+/*
+ * LUFA/Drivers/USB/USB.h
+ * (c) 2015 flabbergast
+ *  Host build: what the SCSI and VirtualFAT code use of LUFA (the Mass
+ *  Storage class types and constants, and the endpoint stream API). The
+ *  endpoint functions are implemented by host/usb.c, as a USB host that
+ *  takes whatever the device sends and supplies what it reads.
+ *
+ *  Based on LUFA (license below); the types are laid out like LUFA's.
+ */
+
+/*
+             LUFA Library
+     Copyright (C) Dean Camera, 2014.
+
+  dean [at] fourwalledcubicle [dot] com
+           www.lufa-lib.org
+*/
+
+#ifndef _HOST_LUFA_USB_H_
+#define _HOST_LUFA_USB_H_
+
+  /* Includes: */
+    #include <stdint.h>
+    #include <stdbool.h>
+    #include <stddef.h>
+
+    #include <avr/io.h>
+    #include <avr/pgmspace.h>
+
+  /* Macros: */
+    #define ATTR_PACKED                 __attribute__((packed))
+    #define ATTR_WARN_UNUSED_RESULT     __attribute__((warn_unused_result))
+    #define ATTR_NON_NULL_PTR_ARG(...)  __attribute__((nonnull(__VA_ARGS__)))
+
+    #define MIN(x, y)                   (((x) < (y)) ? (x) : (y))
+    #define MAX(x, y)                   (((x) > (y)) ? (x) : (y))
+
+    #define SwapEndian_16(x)            __builtin_bswap16(x)
+    #define SwapEndian_32(x)            __builtin_bswap32(x)
+
+    #define ENDPOINT_DIR_IN             0x80
+    #define ENDPOINT_DIR_OUT            0x00
+
+    /** Mass Storage class SCSI commands (MassStorageClassCommon.h). */
+    #define SCSI_CMD_INQUIRY                               0x12
+    #define SCSI_CMD_REQUEST_SENSE                         0x03
+    #define SCSI_CMD_TEST_UNIT_READY                       0x00
+    #define SCSI_CMD_READ_CAPACITY_10                      0x25
+    #define SCSI_CMD_SEND_DIAGNOSTIC                       0x1D
+    #define SCSI_CMD_PREVENT_ALLOW_MEDIUM_REMOVAL          0x1E
+    #define SCSI_CMD_WRITE_10                              0x2A
+    #define SCSI_CMD_READ_10                               0x28
+    #define SCSI_CMD_VERIFY_10                             0x2F
+    #define SCSI_CMD_MODE_SENSE_6                          0x1A
+    #define SCSI_CMD_START_STOP_UNIT                       0x1B
+
+    /** SCSI sense keys, additional sense codes and qualifiers. */
+    #define SCSI_SENSE_KEY_GOOD                            0x00
+    #define SCSI_SENSE_KEY_NOT_READY                       0x02
+    #define SCSI_SENSE_KEY_MEDIUM_ERROR                    0x03
+    #define SCSI_SENSE_KEY_ILLEGAL_REQUEST                 0x05
+    #define SCSI_SENSE_KEY_UNIT_ATTENTION                  0x06
+    #define SCSI_SENSE_KEY_DATA_PROTECT                    0x07
+
+    #define SCSI_ASENSE_NO_ADDITIONAL_INFORMATION          0x00
+    #define SCSI_ASENSE_INVALID_COMMAND                    0x20
+    #define SCSI_ASENSE_LOGICAL_BLOCK_ADDRESS_OUT_OF_RANGE 0x21
+    #define SCSI_ASENSE_INVALID_FIELD_IN_CDB               0x24
+    #define SCSI_ASENSE_WRITE_PROTECTED                    0x27
+    #define SCSI_ASENSE_NOT_READY_TO_READY_CHANGE          0x28
+    #define SCSI_ASENSE_MEDIUM_NOT_PRESENT                 0x3A
+
+    #define SCSI_ASENSEQ_NO_QUALIFIER                      0x00
+
+    /** Mass Storage class CBW flag of data going to the host. */
+    #define MS_COMMAND_DIR_DATA_IN                         (1 << 7)
+
+  /* Enums: */
+    /** Results of the endpoint stream functions (EndpointStream.h). */
+    enum Endpoint_Stream_RW_ErrorCodes_t
+    {
+      ENDPOINT_RWSTREAM_NoError            = 0,
+      ENDPOINT_RWSTREAM_EndpointStalled    = 1,
+      ENDPOINT_RWSTREAM_DeviceDisconnected = 2,
+      ENDPOINT_RWSTREAM_BusSuspended       = 3,
+      ENDPOINT_RWSTREAM_Timeout            = 4,
+      ENDPOINT_RWSTREAM_IncompleteTransfer = 5,
+    };
+
+  /* Type Defines: */
+    /** USB descriptors (Descriptors.h puts them together; only their sizes matter here). */
+    typedef struct { uint8_t Data[9]; } ATTR_PACKED USB_Descriptor_Configuration_Header_t;
+    typedef struct { uint8_t Data[8]; } ATTR_PACKED USB_Descriptor_Interface_Association_t;
+    typedef struct { uint8_t Data[9]; } ATTR_PACKED USB_Descriptor_Interface_t;
+    typedef struct { uint8_t Data[7]; } ATTR_PACKED USB_Descriptor_Endpoint_t;
+    typedef struct { uint8_t Data[5]; } ATTR_PACKED USB_CDC_Descriptor_FunctionalHeader_t;
+    typedef struct { uint8_t Data[4]; } ATTR_PACKED USB_CDC_Descriptor_FunctionalACM_t;
+    typedef struct { uint8_t Data[5]; } ATTR_PACKED USB_CDC_Descriptor_FunctionalUnion_t;
+    typedef struct { uint8_t Data[9]; } ATTR_PACKED USB_HID_Descriptor_HID_t;
+
+    typedef struct
+    {
+      uint8_t  Address;
+      uint16_t Size;
+      uint8_t  Type;
+      uint8_t  Banks;
+    } USB_Endpoint_Table_t;
+
+    typedef struct
+    {
+      uint32_t Signature;
+      uint32_t Tag;
+      uint32_t DataTransferLength;
+      uint8_t  Flags;
+      uint8_t  LUN;
+      uint8_t  SCSICommandLength;
+      uint8_t  SCSICommandData[16];
+    } ATTR_PACKED MS_CommandBlockWrapper_t;
+
+    typedef struct
+    {
+      uint32_t Signature;
+      uint32_t Tag;
+      uint32_t DataTransferResidue;
+      uint8_t  Status;
+    } ATTR_PACKED MS_CommandStatusWrapper_t;
+
+    typedef struct
+    {
+      struct
+      {
+        uint8_t InterfaceNumber;
+        USB_Endpoint_Table_t DataINEndpoint;
+        USB_Endpoint_Table_t DataOUTEndpoint;
+        uint8_t TotalLUNs;
+      } Config;
+      struct
+      {
+        MS_CommandBlockWrapper_t  CommandBlock;
+        MS_CommandStatusWrapper_t CommandStatus;
+        bool IsMassStoreReset;
+      } State;
+    } USB_ClassInfo_MS_Device_t;
+
+    typedef struct
+    {
+      unsigned DeviceType          : 5;
+      unsigned PeripheralQualifier : 3;
+
+      unsigned Reserved            : 7;
+      unsigned Removable           : 1;
+
+      uint8_t  Version;
+
+      unsigned ResponseDataFormat  : 4;
+      unsigned Reserved2           : 1;
+      unsigned NormACA             : 1;
+      unsigned TrmTsk              : 1;
+      unsigned AERC                : 1;
+
+      uint8_t  AdditionalLength;
+      uint8_t  Reserved3[2];
+
+      unsigned SoftReset           : 1;
+      unsigned CmdQue              : 1;
+      unsigned Reserved4           : 1;
+      unsigned Linked              : 1;
+      unsigned Sync                : 1;
+      unsigned WideBus16Bit        : 1;
+      unsigned WideBus32Bit        : 1;
+      unsigned RelAddr             : 1;
+
+      uint8_t  VendorID[8];
+      uint8_t  ProductID[16];
+      uint8_t  RevisionID[4];
+    } ATTR_PACKED SCSI_Inquiry_Response_t;
+
+    typedef struct
+    {
+      uint8_t  ResponseCode;
+
+      uint8_t  SegmentNumber;
+
+      unsigned SenseKey            : 4;
+      unsigned Reserved            : 1;
+      unsigned ILI                 : 1;
+      unsigned EOM                 : 1;
+      unsigned FileMark            : 1;
+
+      uint8_t  Information[4];
+      uint8_t  AdditionalLength;
+      uint8_t  CmdSpecificInformation[4];
+      uint8_t  AdditionalSenseCode;
+      uint8_t  AdditionalSenseQualifier;
+      uint8_t  FieldReplaceableUnitCode;
+      uint8_t  SenseKeySpecific[3];
+    } ATTR_PACKED SCSI_Request_Sense_Response_t;
+
+  /* Function Prototypes: */
+    uint8_t  Endpoint_Write_Stream_LE(const void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed);
+    uint8_t  Endpoint_Read_Stream_LE(void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed);
+    uint8_t  Endpoint_Null_Stream(uint16_t Length, uint16_t* const BytesProcessed);
+    uint8_t  Endpoint_Discard_Stream(uint16_t Length, uint16_t* const BytesProcessed);
+    void     Endpoint_Write_32_BE(const uint32_t Data);
+    void     Endpoint_ClearIN(void);
+    void     Endpoint_ClearOUT(void);
+    bool     Endpoint_IsINReady(void);
+    bool     Endpoint_IsOUTReceived(void);
+    uint8_t  Endpoint_GetCurrentEndpoint(void);
+    void     Endpoint_SelectEndpoint(const uint8_t Address);
+
+#endif
@@ -0,0 +1,19 @@
+/*
+ * avr/eeprom.h
+ * (c) 2015 flabbergast
+ *  Host build: the EEPROM variables (EEMEM) are ordinary ones.
+ */
+
+#ifndef _HOST_AVR_EEPROM_H_
+#define _HOST_AVR_EEPROM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+#define eeprom_read_block(d, s, n)   memcpy((d), (s), (n))
+#define eeprom_write_block(s, d, n)  memcpy((d), (s), (n))
+#define eeprom_read_byte(p)          (*(const uint8_t*)(p))
+
+#endif
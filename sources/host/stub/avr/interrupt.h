@@ -0,0 +1,13 @@
+/*
+ * avr/interrupt.h
+ * (c) 2015 flabbergast
+ *  Host build: no interrupts.
+ */
+
+#ifndef _HOST_AVR_INTERRUPT_H_
+#define _HOST_AVR_INTERRUPT_H_
+
+#define cli()
+#define sei()
+
+#endif
@@ -0,0 +1,20 @@
+/*
+ * avr/io.h
+ * (c) 2015 flabbergast
+ *  Host build (see host/makefile): the little of avr-libc's io.h that the
+ *  compiled sources need outside of their hardware code.
+ */
+
+#ifndef _HOST_AVR_IO_H_
+#define _HOST_AVR_IO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// flash geometry (only used in the flash storage code of the atxmega128a3u)
+#define SPM_PAGESIZE            256
+#define BOOT_SECTION_PAGE_SIZE  256
+#define PROGMEM_SIZE            0x8000
+
+#endif
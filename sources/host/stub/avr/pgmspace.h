@@ -0,0 +1,23 @@
+/*
+ * avr/pgmspace.h
+ * (c) 2015 flabbergast
+ *  Host build: flash is just memory.
+ */
+
+#ifndef _HOST_AVR_PGMSPACE_H_
+#define _HOST_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+typedef uint32_t uint_farptr_t;
+
+#define pgm_read_byte(p)      (*(const uint8_t*)(p))
+#define pgm_read_byte_far(p)  (*(const uint8_t*)(uintptr_t)(p))
+#define memcpy_P(d, s, n)     memcpy((d), (s), (n))
+#define memcmp_P(a, b, n)     memcmp((a), (b), (n))
+
+#endif
@@ -0,0 +1,13 @@
+/*
+ * util/delay.h
+ * (c) 2015 flabbergast
+ *  Host build: nothing to wait for.
+ */
+
+#ifndef _HOST_UTIL_DELAY_H_
+#define _HOST_UTIL_DELAY_H_
+
+#define _delay_ms(ms)
+#define _delay_us(us)
+
+#endif
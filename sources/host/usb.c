@@ -0,0 +1,302 @@
+/*
+ * usb.c
+ * (c) 2015 flabbergast
+ *  Host build: the USB side of the firmware. The Mass Storage endpoints
+ *  (LUFA's Endpoint_* stream functions, with 64 byte banks) talk to a host
+ *  that's always ready: every bank the device fills is taken right away,
+ *  and every bank it wants has the next part of the data given to
+ *  usb_host_out(). The rest of LufaLayer (serial console, keyboard,
+ *  button) does nothing; the serial output goes to stdout. And the timer,
+ *  from the system clock.
+ */
+
+#define _HOST_NO_COUNTING_
+#include "host.h"
+
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+#endif
+
+#include "../LufaLayer.h"
+#include "../Descriptors.h"
+#include "../Timer.h"
+#include "../DiskCache/DiskCache.h"
+#include "../DiskMap/DiskMap.h"
+
+#define BANK_SIZE MASS_STORAGE_IO_EPSIZE
+
+host_counters_t host_counters;
+
+void host_counters_reset(void) {
+  memset(&host_counters, 0, sizeof(host_counters));
+}
+
+/*************************************************************************
+ * ------------------------------ Endpoints -----------------------------*
+ *************************************************************************/
+
+static const uint8_t *out_data;
+static uint32_t out_length;
+static uint32_t out_position;
+static uint8_t *in_buffer;
+static uint32_t in_size;
+static uint32_t in_length;
+static uint8_t current_endpoint;
+
+void usb_host_out(const uint8_t *data, const uint32_t length) {
+  out_data = data;
+  out_length = length;
+  out_position = 0;
+}
+
+void usb_host_in(uint8_t *buffer, const uint32_t size) {
+  in_buffer = buffer;
+  in_size = size;
+  in_length = 0;
+}
+
+uint32_t usb_host_in_length(void) {
+  return in_length;
+}
+
+uint32_t usb_host_out_left(void) {
+  return out_length - out_position;
+}
+
+static void in_bytes(const uint8_t *data, const uint16_t length) {
+  for(uint16_t i = 0; i < length; i++, in_length++)
+    if(in_length < in_size)
+      in_buffer[in_length] = data ? data[i] : 0;
+  host_counters.UsbBytesIn += length;
+}
+
+// a bank at a time when "BytesProcessed" is given (like LUFA, which returns
+//  ENDPOINT_RWSTREAM_IncompleteTransfer whenever it had to send a full bank)
+static uint16_t stream_step(uint16_t Length, uint16_t* const BytesProcessed) {
+  uint16_t done = BytesProcessed ? *BytesProcessed : 0;
+  uint16_t step = Length - done;
+
+  if(BytesProcessed && step > BANK_SIZE)
+    step = BANK_SIZE;
+  return step;
+}
+
+static uint8_t stream_done(uint16_t Length, uint16_t* const BytesProcessed, const uint16_t step) {
+  if(!BytesProcessed)
+    return ENDPOINT_RWSTREAM_NoError;
+  *BytesProcessed += step;
+  return (*BytesProcessed < Length) ? ENDPOINT_RWSTREAM_IncompleteTransfer : ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed) {
+  uint16_t done = BytesProcessed ? *BytesProcessed : 0;
+  uint16_t step = stream_step(Length, BytesProcessed);
+
+  in_bytes((const uint8_t *)Buffer + done, step);
+  return stream_done(Length, BytesProcessed, step);
+}
+
+uint8_t Endpoint_Null_Stream(uint16_t Length, uint16_t* const BytesProcessed) {
+  uint16_t step = stream_step(Length, BytesProcessed);
+
+  in_bytes(NULL, step);
+  return stream_done(Length, BytesProcessed, step);
+}
+
+void Endpoint_Write_32_BE(const uint32_t Data) {
+  uint8_t bytes[4] = {Data >> 24, Data >> 16, Data >> 8, Data};
+
+  in_bytes(bytes, 4);
+}
+
+uint8_t Endpoint_Read_Stream_LE(void* const Buffer, uint16_t Length, uint16_t* const BytesProcessed) {
+  uint16_t done = BytesProcessed ? *BytesProcessed : 0;
+  uint16_t step = stream_step(Length, BytesProcessed);
+
+  // the host sent less than the command said: the device would wait forever
+  if(out_position + step > out_length)
+    return ENDPOINT_RWSTREAM_Timeout;
+  memcpy((uint8_t *)Buffer + done, out_data + out_position, step);
+  out_position += step;
+  host_counters.UsbBytesOut += step;
+  return stream_done(Length, BytesProcessed, step);
+}
+
+uint8_t Endpoint_Discard_Stream(uint16_t Length, uint16_t* const BytesProcessed) {
+  uint16_t step = stream_step(Length, BytesProcessed);
+
+  if(out_position + step > out_length)
+    return ENDPOINT_RWSTREAM_Timeout;
+  out_position += step;
+  host_counters.UsbBytesOut += step;
+  return stream_done(Length, BytesProcessed, step);
+}
+
+void Endpoint_ClearIN(void) {
+}
+
+void Endpoint_ClearOUT(void) {
+}
+
+bool Endpoint_IsINReady(void) {
+  return true;
+}
+
+bool Endpoint_IsOUTReceived(void) {
+  return true;
+}
+
+uint8_t Endpoint_GetCurrentEndpoint(void) {
+  return current_endpoint;
+}
+
+void Endpoint_SelectEndpoint(const uint8_t Address) {
+  current_endpoint = Address;
+}
+
+/*************************************************************************
+ * ------------------------------ LufaLayer -----------------------------*
+ *************************************************************************/
+
+uint8_t volatile usb_keyboard_leds;
+bool usb_keyboard_send_current_data_GLOBAL;
+uint8_t usb_keyboard_current_keys_GLOBAL[6];
+uint8_t usb_keyboard_current_modifier_GLOBAL;
+bool usb_keyboard_sending_string_GLOBAL;
+bool usb_storage_only_GLOBAL;
+
+void init(void) {
+}
+
+// what the main loop runs in between commands (see LufaLayer.c)
+void usb_tasks(void) {
+  static uint8_t prev_disk_state = DISK_STATE_INITIAL;
+
+  if(disk_state_GLOBAL == DISK_STATE_ENCRYPTING) {
+    DiskCache_Task(SCSI_ReadAhead_Borrow);
+    DiskMap_Task(SCSI_ReadAhead_Borrow);
+    SCSI_ReadAhead_Task();
+  } else if(prev_disk_state == DISK_STATE_ENCRYPTING) {
+    DiskCache_Wipe();
+    DiskMap_Close();
+  }
+  prev_disk_state = disk_state_GLOBAL;
+}
+
+void usb_tasks_others(void) {
+}
+
+void usb_wait(const uint8_t ticks) {
+  uint32_t start = millis10();
+
+  while((millis10() - start) < ticks)
+    usb_tasks();
+}
+
+uint16_t usb_serial_available(void) {
+  return 0;
+}
+
+int16_t usb_serial_getchar(void) {
+  return -1;
+}
+
+void usb_serial_flush_input(void) {
+}
+
+void usb_serial_putchar(uint8_t ch) {
+  putchar(ch);
+}
+
+void usb_serial_wait_for_key(void) {
+}
+
+void usb_serial_write(const char* const buffer) {
+  fputs(buffer, stdout);
+}
+
+void usb_serial_write_P(const char* data) {
+  fputs(data, stdout);
+}
+
+void usb_serial_writeln(const char* const buffer) {
+  puts(buffer);
+}
+
+void usb_serial_writeln_P(const char* data) {
+  puts(data);
+}
+
+void usb_serial_flush_output(void) {
+  fflush(stdout);
+}
+
+uint16_t usb_serial_readline(char *buffer, const uint16_t buffer_size, const bool obscure_input) {
+  (void)obscure_input;
+  if(buffer_size)
+    buffer[0] = '\0';
+  return 0;
+}
+
+bool usb_serial_dtr(void) {
+  return false;
+}
+
+bool usb_keyboard_press(uint8_t key, uint8_t mod) {
+  (void)key;
+  (void)mod;
+  return false;
+}
+
+bool usb_keyboard_write(char* text) {
+  (void)text;
+  return false;
+}
+
+void usb_set_storage_only(const bool storage_only) {
+  usb_storage_only_GLOBAL = storage_only;
+}
+
+void service_button(void) {
+}
+
+uint32_t button_pressed_for(void) {
+  return 0;
+}
+
+/*************************************************************************
+ * -------------------------------- Timer -------------------------------*
+ *************************************************************************/
+
+uint64_t host_micros(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Timer_Init(void) {
+}
+
+// in 10.24 ms, like the atmega32u4's
+uint32_t millis10(void) {
+  return host_micros() / 10240;
+}
+
+bool host_cpu_ticks;
+
+uint32_t timer_ticks(void) {
+  if(host_cpu_ticks) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc() / TIMER_TICK_CYCLES;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) / TIMER_TICK_CYCLES;
+#endif
+  }
+  return host_micros() / TIMER_TICK_MICROS;
+}
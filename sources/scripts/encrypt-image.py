@@ -2,6 +2,8 @@
 
 BLOCK_SIZE=512
 HASH_ITERATIONS=1000
+PBKDF2_ITERATIONS=1000
+SALT_BYTES=16
 
 from Crypto.Cipher import AES
 from Crypto.Hash import SHA256
@@ -9,6 +11,7 @@ from Crypto import Random
 
 import getpass
 import binascii
+import hashlib
 import struct
 import sys
 
@@ -20,10 +23,44 @@ parser.add_argument('-o', '--output', dest='output_imgfile', nargs='?', default=
 parser.add_argument('-k', '--key', dest='key', help='Encrypted main AES key, 16 hexified bytes (32 chars). If no supplied, a new random one will be generated.')
 parser.add_argument('-d', '--decrypt', dest='decrypt', action='store_true', help="Decrypt (instead of the default encrypting) the input file; supplying a key is mandatory.")
 parser.add_argument('-N', '--no-eeprom', dest='no_eeprom', action='store_true', help="Do not update the eeprom C source file with the generated password.")
+parser.add_argument('-f', '--format', dest='format', choices=['cbc-essiv', 'xts'], default='cbc-essiv', help="Disk format: aes128-cbc-essiv, or aes128-xts (the tweak is the ESSIV iv of the block; saved to EEPROM, so that the firmware knows).")
+parser.add_argument('-b', '--block-size', dest='block_size', type=int, default=BLOCK_SIZE, help="Logical block size of the encrypted disk (ENCRYPTED_BLOCK_SIZE in Config/AppConfig.h): each block is encrypted as a whole (one IV, one CBC chain). A multiple of "+str(BLOCK_SIZE)+".")
+parser.add_argument('--kdf', dest='kdf', choices=['pbkdf2', 'sha256-chain'], default='pbkdf2', help="Passphrase hashing: PBKDF2-HMAC-SHA256, or the original SHA256 chain ("+str(HASH_ITERATIONS)+" times, and as many again for the check value); saved to EEPROM.")
+parser.add_argument('-n', '--iterations', dest='iterations', type=int, default=PBKDF2_ITERATIONS, help="PBKDF2 iterations. The stick's 'k' command tells how many take about 2 seconds there.")
+parser.add_argument('-s', '--salt', dest='salt', help="PBKDF2 salt, "+str(SALT_BYTES)+" hexified bytes (as the stick's 'i' command shows it); needed along with the key. If not supplied, a new random one will be generated.")
 parser.add_argument('-e', '--eeprom-file', dest='eeprom_file', nargs='?', default='eeprom_contents.c', help="C source file for eeprom variables (gets overwritten!).")
 
 args = parser.parse_args()
 
+# XTS: multiply the tweak by alpha in GF(2^128), for the next AES block
+def xts_next_tweak(tweak):
+    t = bytearray(tweak)
+    carry = 0
+    for i in range(16):
+        next_carry = t[i] >> 7
+        t[i] = ((t[i] << 1) & 0xff) | carry
+        carry = next_carry
+    if carry:
+        t[0] ^= 0x87
+    return bytes(t)
+
+def xor_block(a, b):
+    return bytes(bytearray(x ^ y for x, y in zip(bytearray(a), bytearray(b))))
+
+# XTS en/decrypt a data unit (a logical block); "aes_data" is AES with the main key, in ECB mode
+def xts_crypt(aes_data, tweak, data, decrypt):
+    out = b''
+    for i in range(0, len(data), 16):
+        block = xor_block(data[i:i+16], tweak)
+        block = aes_data.decrypt(block) if decrypt else aes_data.encrypt(block)
+        out += xor_block(block, tweak)
+        tweak = xts_next_tweak(tweak)
+    return out
+
+if(args.block_size <= 0 or args.block_size % BLOCK_SIZE != 0):
+    print("Error: The block size needs to be a multiple of "+str(BLOCK_SIZE)+".")
+    exit(1)
+
 if(args.decrypt and not args.key):
     print("Error: A key needs to be supplied for decrypting.")
     exit(1)
@@ -40,6 +77,27 @@ if args.key:
         print("Error: The supplied encrypted AES key has wrong length.")
         exit(1)
 
+salt = ''
+if args.salt:
+    if len(args.salt) == 2*SALT_BYTES:
+        try:
+            salt = binascii.unhexlify(args.salt)
+        except TypeError as e:
+            print("Error: Couldn't unhexify the supplied salt.")
+            exit(1)
+    else:
+        print("Error: The supplied salt has wrong length.")
+        exit(1)
+elif args.kdf == 'pbkdf2':
+    if args.key:
+        print("Error: The salt needs to be supplied along with the key (the stick's 'i' command shows it).")
+        exit(1)
+    salt = Random.new().read(SALT_BYTES)
+
+if args.kdf == 'pbkdf2' and args.iterations <= 0:
+    print("Error: The number of iterations needs to be positive.")
+    exit(1)
+
 passphrase = getpass.getpass("Passphrase: ")
 pass_check = getpass.getpass("Repeat passphrase: ")
 
@@ -49,17 +107,28 @@ if(passphrase != pass_check):
 
 print("Passphrases match, continuing...")
 
-pp_hash = SHA256.new(passphrase)
-for i in range(1,HASH_ITERATIONS):
-    pp_hash = SHA256.new(pp_hash.digest())
-print("SHA256 hash^"+str(HASH_ITERATIONS)+" of the passphrase: "+pp_hash.hexdigest())
-pp_hash_hash = SHA256.new(pp_hash.digest())
-for i in range(1,HASH_ITERATIONS):
-    pp_hash_hash = SHA256.new(pp_hash_hash.digest())
-print("SHA256^"+str(HASH_ITERATIONS)+" hash of the hash^"+str(HASH_ITERATIONS)+" of the passphrase (saved to EEPROM, used to check if the passphrase is correct: "+pp_hash_hash.hexdigest())
+if args.kdf == 'pbkdf2':
+    # the check value doesn't need stretching again: the passphrase hash is stretched already
+    pp_hash = hashlib.pbkdf2_hmac('sha256', passphrase, salt, args.iterations, 32)
+    print("PBKDF2-HMAC-SHA256 of the passphrase ("+str(args.iterations)+" iterations, salt "+binascii.hexlify(salt)+"): "+binascii.hexlify(pp_hash))
+    pp_hash_hash = SHA256.new(pp_hash).digest()
+    print("SHA256 hash of that (saved to EEPROM, used to check if the passphrase is correct): "+binascii.hexlify(pp_hash_hash))
+    kdf_record = struct.pack('<BI', 1, args.iterations) + salt
+else:
+    pp_hash = SHA256.new(passphrase)
+    for i in range(1,HASH_ITERATIONS):
+        pp_hash = SHA256.new(pp_hash.digest())
+    print("SHA256 hash^"+str(HASH_ITERATIONS)+" of the passphrase: "+pp_hash.hexdigest())
+    pp_hash_hash = SHA256.new(pp_hash.digest())
+    for i in range(1,HASH_ITERATIONS):
+        pp_hash_hash = SHA256.new(pp_hash_hash.digest())
+    print("SHA256^"+str(HASH_ITERATIONS)+" hash of the hash^"+str(HASH_ITERATIONS)+" of the passphrase (saved to EEPROM, used to check if the passphrase is correct: "+pp_hash_hash.hexdigest())
+    pp_hash = pp_hash.digest()
+    pp_hash_hash = pp_hash_hash.digest()
+    kdf_record = struct.pack('<BI', 0, HASH_ITERATIONS) + '\x00'*SALT_BYTES
 
 # Use 1st 16 bytes of SHA256 hash of passphrase a key for AES128 used for encrypting the actual key
-aes_hashkey = AES.new(pp_hash.digest()[0:16], AES.MODE_ECB) # only used to encr/decr 1 block, so ECB is appropriate
+aes_hashkey = AES.new(pp_hash[0:16], AES.MODE_ECB) # only used to encr/decr 1 block, so ECB is appropriate
                                                             # also cut the length of the key to 16 bytes, so that AES128 is used
 
 if len(aes128_key_encr) > 0:
@@ -71,7 +140,7 @@ else:
 print("AES128 key (the main key; random): "+binascii.hexlify(aes128_key))
 print("The main key encrypted with AES128; the key is the passphrase hash (saved to EEPROM): "+binascii.hexlify(aes128_key_encr))
 
-# encrypt in chunks, to get "sector number"
+# encrypt in chunks of the logical block size, to get "sector number" (the number of the logical block)
 sect_num = 0
 if args.decrypt:
     print("Decrypting image '"+args.input_imgfile+"' to '"+args.output_imgfile+"' now:")
@@ -81,15 +150,19 @@ aes_iv = AES.new(SHA256.new(aes128_key).digest()[0:16], AES.MODE_ECB) # iv = ESS
 outimage = open(args.output_imgfile, "wb")
 with open(args.input_imgfile, "rb") as f:
     while True:
-        chunk = f.read(BLOCK_SIZE)
+        chunk = f.read(args.block_size)
         if chunk:
             # encrypt the sector number to get iv (the ESSIV way) (careful with struct.pack: endianness matters!)
             iv = aes_iv.encrypt(struct.pack('l', sect_num).ljust(16, '\x00'))
-            aes_block = AES.new(aes128_key, AES.MODE_CBC, iv)
-            if args.decrypt:
-                outimage.write(aes_block.decrypt(chunk))
+            if args.format == 'xts':
+                # the iv is the tweak of the first AES block of the logical block
+                outimage.write(xts_crypt(AES.new(aes128_key, AES.MODE_ECB), iv, chunk, args.decrypt))
             else:
-                outimage.write(aes_block.encrypt(chunk))
+                aes_block = AES.new(aes128_key, AES.MODE_CBC, iv)
+                if args.decrypt:
+                    outimage.write(aes_block.decrypt(chunk))
+                else:
+                    outimage.write(aes_block.encrypt(chunk))
             sect_num += 1;
             sys.stdout.write('.')
         else:
@@ -110,11 +183,21 @@ if not args.no_eeprom:
         f.write(binascii.hexlify(aes128_key_encr));
         f.write('\n');
         f.write('uint8_t EEMEM passphrase_hash_hash[] = {')
-        for c in pp_hash_hash.digest():
+        for c in pp_hash_hash:
             f.write(str(ord(c)))
             f.write(',')
         f.write('}; // ')
-        f.write(pp_hash_hash.hexdigest());
+        f.write(binascii.hexlify(pp_hash_hash));
         f.write('\n');
+        # after the others, so that their place in EEPROM stays the same as before there was a format
+        f.write('#define EEPROM_DISK_FORMAT\n')
+        f.write('uint8_t EEMEM disk_format_eeprom[] = {'+('1' if args.format == 'xts' else '0')+'}; // '+args.format+'\n')
+        # type, iterations (little endian), salt
+        f.write('#define EEPROM_KDF\n')
+        f.write('uint8_t EEMEM kdf_eeprom[] = {')
+        for c in kdf_record:
+            f.write(str(ord(c)))
+            f.write(',')
+        f.write('}; // '+args.kdf+'\n')
         f.close()
 
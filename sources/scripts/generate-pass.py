@@ -1,6 +1,8 @@
 #!/usr/bin/env python
 
 HASH_ITERATIONS=1000
+PBKDF2_ITERATIONS=1000
+SALT_BYTES=16
 
 from Crypto.Cipher import AES
 from Crypto.Hash import SHA256
@@ -8,6 +10,7 @@ from Crypto import Random
 
 import getpass
 import binascii
+import hashlib
 import struct
 import sys
 
@@ -16,6 +19,10 @@ import argparse
 parser = argparse.ArgumentParser(description="Generate a random AES key and write eeprom C source file (for usage with enstix).", formatter_class=argparse.ArgumentDefaultsHelpFormatter)
 parser.add_argument('-k', '--key', dest='key', help='Encrypted main AES key, 16 hexified bytes (32 chars). If no supplied, a new random one will be generated.')
 parser.add_argument('-N', '--no-eeprom', dest='no_eeprom', action='store_true', help="Do not update the eeprom C source file with the generated password.")
+parser.add_argument('-f', '--format', dest='format', choices=['cbc-essiv', 'xts'], default='cbc-essiv', help="Disk format (as the image was encrypted with, see encrypt-image.py).")
+parser.add_argument('--kdf', dest='kdf', choices=['pbkdf2', 'sha256-chain'], default='pbkdf2', help="Passphrase hashing: PBKDF2-HMAC-SHA256, or the original SHA256 chain ("+str(HASH_ITERATIONS)+" times, and as many again for the check value); saved to EEPROM.")
+parser.add_argument('-n', '--iterations', dest='iterations', type=int, default=PBKDF2_ITERATIONS, help="PBKDF2 iterations. The stick's 'k' command tells how many take about 2 seconds there.")
+parser.add_argument('-s', '--salt', dest='salt', help="PBKDF2 salt, "+str(SALT_BYTES)+" hexified bytes (as the stick's 'i' command shows it); needed along with the key. If not supplied, a new random one will be generated.")
 parser.add_argument('-e', '--eeprom-file', dest='eeprom_file', nargs='?', default='eeprom_contents.c', help="C source file for eeprom variables (gets overwritten!).")
 
 args = parser.parse_args()
@@ -32,6 +39,27 @@ if args.key:
         print("Error: The supplied encrypted AES key has wrong length.")
         exit(1)
 
+salt = ''
+if args.salt:
+    if len(args.salt) == 2*SALT_BYTES:
+        try:
+            salt = binascii.unhexlify(args.salt)
+        except TypeError as e:
+            print("Error: Couldn't unhexify the supplied salt.")
+            exit(1)
+    else:
+        print("Error: The supplied salt has wrong length.")
+        exit(1)
+elif args.kdf == 'pbkdf2':
+    if args.key:
+        print("Error: The salt needs to be supplied along with the key (the stick's 'i' command shows it).")
+        exit(1)
+    salt = Random.new().read(SALT_BYTES)
+
+if args.kdf == 'pbkdf2' and args.iterations <= 0:
+    print("Error: The number of iterations needs to be positive.")
+    exit(1)
+
 passphrase = getpass.getpass("Passphrase: ")
 pass_check = getpass.getpass("Repeat passphrase: ")
 
@@ -41,17 +69,28 @@ if(passphrase != pass_check):
 
 print("Passphrases match, continuing...")
 
-pp_hash = SHA256.new(passphrase)
-for i in range(1,HASH_ITERATIONS):
-    pp_hash = SHA256.new(pp_hash.digest())
-print("SHA256 hash^"+str(HASH_ITERATIONS)+" of the passphrase: "+pp_hash.hexdigest())
-pp_hash_hash = SHA256.new(pp_hash.digest())
-for i in range(1,HASH_ITERATIONS):
-    pp_hash_hash = SHA256.new(pp_hash_hash.digest())
-print("SHA256^"+str(HASH_ITERATIONS)+" hash of the hash^"+str(HASH_ITERATIONS)+" of the passphrase (saved to EEPROM, used to check if the passphrase is correct: "+pp_hash_hash.hexdigest())
+if args.kdf == 'pbkdf2':
+    # the check value doesn't need stretching again: the passphrase hash is stretched already
+    pp_hash = hashlib.pbkdf2_hmac('sha256', passphrase, salt, args.iterations, 32)
+    print("PBKDF2-HMAC-SHA256 of the passphrase ("+str(args.iterations)+" iterations, salt "+binascii.hexlify(salt)+"): "+binascii.hexlify(pp_hash))
+    pp_hash_hash = SHA256.new(pp_hash).digest()
+    print("SHA256 hash of that (saved to EEPROM, used to check if the passphrase is correct): "+binascii.hexlify(pp_hash_hash))
+    kdf_record = struct.pack('<BI', 1, args.iterations) + salt
+else:
+    pp_hash = SHA256.new(passphrase)
+    for i in range(1,HASH_ITERATIONS):
+        pp_hash = SHA256.new(pp_hash.digest())
+    print("SHA256 hash^"+str(HASH_ITERATIONS)+" of the passphrase: "+pp_hash.hexdigest())
+    pp_hash_hash = SHA256.new(pp_hash.digest())
+    for i in range(1,HASH_ITERATIONS):
+        pp_hash_hash = SHA256.new(pp_hash_hash.digest())
+    print("SHA256^"+str(HASH_ITERATIONS)+" hash of the hash^"+str(HASH_ITERATIONS)+" of the passphrase (saved to EEPROM, used to check if the passphrase is correct: "+pp_hash_hash.hexdigest())
+    pp_hash = pp_hash.digest()
+    pp_hash_hash = pp_hash_hash.digest()
+    kdf_record = struct.pack('<BI', 0, HASH_ITERATIONS) + '\x00'*SALT_BYTES
 
 # Use 1st 16 bytes of SHA256 hash of passphrase a key for AES128 used for encrypting the actual key
-aes_hashkey = AES.new(pp_hash.digest()[0:16], AES.MODE_ECB) # only used to encr/decr 1 block, so ECB is appropriate
+aes_hashkey = AES.new(pp_hash[0:16], AES.MODE_ECB) # only used to encr/decr 1 block, so ECB is appropriate
                                                             # also cut the length of the key to 16 bytes, so that AES128 is used
 
 if len(aes128_key_encr) > 0:
@@ -74,11 +113,21 @@ if not args.no_eeprom:
         f.write(binascii.hexlify(aes128_key_encr));
         f.write('\n');
         f.write('uint8_t EEMEM passphrase_hash_hash[] = {')
-        for c in pp_hash_hash.digest():
+        for c in pp_hash_hash:
             f.write(str(ord(c)))
             f.write(',')
         f.write('}; // ')
-        f.write(pp_hash_hash.hexdigest());
+        f.write(binascii.hexlify(pp_hash_hash));
         f.write('\n');
+        # after the others, so that their place in EEPROM stays the same as before there was a format
+        f.write('#define EEPROM_DISK_FORMAT\n')
+        f.write('uint8_t EEMEM disk_format_eeprom[] = {'+('1' if args.format == 'xts' else '0')+'}; // '+args.format+'\n')
+        # type, iterations (little endian), salt
+        f.write('#define EEPROM_KDF\n')
+        f.write('uint8_t EEMEM kdf_eeprom[] = {')
+        for c in kdf_record:
+            f.write(str(ord(c)))
+            f.write(',')
+        f.write('}; // '+args.kdf+'\n')
         f.close()
 
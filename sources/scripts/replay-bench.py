@@ -0,0 +1,270 @@
+#!/usr/bin/env python
+
+# Replays a sequence of SCSI commands against the stick's encrypted disk (via the
+# Linux SG_IO interface) and reports how long they took, together with what the
+# stick itself measured (its performance counters, LOG SENSE page 0x30).
+#
+# The commands come either from a usbmon capture (the text interface, e.g.
+#   cat /sys/kernel/debug/usb/usbmon/1u > capture.txt
+# while using the stick), or from a synthetic pattern.
+#
+# Nothing on the disk gets changed: writes are replayed by writing back what
+# the sectors already contain. Commands that would change it in other ways
+# (UNMAP, WRITE SAME, ...) are skipped. Needs root (or access to the device).
+
+import argparse
+import ctypes
+import fcntl
+import random
+import struct
+import time
+
+BLOCK_SIZE=512
+
+SG_IO = 0x2285
+SG_DXFER_NONE = -1
+SG_DXFER_TO_DEV = -2
+SG_DXFER_FROM_DEV = -3
+
+TEST_UNIT_READY = 0x00
+INQUIRY = 0x12
+READ_CAPACITY_10 = 0x25
+READ_10 = 0x28
+WRITE_10 = 0x2a
+SYNCHRONIZE_CACHE_10 = 0x35
+LOG_SENSE = 0x4d
+
+OPCODE_NAMES = {0x00: "TEST UNIT READY", 0x03: "REQUEST SENSE", 0x12: "INQUIRY", 0x1a: "MODE SENSE (6)",
+                0x1b: "START STOP UNIT", 0x1e: "PREVENT ALLOW MEDIUM REMOVAL", 0x25: "READ CAPACITY (10)",
+                0x28: "READ (10)", 0x2a: "WRITE (10)", 0x2f: "VERIFY (10)", 0x35: "SYNCHRONIZE CACHE (10)",
+                0x41: "WRITE SAME (10)", 0x42: "UNMAP", 0x4d: "LOG SENSE", 0x9e: "SERVICE ACTION IN (16)"}
+
+# the commands that don't change anything (besides WRITE (10), see above)
+SAFE_OPCODES = [0x00, 0x03, 0x12, 0x1a, 0x1e, 0x25, 0x28, 0x2f, 0x35, 0x4d, 0x9e]
+
+LOG_PAGE_DISK_STATS = 0x30
+
+class sg_io_hdr(ctypes.Structure):
+    _fields_ = [("interface_id", ctypes.c_int), ("dxfer_direction", ctypes.c_int),
+                ("cmd_len", ctypes.c_ubyte), ("mx_sb_len", ctypes.c_ubyte),
+                ("iovec_count", ctypes.c_ushort), ("dxfer_len", ctypes.c_uint),
+                ("dxferp", ctypes.c_void_p), ("cmdp", ctypes.c_void_p), ("sbp", ctypes.c_void_p),
+                ("timeout", ctypes.c_uint), ("flags", ctypes.c_uint), ("pack_id", ctypes.c_int),
+                ("usr_ptr", ctypes.c_void_p), ("status", ctypes.c_ubyte), ("masked_status", ctypes.c_ubyte),
+                ("msg_status", ctypes.c_ubyte), ("sb_len_wr", ctypes.c_ubyte),
+                ("host_status", ctypes.c_ushort), ("driver_status", ctypes.c_ushort),
+                ("resid", ctypes.c_int), ("duration", ctypes.c_uint), ("info", ctypes.c_uint)]
+
+clock = getattr(time, 'perf_counter', time.time)
+
+def scsi_command(dev, cdb, direction=SG_DXFER_NONE, length=0, data=None):
+    """Issues the command, returns (data read, seconds taken); raises IOError if it failed."""
+    cdb_buf = ctypes.create_string_buffer(bytes(cdb), len(cdb))
+    sense_buf = ctypes.create_string_buffer(32)
+    if data is not None:
+        data_buf = ctypes.create_string_buffer(bytes(data), len(data))
+        length = len(data)
+    else:
+        data_buf = ctypes.create_string_buffer(max(length, 1))
+    hdr = sg_io_hdr(interface_id=ord('S'), dxfer_direction=direction, cmd_len=len(cdb),
+                    mx_sb_len=len(sense_buf), dxfer_len=length,
+                    dxferp=ctypes.cast(data_buf, ctypes.c_void_p).value,
+                    cmdp=ctypes.cast(cdb_buf, ctypes.c_void_p).value,
+                    sbp=ctypes.cast(sense_buf, ctypes.c_void_p).value, timeout=30000)
+    start = clock()
+    fcntl.ioctl(dev, SG_IO, hdr)
+    elapsed = clock() - start
+    if hdr.status or hdr.host_status or hdr.driver_status:
+        sense = bytearray(sense_buf.raw[:hdr.sb_len_wr])
+        raise IOError("SCSI command %02x failed (status %02x, sense %s)" %
+                      (cdb[0], hdr.status, " ".join("%02x" % b for b in sense[:18])))
+    return bytearray(data_buf.raw[:length - hdr.resid]), elapsed
+
+def read_10(lba, blocks):
+    return bytearray(struct.pack(">BBIBHB", READ_10, 0, lba, 0, blocks, 0))
+
+def write_10(lba, blocks):
+    return bytearray(struct.pack(">BBIBHB", WRITE_10, 0, lba, 0, blocks, 0))
+
+def capacity(dev):
+    data, _ = scsi_command(dev, bytearray([READ_CAPACITY_10] + [0] * 9), SG_DXFER_FROM_DEV, 8)
+    return struct.unpack(">I", bytes(data[0:4]))[0] + 1
+
+def disk_stats(dev):
+    """The stick's performance counters: {parameter code: value}; empty if not supported."""
+    cdb = bytearray([LOG_SENSE, 0, 0x40 | LOG_PAGE_DISK_STATS, 0, 0, 0, 0, 0x04, 0x00, 0])
+    try:
+        data, _ = scsi_command(dev, cdb, SG_DXFER_FROM_DEV, 1024)
+    except IOError:
+        return {}
+    stats = {}
+    pos = 4
+    end = 4 + struct.unpack(">H", bytes(data[2:4]))[0]
+    while pos + 4 <= min(end, len(data)):
+        code, length = struct.unpack(">H", bytes(data[pos:pos+2]))[0], data[pos+3]
+        value = 0
+        for b in data[pos+4:pos+4+length]:
+            value = (value << 8) | b
+        stats[code] = value
+        pos += 4 + length
+    return stats
+
+def pattern_commands(pattern, count, blocks, span):
+    """CDBs of a synthetic pattern over the first "span" sectors."""
+    cdbs = []
+    if pattern in ('seq-read', 'seq-write'):
+        lba = 0
+        for i in range(count):
+            if lba + blocks > span:
+                lba = 0
+            cdbs.append(read_10(lba, blocks) if pattern == 'seq-read' else write_10(lba, blocks))
+            lba += blocks
+    elif pattern in ('random-read', 'random-write'):
+        for i in range(count):
+            lba = random.randrange(0, span - blocks + 1) // blocks * blocks
+            cdbs.append(read_10(lba, blocks) if pattern == 'random-read' else write_10(lba, blocks))
+    elif pattern == 'mkfs':
+        # what formatting looks like: probing, then small writes of the boot
+        # sector, FATs and root directory, with the FAT sectors re-read
+        cdbs.append(bytearray([TEST_UNIT_READY] + [0] * 5))
+        cdbs.append(bytearray([INQUIRY, 0, 0, 0, 36, 0]))
+        cdbs.append(bytearray([READ_CAPACITY_10] + [0] * 9))
+        cdbs.append(read_10(0, 8))
+        fat_sectors = min(max(span // 1024, 1), 64)
+        for i in range(count):
+            lba = 1 + i % (2 * fat_sectors + 32)
+            cdbs.append(write_10(lba, 1))
+            if i % 4 == 3:
+                cdbs.append(read_10(lba, 1))
+        cdbs.append(write_10(0, 1))
+        cdbs.append(bytearray([SYNCHRONIZE_CACHE_10] + [0] * 9))
+    return cdbs
+
+def usbmon_commands(filename):
+    """CDBs of the Command Block Wrappers (31 bytes, starting with "USBC") in a usbmon text capture."""
+    cdbs = []
+    with open(filename) as f:
+        for line in f:
+            words = line.split()
+            if len(words) < 8 or words[2] != 'S' or not words[3].startswith('Bo:') or '=' not in words:
+                continue
+            data = bytearray.fromhex("".join(words[words.index('=') + 1:]))
+            if len(data) >= 31 and data[0:4] == bytearray(b'USBC'):
+                cdbs.append(data[15:15 + (data[14] & 0x1f)])
+    return cdbs
+
+def transfer_length(cdb):
+    """Number of bytes a data-in command reads (allocation length), 0 if it doesn't read anything."""
+    op = cdb[0]
+    if op == READ_10:
+        return struct.unpack(">H", bytes(cdb[7:9]))[0] * BLOCK_SIZE
+    if op in (0x03, 0x1a):
+        return cdb[4]
+    if op == INQUIRY:
+        return struct.unpack(">H", bytes(cdb[3:5]))[0]
+    if op == READ_CAPACITY_10:
+        return 8
+    if op == LOG_SENSE:
+        return struct.unpack(">H", bytes(cdb[7:9]))[0]
+    if op == 0x9e:
+        return struct.unpack(">I", bytes(cdb[10:14]))[0]
+    return 0
+
+parser = argparse.ArgumentParser(description="Replay SCSI commands against the enstix encrypted disk and report the timing.", formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+parser.add_argument('device', help='The encrypted disk (e.g. /dev/sdc or /dev/sg2); it has to be unlocked.')
+parser.add_argument('-p', '--pattern', dest='pattern', default='seq-read', choices=['seq-read', 'seq-write', 'random-read', 'random-write', 'mkfs'], help='Synthetic pattern to replay.')
+parser.add_argument('-u', '--usbmon', dest='usbmon_file', help='Replay the commands of this usbmon text capture instead of a pattern.')
+parser.add_argument('-n', '--count', dest='count', type=int, default=256, help='Number of READ/WRITE commands of the pattern.')
+parser.add_argument('-b', '--blocks', dest='blocks', type=int, default=64, help='Sectors per READ/WRITE command of the pattern.')
+parser.add_argument('-s', '--span', dest='span', type=int, default=0, help='Sectors of the disk the pattern covers (0 = all of it).')
+parser.add_argument('-r', '--seed', dest='seed', type=int, default=0, help='Seed for the random patterns.')
+
+args = parser.parse_args()
+
+random.seed(args.seed)
+
+try:
+    dev = open(args.device, 'rb+')
+except IOError as e:
+    print("Error: Couldn't open %s: %s" % (args.device, e))
+    exit(1)
+
+try:
+    disk_sectors = capacity(dev)
+except IOError as e:
+    print("Error: %s (is the disk unlocked?)" % e)
+    exit(1)
+if args.usbmon_file:
+    cdbs = usbmon_commands(args.usbmon_file)
+    print("Replaying %d commands from %s." % (len(cdbs), args.usbmon_file))
+else:
+    span = min(args.span or disk_sectors, disk_sectors)
+    cdbs = pattern_commands(args.pattern, args.count, min(args.blocks, span), span)
+    print("Replaying the %s pattern: %d commands over %d sectors." % (args.pattern, len(cdbs), span))
+
+stats_before = disk_stats(dev)
+
+times = {}      # opcode -> [count, seconds]
+sectors = {READ_10: 0, WRITE_10: 0}
+skipped = 0
+for cdb in cdbs:
+    op = cdb[0]
+    try:
+        if op == WRITE_10:
+            # write back what's there (reading it isn't timed)
+            lba, blocks = struct.unpack(">I", bytes(cdb[2:6]))[0], struct.unpack(">H", bytes(cdb[7:9]))[0]
+            if lba + blocks > disk_sectors:
+                skipped += 1
+                continue
+            data, _ = scsi_command(dev, read_10(lba, blocks), SG_DXFER_FROM_DEV, blocks * BLOCK_SIZE)
+            _, elapsed = scsi_command(dev, write_10(lba, blocks), SG_DXFER_TO_DEV, data=data)
+            sectors[WRITE_10] += blocks
+        elif op in SAFE_OPCODES:
+            length = transfer_length(cdb)
+            _, elapsed = scsi_command(dev, cdb, SG_DXFER_FROM_DEV if length else SG_DXFER_NONE, length)
+            if op == READ_10:
+                sectors[READ_10] += length // BLOCK_SIZE
+        else:
+            skipped += 1
+            continue
+    except IOError as e:
+        print("Error: %s" % e)
+        exit(1)
+    entry = times.setdefault(op, [0, 0.0])
+    entry[0] += 1
+    entry[1] += elapsed
+
+stats_after = disk_stats(dev)
+dev.close()
+
+print("")
+print("%-30s %8s %12s %12s" % ("command", "count", "total [ms]", "avg [ms]"))
+for op in sorted(times):
+    count, seconds = times[op]
+    print("%-30s %8d %12.1f %12.3f" % (OPCODE_NAMES.get(op, "0x%02x" % op), count, seconds * 1000, seconds * 1000 / count))
+if skipped:
+    print("(%d commands skipped)" % skipped)
+
+print("")
+for op, name in ((READ_10, "read"), (WRITE_10, "written")):
+    if sectors[op]:
+        seconds = times[op][1]
+        print("Sectors %s: %d, %.1f sectors/s (%.1f kB/s)" % (name, sectors[op], sectors[op] / seconds, sectors[op] * BLOCK_SIZE / seconds / 1024))
+
+if not stats_after:
+    print("The stick doesn't report its performance counters (LOG SENSE page 0x30).")
+    exit(0)
+
+diff = dict((code, stats_after.get(code, 0) - stats_before.get(code, 0)) for code in stats_after)
+device_sectors = diff.get(0x0000, 0) + diff.get(0x0001, 0)
+print("")
+print("As measured by the stick (including the untimed reads of the written sectors):")
+print("  sectors read/written: %d / %d" % (diff.get(0x0000, 0), diff.get(0x0001, 0)))
+if device_sectors:
+    print("  ciphertext bytes over SPI per sector: %.1f" % (float(diff.get(0x0002, 0) + diff.get(0x0003, 0)) / device_sectors))
+    print("  waiting for the card per sector: %.1f us" % (float(diff.get(0x0004, 0)) / device_sectors))
+    print("  AES per sector (started/waited for): %.1f us" % (float(diff.get(0x0005, 0)) / device_sectors))
+    print("  console/keyboard servicing per sector: %.1f us (%d times)" % (float(diff.get(0x0006, 0)) / device_sectors, diff.get(0x0007, 0)))
+print("  cache hits/misses: %d / %d" % (diff.get(0x0030, 0), diff.get(0x0031, 0)))
+print("  per-sector latency since power up, read min/avg/max: %d / %d / %d us" % (stats_after.get(0x0010, 0), stats_after.get(0x0011, 0), stats_after.get(0x0012, 0)))
+print("  per-sector latency since power up, write min/avg/max: %d / %d / %d us" % (stats_after.get(0x0020, 0), stats_after.get(0x0021, 0), stats_after.get(0x0022, 0)))
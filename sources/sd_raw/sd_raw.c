@@ -19,6 +19,8 @@
 #include <string.h>
 #include <avr/io.h>
 #include "sd_raw.h"
+#include "../Timer.h"
+#include "../DiskStats/DiskStats.h"
 
 /**
  * \addtogroup sd_raw_config MMC/SD configuration
@@ -126,6 +128,10 @@
 #define DR_STATUS_CRC_ERR 0x0a
 #define DR_STATUS_WRITE_ERR 0x0c
 
+/* the data start token of a block read, and the longest wait for it (100ms, the SD spec's read timeout) */
+#define DATA_START_BLOCK 0xfe
+#define READ_TIMEOUT_TICKS (100000UL / TIMER_TICK_MICROS)
+
 /* status bits for card types */
 #define SD_RAW_SPEC_1 0
 #define SD_RAW_SPEC_2 1
@@ -133,10 +139,18 @@
 
 /* card type state */
 static uint8_t sd_raw_card_type;
+/* is the card (possibly) still programming a block written by sd_raw_write_block_end()? */
+static uint8_t sd_raw_write_pending;
+/* bytes of the block being read (see sd_raw_read_block_begin()) still to come; 0 if none is */
+static uint16_t sd_raw_read_left;
+/* allocation unit sizes (in MB) of the sd status AU_SIZE codes 0xa..0xf */
+static const uint8_t sd_raw_au_sizes_mb[] = { 8, 12, 16, 24, 32, 64 };
 
 /* private helper functions */
 static uint8_t sd_raw_send_and_receive_byte(uint8_t b);
 static uint8_t sd_raw_send_command(uint8_t command, uint32_t arg);
+static void sd_raw_wait_while_busy(void);
+static uint8_t sd_raw_wait_data_block(void);
 
 /**
  * \ingroup sd_raw
@@ -181,6 +195,7 @@ uint8_t sd_raw_init()
 
   /* initialization procedure */
   sd_raw_card_type = 0;
+  sd_raw_write_pending = 0;
 
   if(!sd_raw_available())
     return 0;
@@ -412,6 +427,32 @@ uint8_t sd_raw_send_command(uint8_t command, uint32_t arg)
  */
 uint8_t sd_raw_read_block(offset_t block, uint8_t buffer[SD_BLOCK_SIZE])
 {
+  if(!sd_raw_read_block_begin(block))
+    return 0;
+
+  sd_raw_read_block_chunk(buffer, SD_BLOCK_SIZE);
+  return sd_raw_read_block_end();
+}
+
+/**
+ * \ingroup sd_raw
+ * Starts reading a block of raw data from the card.
+ *
+ * Sends the read request and waits for the data start token. The
+ * block's data is then to be fetched with (repeated) calls to
+ * sd_raw_read_block_chunk() (SD_BLOCK_SIZE bytes altogether), and the
+ * read finished with sd_raw_read_block_end(). The card stays selected
+ * in between, so other (non-SPI) work can be done between the calls.
+ *
+ * \param[in] block The block which to read.
+ * \returns 0 on failure (the card refused the request, sent an error
+ *          token or nothing at all; it's unselected then), 1 on success.
+ */
+uint8_t sd_raw_read_block_begin(offset_t block)
+{
+  /* finish a previous write */
+  sd_raw_wait_while_busy();
+
   /* address card */
   select_card();
 
@@ -426,14 +467,78 @@ uint8_t sd_raw_read_block(offset_t block, uint8_t buffer[SD_BLOCK_SIZE])
       return 0;
   }
 
-  /* wait for data block (start byte 0xfe) */
-  while(sd_raw_send_and_receive_byte(0xFF) != 0xfe);
+  /* wait for data block */
+  uint32_t wait_start = timer_ticks();
+  uint8_t started = sd_raw_wait_data_block();
+  DiskStats_AddTime(&DiskStats.SdBusyMicros, wait_start);
+
+  if(!started)
+  {
+      unselect_card();
+      return 0;
+  }
+
+  sd_raw_read_left = SD_BLOCK_SIZE;
+  return 1;
+}
+
+/**
+ * \ingroup sd_raw
+ * Waits for the start of a data block sent by the card.
+ *
+ * Gives up after READ_TIMEOUT_TICKS, or when the card sends an error
+ * token (anything else but 0xff before the start byte 0xfe).
+ *
+ * \returns 0 on failure, 1 when the data block follows.
+ */
+uint8_t sd_raw_wait_data_block(void)
+{
+  uint32_t wait_start = timer_ticks();
+  uint8_t token;
+  while((token = sd_raw_send_and_receive_byte(0xFF)) == 0xff &&
+        (timer_ticks() - wait_start) < READ_TIMEOUT_TICKS);
+
+  return token == DATA_START_BLOCK;
+}
+
+/**
+ * \ingroup sd_raw
+ * Reads the next part of a block started with sd_raw_read_block_begin().
+ *
+ * \param[out] buffer The buffer into which to write the data.
+ * \param[in] length Number of bytes to read.
+ * \returns 0 if no block is being read or it has less than "length"
+ *          bytes left (nothing is read then), 1 on success.
+ */
+uint8_t sd_raw_read_block_chunk(uint8_t* buffer, uint16_t length)
+{
+  if(length > sd_raw_read_left)
+    return 0;
+  sd_raw_read_left -= length;
 
   /* read byte block */
   uint8_t* cache = buffer;
-  for(uint16_t i = 0; i < SD_BLOCK_SIZE; ++i)
+  for(uint16_t i = 0; i < length; ++i)
       *cache++ = sd_raw_send_and_receive_byte(0xFF);
 
+  return 1;
+}
+
+/**
+ * \ingroup sd_raw
+ * Finishes reading a block started with sd_raw_read_block_begin(); the
+ * part of it that wasn't read (if any) is skipped.
+ *
+ * \returns 0 if the block wasn't read completely, 1 on success.
+ */
+uint8_t sd_raw_read_block_end(void)
+{
+  uint8_t complete = (sd_raw_read_left == 0);
+
+  /* skip the rest of the block */
+  for(; sd_raw_read_left; --sd_raw_read_left)
+      sd_raw_send_and_receive_byte(0xFF);
+
   /* read crc16 */
   sd_raw_send_and_receive_byte(0xFF);
   sd_raw_send_and_receive_byte(0xFF);
@@ -444,7 +549,7 @@ uint8_t sd_raw_read_block(offset_t block, uint8_t buffer[SD_BLOCK_SIZE])
   /* let card some time to finish */
   sd_raw_send_and_receive_byte(0xFF);
 
-  return 1;
+  return complete;
 }
 
 /**
@@ -456,10 +561,40 @@ uint8_t sd_raw_read_block(offset_t block, uint8_t buffer[SD_BLOCK_SIZE])
  * \returns 0 on failure, 1 on success.
  */
 uint8_t sd_raw_write_block(offset_t block, const uint8_t buffer[SD_BLOCK_SIZE])
+{
+  if(!sd_raw_write_block_begin(block))
+    return 0;
+
+  sd_raw_write_block_chunk(buffer, SD_BLOCK_SIZE);
+  if(!sd_raw_write_block_end())
+    return 0;
+
+  /* wait while card is busy */
+  sd_raw_wait_while_busy();
+
+  return 1;
+}
+
+/**
+ * \ingroup sd_raw
+ * Starts writing a block of raw data to the card.
+ *
+ * Sends the write request and the data start token. The block's data
+ * is then to be sent with (repeated) calls to sd_raw_write_block_chunk()
+ * (SD_BLOCK_SIZE bytes altogether), and the write finished with
+ * sd_raw_write_block_end().
+ *
+ * \param[in] block The block which to write.
+ * \returns 0 on failure (card is unselected then), 1 on success.
+ */
+uint8_t sd_raw_write_block_begin(offset_t block)
 {
   if(sd_raw_locked())
     return 0;
 
+  /* finish a previous write */
+  sd_raw_wait_while_busy();
+
   /* address card */
   select_card();
 
@@ -477,21 +612,145 @@ uint8_t sd_raw_write_block(offset_t block, const uint8_t buffer[SD_BLOCK_SIZE])
   /* send start byte */
   sd_raw_send_and_receive_byte(0xfe);
 
+  return 1;
+}
+
+/**
+ * \ingroup sd_raw
+ * Sends the next part of a block started with sd_raw_write_block_begin().
+ *
+ * \param[in] buffer The buffer containing the data to be written.
+ * \param[in] length Number of bytes to send.
+ */
+void sd_raw_write_block_chunk(const uint8_t* buffer, uint16_t length)
+{
   /* write byte block */
   const uint8_t* cache = buffer;
-  for(uint16_t i = 0; i < SD_BLOCK_SIZE; ++i)
+  for(uint16_t i = 0; i < length; ++i)
     sd_raw_send_and_receive_byte(*cache++);
+}
 
+/**
+ * \ingroup sd_raw
+ * Finishes sending a block started with sd_raw_write_block_begin().
+ *
+ * Does not wait for the card to program the block: the card is
+ * unselected and sd_raw_busy() tells when it's done. The next
+ * read/write waits for that automatically.
+ *
+ * \returns 0 if the card rejected the data, 1 on success.
+ */
+uint8_t sd_raw_write_block_end(void)
+{
   /* write dummy crc16 */
   sd_raw_send_and_receive_byte(0xff);
   sd_raw_send_and_receive_byte(0xff);
 
-  /* wait while card is busy */
-  while(sd_raw_send_and_receive_byte(0xFF) != 0xff);
-  sd_raw_send_and_receive_byte(0xFF);
+  /* check the data response token */
+  uint8_t response = sd_raw_send_and_receive_byte(0xFF);
 
-  /* deaddress card */
+  /* deaddress card; it keeps on programming */
   unselect_card();
+  sd_raw_write_pending = 1;
+
+  return (response & 0x1f) == DR_STATUS_ACCEPTED;
+}
+
+/**
+ * \ingroup sd_raw
+ * Checks whether the card is still busy programming a written block.
+ *
+ * Polls the card once, so it can be used to wait for the card in
+ * between other work.
+ *
+ * \returns 1 if the card is busy, 0 if it is ready.
+ */
+uint8_t sd_raw_busy(void)
+{
+  if(!sd_raw_write_pending)
+    return 0;
+
+  select_card();
+  uint8_t busy = (sd_raw_send_and_receive_byte(0xFF) != 0xff);
+  unselect_card();
+
+  if(!busy)
+  {
+    sd_raw_send_and_receive_byte(0xFF);
+    sd_raw_write_pending = 0;
+  }
+
+  return busy;
+}
+
+/**
+ * \ingroup sd_raw
+ * Waits until the card is done programming a written block (or erasing).
+ *
+ * The time spent waiting is accounted in the performance counters.
+ */
+void sd_raw_wait_while_busy(void)
+{
+  if(!sd_raw_write_pending)
+    return;
+
+  uint32_t wait_start = timer_ticks();
+  while(sd_raw_busy());
+  DiskStats_AddTime(&DiskStats.SdBusyMicros, wait_start);
+}
+
+/**
+ * \ingroup sd_raw
+ * Erases a range of blocks on the card.
+ *
+ * Tags the first and the last block (CMD32/CMD33) and issues the
+ * erase (CMD38). Does not wait for the card to finish erasing, just
+ * like sd_raw_write_block_end(): sd_raw_busy() tells when it's done.
+ * The erased blocks read back as all zeros or all ones, depending on
+ * the card. Sd cards only: MMC cards tag the range with CMD35/CMD36
+ * (see the flag_erase of sd_raw_get_info()), this fails on them.
+ *
+ * \param[in] block The first block to erase.
+ * \param[in] count The number of blocks to erase.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t sd_raw_erase(offset_t block, uint32_t count)
+{
+  offset_t last_block = block + count - 1;
+
+  if(count == 0)
+    return 1;
+  if(sd_raw_locked() || !(sd_raw_card_type & ((1 << SD_RAW_SPEC_1) | (1 << SD_RAW_SPEC_2))))
+    return 0;
+
+  /* finish a previous write/erase */
+  sd_raw_wait_while_busy();
+
+  /* address card */
+  select_card();
+
+  /* tag the range, then erase it */
+#if SD_RAW_SDHC
+  if(!(sd_raw_card_type & (1 << SD_RAW_SPEC_SDHC)))
+  {
+    block *= SD_BLOCK_SIZE;
+    last_block *= SD_BLOCK_SIZE;
+  }
+#else
+  block *= SD_BLOCK_SIZE;
+  last_block *= SD_BLOCK_SIZE;
+#endif
+  if(sd_raw_send_command(CMD_TAG_SECTOR_START, block) ||
+     sd_raw_send_command(CMD_TAG_SECTOR_END, last_block) ||
+     sd_raw_send_command(CMD_ERASE, 0))
+  {
+    unselect_card();
+    return 0;
+  }
+
+  /* deaddress card; it keeps on erasing */
+  unselect_card();
+  sd_raw_write_pending = 1;
 
   return 1;
 }
@@ -575,6 +834,7 @@ uint8_t sd_raw_get_info(struct sd_raw_info* info)
   uint32_t csd_c_size = 0;
 #endif
   uint8_t csd_structure = 0;
+  uint8_t csd_sector_size = 0;
   if(sd_raw_send_command(CMD_SEND_CSD, 0))
   {
     unselect_card();
@@ -585,6 +845,12 @@ uint8_t sd_raw_get_info(struct sd_raw_info* info)
   {
     uint8_t b = sd_raw_send_and_receive_byte(0xFF);
 
+    /* erase sector size, the same for both csd versions */
+    if(i == 10)
+      csd_sector_size = (b & 0x3f) << 1;
+    else if(i == 11)
+      csd_sector_size |= b >> 7;
+
     if(i == 0)
     {
       csd_structure = b >> 6;
@@ -653,6 +919,40 @@ uint8_t sd_raw_get_info(struct sd_raw_info* info)
       }
     }
   }
+  info->erase_size = (uint32_t) csd_sector_size + 1;
+
+  /* read the allocation unit size from the sd status (sd cards only, as is erasing) */
+  if(sd_raw_card_type & ((1 << SD_RAW_SPEC_1) | (1 << SD_RAW_SPEC_2)))
+  {
+    info->flag_erase = 1;
+
+    sd_raw_send_command(CMD_APP, 0);
+    if(sd_raw_send_command(CMD_SEND_STATUS, 0) == 0)
+    {
+      /* second byte of the r2 response */
+      sd_raw_send_and_receive_byte(0xFF);
+
+      /* no sd status in time: keep the erase size from the csd */
+      if(sd_raw_wait_data_block())
+      {
+        uint8_t au_size = 0;
+
+        for(uint8_t i = 0; i < 66; ++i)
+        {
+          uint8_t b = sd_raw_send_and_receive_byte(0xFF);
+
+          if(i == 10)
+            au_size = b >> 4;
+        }
+
+        /* 16kB, 32kB, ... 4MB; then 8MB, 12MB, 16MB, 24MB, 32MB, 64MB */
+        if(au_size >= 1 && au_size <= 9)
+          info->erase_size = (uint32_t) 32 << (au_size - 1);
+        else if(au_size >= 10)
+          info->erase_size = (uint32_t) sd_raw_au_sizes_mb[au_size - 10] * 2048;
+      }
+    }
+  }
 
   unselect_card();
 
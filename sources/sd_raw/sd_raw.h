@@ -113,6 +113,13 @@ struct sd_raw_info
      *       state of the card's mechanical write-protect switch.
      */
     uint8_t flag_write_protect_temp;
+    /**
+     * Defines wether the card's blocks can be erased with sd_raw_erase().
+     *
+     * A value of \c 1 means they can. MMC cards can't: they tag the
+     * range to erase with other commands than sd cards.
+     */
+    uint8_t flag_erase;
     /**
      * The card's data layout.
      *
@@ -121,6 +128,14 @@ struct sd_raw_info
      * \note This value is not guaranteed to match reality.
      */
     uint8_t format;
+    /**
+     * The card's allocation unit (or erase sector, if the card doesn't
+     * tell the former) in blocks; 0 if unknown.
+     *
+     * Writes that are aligned to and fill whole allocation units are
+     * the fastest ones for the card.
+     */
+    uint32_t erase_size;
 };
 
 uint8_t sd_raw_init(void);
@@ -128,7 +143,15 @@ uint8_t sd_raw_available(void);
 uint8_t sd_raw_locked(void);
 
 uint8_t sd_raw_read_block(offset_t block, uint8_t buffer[SD_BLOCK_SIZE]);
+uint8_t sd_raw_read_block_begin(offset_t block);
+uint8_t sd_raw_read_block_chunk(uint8_t* buffer, uint16_t length);
+uint8_t sd_raw_read_block_end(void);
 uint8_t sd_raw_write_block(offset_t block, const uint8_t buffer[SD_BLOCK_SIZE]);
+uint8_t sd_raw_write_block_begin(offset_t block);
+void sd_raw_write_block_chunk(const uint8_t* buffer, uint16_t length);
+uint8_t sd_raw_write_block_end(void);
+uint8_t sd_raw_busy(void);
+uint8_t sd_raw_erase(offset_t block, uint32_t count);
 
 uint8_t sd_raw_get_info(struct sd_raw_info* info);
 